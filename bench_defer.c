@@ -0,0 +1,1302 @@
+// Runtime microbenchmarks for defer.h.
+//
+// Every scenario exists twice: once written with S_ _S scopes and defer, and
+// once as the hand-written goto cleanup ladder the README suggests rewriting
+// hot functions into. The same source is built once per backend by
+// `make bench`, and each binary prints one JSON object to stdout (the timing
+// and reporting live in bench_harness.h, shared with bench_defer.cpp).
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "bench_harness.h"
+#if defined(__GNUC__) && !defined(USE_C99_DEFER) && !defined(__PCC__)
+#undef USE_MACRO_STACK
+#endif
+// The Makefile force-includes a stack sized for this file (-include), the
+// shared macro_stack.h is for building by hand
+#if defined(USE_MACRO_STACK) && !defined(SCOPE_MACRO_STACK_AVAILABLE)
+#include "macro_stack.h"
+#endif // USE_MACRO_STACK
+#include "defer.h"
+
+// defer_alloc.h allocates through the harness too, so its trips to the
+// allocator show up in mallocs_per_op.
+#define DEFER_ALLOC_MALLOC bench_malloc
+#define DEFER_ALLOC_FREE bench_free
+#include "defer_alloc.h"
+#include "defer_coro.h"
+#include "defer_thread.h"
+#include "defer_lock.h"
+// defer_io.h's batches count their trips to the kernel too
+#define DEFER_IO_SYSCALL bench_syscall
+#include "defer_io.h"
+// Pools are used from several threads at once, which count their own mallocs
+// and add them to bench_mallocs once they're joined
+static __thread unsigned long churn_mallocs = 0;
+
+BENCH_NOINLINE static void* churn_malloc(size_t size) {
+    churn_mallocs++;
+    return malloc(size);
+}
+
+#define DEFER_POOL_MALLOC churn_malloc
+#include "defer_pool.h"
+#include "defer_ref.h"
+
+// The scenarios are written with the uppercase keywords so the same source
+// works under DONT_REDEFINE_KEYWORDS. Everywhere else the plain keywords are
+// already defer aware (or don't need to be, in GNU C).
+#ifndef RETURN
+#define RETURN return
+#define RETURNERR returnerr
+#define BREAK break
+#define CONTINUE continue
+#define FOR for
+#define DO do
+#define WHILE while
+#define SWITCH switch
+#endif
+
+#if defined(DEFER_BENCH_BACKEND)
+#define BENCH_BACKEND DEFER_BENCH_BACKEND
+#elif defined(DONT_REDEFINE_KEYWORDS)
+#define BENCH_BACKEND (USING_GNUC_DEFER ? "gnu-nokw" : "c99-nokw")
+#else
+#define BENCH_BACKEND (USING_GNUC_DEFER ? "gnu" : USING_TLS_DEFER ? "c99-tls" : \
+    USING_MACRO_STACK ? "c99-macro" : USING_SCOPE_ENUM ? "c99-scope" : "c99")
+#endif
+
+static void cleanup_add(void* ptr) {
+    int* val = (int*)ptr;
+    bench_sink += (unsigned long)*val;
+}
+
+static void release_add(int* val) {
+    bench_sink += (unsigned long)*val;
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: defer/errdefer registration on a success path
+// ---------------------------------------------------------------------------
+
+BENCH_NOINLINE int register_defer(int n) S_
+    int a = n;
+    defer(cleanup_add, a);
+    int b = n + 1;
+    defer(cleanup_add, b);
+    int c = n + 2;
+    errdefer(cleanup_add, c);
+    int d = n + 3;
+    errdefer(cleanup_add, d);
+    RETURN a + b;
+_S
+
+BENCH_NOINLINE int register_goto(int n) {
+    int a = n;
+    int b = n + 1;
+    int c = n + 2;
+    int d = n + 3;
+    int ret = a + b;
+    (void)c;
+    (void)d;
+    release_add(&b);
+    release_add(&a);
+    return ret;
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: constructor style scopes, one defer and 1, 8 or 64 errdefers that
+// never fire because the function succeeds
+// ---------------------------------------------------------------------------
+
+#define ERRDEFERS_1(var) errdefer(cleanup_add, var);
+#define ERRDEFERS_8(var) ERRDEFERS_1(var) ERRDEFERS_1(var) ERRDEFERS_1(var) ERRDEFERS_1(var) \
+    ERRDEFERS_1(var) ERRDEFERS_1(var) ERRDEFERS_1(var) ERRDEFERS_1(var)
+#define ERRDEFERS_64(var) ERRDEFERS_8(var) ERRDEFERS_8(var) ERRDEFERS_8(var) ERRDEFERS_8(var) \
+    ERRDEFERS_8(var) ERRDEFERS_8(var) ERRDEFERS_8(var) ERRDEFERS_8(var)
+
+#define ERRDEFER_SCENARIO(count) \
+    BENCH_NOINLINE int errdefer_##count##_defer(int n) S_ \
+        int a = n; \
+        defer(cleanup_add, a); \
+        int b = n + 1; \
+        ERRDEFERS_##count(b) \
+        RETURN a + b; \
+    _S \
+    BENCH_NOINLINE int errdefer_##count##_goto(int n) { \
+        int a = n; \
+        int b = n + 1; \
+        int ret = a + b; \
+        (void)b; \
+        release_add(&a); \
+        return ret; \
+    }
+
+ERRDEFER_SCENARIO(1)
+ERRDEFER_SCENARIO(8)
+ERRDEFER_SCENARIO(64)
+
+// ---------------------------------------------------------------------------
+// Scenario: return through three nested scopes
+// ---------------------------------------------------------------------------
+
+BENCH_NOINLINE int nested_return_defer(int n) S_
+    int a = n;
+    defer(cleanup_add, a);
+    S_
+        int b = n * 2;
+        defer(cleanup_add, b);
+        S_
+            int c = n * 3;
+            defer(cleanup_add, c);
+            if (n >= 0) {
+                RETURN c;
+            }
+        _S
+    _S
+    RETURN 0;
+_S
+
+BENCH_NOINLINE int nested_return_goto(int n) {
+    int ret = 0;
+    int a = n;
+    int b = n * 2;
+    int c = n * 3;
+    if (n >= 0) {
+        ret = c;
+        goto cleanup;
+    }
+cleanup:
+    release_add(&c);
+    release_add(&b);
+    release_add(&a);
+    return ret;
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: break/continue out of a scoped loop body
+// ---------------------------------------------------------------------------
+
+BENCH_NOINLINE int loop_defer(int n) S_
+    int total = 0;
+    int i;
+    FOR (i = 0; i < 16; i++) S_
+        int x = i + n;
+        defer(cleanup_add, x);
+        if (i == 12) {
+            BREAK;
+        }
+        if (i & 1) {
+            CONTINUE;
+        }
+        total += x;
+    _S
+    RETURN total;
+_S
+
+BENCH_NOINLINE int loop_goto(int n) {
+    int total = 0;
+    int i;
+    for (i = 0; i < 16; i++) {
+        int x = i + n;
+        if (i == 12) {
+            release_add(&x);
+            break;
+        }
+        if (i & 1) {
+            goto next;
+        }
+        total += x;
+next:
+        release_add(&x);
+    }
+    return total;
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: leave two nested scoped loops at once, with break_to, with the
+// flag-checking loops break_to replaces, and as a goto ladder
+// ---------------------------------------------------------------------------
+
+#define EXIT_ROWS 8
+
+BENCH_NOINLINE int multi_exit_break_to(int n) S_
+    int found = -1;
+    int r;
+    S_LABEL(search)
+        FOR (r = 0; r < EXIT_ROWS; r++) S_
+            int row = r + n;
+            defer(cleanup_add, row);
+            int c;
+            FOR (c = 0; c < EXIT_ROWS; c++) S_
+                int cell = row * EXIT_ROWS + c;
+                defer(cleanup_add, cell);
+                if (r == 5 && c == 3) {
+                    found = cell;
+                    break_to(search);
+                }
+            _S
+        _S
+    _S_LABEL(search)
+    RETURN found;
+_S
+
+BENCH_NOINLINE int multi_exit_flag(int n) S_
+    int found = -1;
+    int r;
+    FOR (r = 0; r < EXIT_ROWS && found < 0; r++) S_
+        int row = r + n;
+        defer(cleanup_add, row);
+        int c;
+        FOR (c = 0; c < EXIT_ROWS; c++) S_
+            int cell = row * EXIT_ROWS + c;
+            defer(cleanup_add, cell);
+            if (r == 5 && c == 3) {
+                found = cell;
+                BREAK;
+            }
+        _S
+    _S
+    RETURN found;
+_S
+
+BENCH_NOINLINE int multi_exit_goto(int n) {
+    int found = -1;
+    int r;
+    for (r = 0; r < EXIT_ROWS; r++) {
+        int row = r + n;
+        int c;
+        for (c = 0; c < EXIT_ROWS; c++) {
+            int cell = row * EXIT_ROWS + c;
+            if (r == 5 && c == 3) {
+                found = cell;
+                release_add(&cell);
+                release_add(&row);
+                goto out;
+            }
+            release_add(&cell);
+        }
+        release_add(&row);
+    }
+out:
+    return found;
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: switch heavy code (the Duff's device from the test suite)
+// ---------------------------------------------------------------------------
+
+static int duff_src[37];
+static int duff_dst[37];
+
+BENCH_NOINLINE void duff_defer(int* from, int* to, size_t count) S_
+    int outer = 1;
+    defer(cleanup_add, outer);
+
+    if (count == 0) {
+        RETURN;
+    }
+    size_t n = (count + 7) / 8;
+    SWITCH (count % 8) {
+        case 0: DO {
+                *to++ = *from++; FALLTHROUGH;
+        case 7:      *to++ = *from++; FALLTHROUGH;
+        case 6:      *to++ = *from++; FALLTHROUGH;
+        case 5:      *to++ = *from++; FALLTHROUGH;
+        case 4:      *to++ = *from++; FALLTHROUGH;
+        case 3:      *to++ = *from++; FALLTHROUGH;
+        case 2:      *to++ = *from++; FALLTHROUGH;
+        case 1:      *to++ = *from++;
+        } WHILE (--n > 0);
+    }
+_S
+
+BENCH_NOINLINE void duff_goto(int* from, int* to, size_t count) {
+    int outer = 1;
+    if (count == 0) {
+        goto cleanup;
+    }
+    size_t n = (count + 7) / 8;
+    switch (count % 8) {
+        case 0: do {
+                *to++ = *from++; FALLTHROUGH;
+        case 7:      *to++ = *from++; FALLTHROUGH;
+        case 6:      *to++ = *from++; FALLTHROUGH;
+        case 5:      *to++ = *from++; FALLTHROUGH;
+        case 4:      *to++ = *from++; FALLTHROUGH;
+        case 3:      *to++ = *from++; FALLTHROUGH;
+        case 2:      *to++ = *from++; FALLTHROUGH;
+        case 1:      *to++ = *from++;
+        } while (--n > 0);
+    }
+cleanup:
+    release_add(&outer);
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: a dozen short lived temporaries, malloc + defer(free) per buffer
+// against one S_ARENA rewind
+// ---------------------------------------------------------------------------
+
+#define TEMPORARIES 12
+
+static void free_ptr(void* ptr) {
+    bench_free(*(void**)ptr);
+}
+
+// Out of line so the compiler can't pair up and drop malloc/free
+BENCH_NOINLINE int touch_buf(char* buf, int value) {
+    buf[0] = (char)value;
+    return buf[0];
+}
+
+BENCH_NOINLINE int temporaries_defer(int n) S_
+    int total = 0;
+    for (int i = 0; i < TEMPORARIES; i++) S_
+        char* buf = (char*)bench_malloc(64 + (size_t)i);
+        defer(free_ptr, buf);
+        total += touch_buf(buf, n + i);
+    _S
+    RETURN total;
+_S
+
+BENCH_NOINLINE int temporaries_arena(int n) S_ARENA
+    int total = 0;
+    for (int i = 0; i < TEMPORARIES; i++) {
+        char* buf = (char*)arena_alloc(64 + (size_t)i);
+        total += touch_buf(buf, n + i);
+    }
+    RETURN total;
+_S
+
+BENCH_NOINLINE int temporaries_goto(int n) {
+    int total = 0;
+    for (int i = 0; i < TEMPORARIES; i++) {
+        char* buf = (char*)bench_malloc(64 + (size_t)i);
+        total += touch_buf(buf, n + i);
+        bench_free(buf);
+    }
+    return total;
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: a request's worth of short lived buffers, mostly small with the
+// odd big one, against a 4 KiB scratchdecl that only spills the big ones
+// ---------------------------------------------------------------------------
+
+static const size_t scratch_sizes[] = { 48, 200, 1024, 96, 3000, 64, 512, 8000 };
+#define SCRATCH_BUFFERS (sizeof(scratch_sizes) / sizeof(scratch_sizes[0]))
+
+BENCH_NOINLINE int requests_defer(int n) S_
+    int total = 0;
+    for (size_t i = 0; i < SCRATCH_BUFFERS; i++) S_
+        char* buf = (char*)bench_malloc(scratch_sizes[i]);
+        defer(free_ptr, buf);
+        total += touch_buf(buf, n + (int)i);
+    _S
+    RETURN total;
+_S
+
+BENCH_NOINLINE int requests_scratch(int n) S_
+    scratchdecl(4096);
+    int total = 0;
+    for (size_t i = 0; i < SCRATCH_BUFFERS; i++) {
+        char* buf = (char*)scratch_alloc(scratch_sizes[i]);
+        total += touch_buf(buf, n + (int)i);
+    }
+    RETURN total;
+_S
+
+BENCH_NOINLINE int requests_goto(int n) {
+    int total = 0;
+    for (size_t i = 0; i < SCRATCH_BUFFERS; i++) {
+        char* buf = (char*)bench_malloc(scratch_sizes[i]);
+        total += touch_buf(buf, n + (int)i);
+        bench_free(buf);
+    }
+    return total;
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: sparse fan-out, 256 slots of which every 16th gets a buffer, freed
+// by a generic defer_each, by defer_free_each, or by a hand-written loop
+// ---------------------------------------------------------------------------
+
+#define FANOUT_SLOTS 256
+#define FANOUT_STRIDE 16
+
+static void free_slot(void* slot) {
+    bench_free(*(void**)slot);
+}
+
+BENCH_NOINLINE static void fanout_fill(void** slots, int n) {
+    memset(slots, 0, FANOUT_SLOTS * sizeof(*slots));
+    for (int i = n % FANOUT_STRIDE; i < FANOUT_SLOTS; i += FANOUT_STRIDE) {
+        slots[i] = bench_malloc(32);
+    }
+}
+
+BENCH_NOINLINE int fanout_each(int n) S_
+    void* slots[FANOUT_SLOTS];
+    defer_each(free_slot, slots, FANOUT_SLOTS);
+    fanout_fill(slots, n);
+    RETURN n;
+_S
+
+BENCH_NOINLINE int fanout_free_each(int n) S_
+    void* slots[FANOUT_SLOTS];
+    defer_free_each(slots, FANOUT_SLOTS);
+    fanout_fill(slots, n);
+    RETURN n;
+_S
+
+BENCH_NOINLINE int fanout_goto(int n) {
+    void* slots[FANOUT_SLOTS];
+    fanout_fill(slots, n);
+    for (int i = FANOUT_SLOTS - 1; i >= 0; i--) {
+        if (slots[i]) bench_free(slots[i]);
+    }
+    return n;
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: 16 suspended tasks stepped round-robin to completion, each
+// holding a buffer and a counter across two yields, with defer_coro.h defers
+// in the task frame or a hand-written state machine
+// ---------------------------------------------------------------------------
+
+#define CORO_TASKS 16
+
+typedef struct coro_bench_task {
+    defer_coro co;
+    int n;
+    int value;
+    char* buf;
+} coro_bench_task;
+
+static int coro_bench_step(coro_bench_task* t) {
+    CORO_BEGIN(&t->co);
+    t->buf = (char*)bench_malloc(64);
+    coro_defer(&t->co, free_ptr, t->buf);
+    CORO_YIELD(&t->co);
+    t->value = touch_buf(t->buf, t->n);
+    coro_defer(&t->co, cleanup_add, t->value);
+    CORO_YIELD(&t->co);
+    t->value += t->n;
+    CORO_END(&t->co);
+}
+
+BENCH_NOINLINE int coroutine_defer(int n) {
+    coro_bench_task tasks[CORO_TASKS];
+    memset(tasks, 0, sizeof(tasks));
+    int pending = CORO_TASKS;
+    for (int i = 0; i < CORO_TASKS; i++) tasks[i].n = n + i;
+    for (; pending; ) {
+        for (int i = 0; i < CORO_TASKS; i++) {
+            if (!defer_coro_done(&tasks[i].co) && coro_bench_step(&tasks[i]) == DEFER_CORO_DONE) pending--;
+        }
+    }
+    return n;
+}
+
+typedef struct machine_bench_task {
+    int state;
+    int n;
+    int value;
+    char* buf;
+} machine_bench_task;
+
+static int machine_bench_step(machine_bench_task* t) {
+    switch (t->state) {
+    case 0:
+        t->buf = (char*)bench_malloc(64);
+        t->state = 1;
+        return 1;
+    case 1:
+        t->value = touch_buf(t->buf, t->n);
+        t->state = 2;
+        return 1;
+    default:
+        t->value += t->n;
+        release_add(&t->value);
+        bench_free(t->buf);
+        t->state = 3;
+        return 0;
+    }
+}
+
+BENCH_NOINLINE int coroutine_goto(int n) {
+    machine_bench_task tasks[CORO_TASKS];
+    memset(tasks, 0, sizeof(tasks));
+    int pending = CORO_TASKS;
+    for (int i = 0; i < CORO_TASKS; i++) tasks[i].n = n + i;
+    for (; pending; ) {
+        for (int i = 0; i < CORO_TASKS; i++) {
+            if (tasks[i].state != 3 && machine_bench_step(&tasks[i]) == 0) pending--;
+        }
+    }
+    return n;
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: spawn and join a thread that sets up 4 thread-local caches, torn
+// down at thread exit by defer_thread, by one pthread key destructor each, or
+// by hand before the thread function returns. Run 100x fewer times than the
+// others, so 10k threads per run with the default iteration count.
+// ---------------------------------------------------------------------------
+
+#define THREAD_CACHES 4
+#define THREAD_SCALE 100
+
+static _dfr_thread_local void* thread_caches[THREAD_CACHES];
+static pthread_key_t thread_keys[THREAD_CACHES];
+
+static void* thread_defer_body(void* arg) {
+    for (int i = 0; i < THREAD_CACHES; i++) {
+        thread_caches[i] = bench_malloc(64);
+    }
+    defer_thread(free_ptr, thread_caches[0]);
+    defer_thread(free_ptr, thread_caches[1]);
+    defer_thread(free_ptr, thread_caches[2]);
+    defer_thread(free_ptr, thread_caches[3]);
+    return arg;
+}
+
+static void* thread_key_body(void* arg) {
+    for (int i = 0; i < THREAD_CACHES; i++) {
+        thread_caches[i] = bench_malloc(64);
+        pthread_setspecific(thread_keys[i], thread_caches[i]);
+    }
+    return arg;
+}
+
+static void* thread_goto_body(void* arg) {
+    for (int i = 0; i < THREAD_CACHES; i++) {
+        thread_caches[i] = bench_malloc(64);
+    }
+    for (int i = THREAD_CACHES - 1; i >= 0; i--) {
+        bench_free(thread_caches[i]);
+    }
+    return arg;
+}
+
+static void thread_spawn(void* (*body)(void*)) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, body, NULL) != 0) {
+        fprintf(stderr, "bench: pthread_create failed\n");
+        exit(1);
+    }
+    pthread_join(thread, NULL);
+}
+
+static void thread_keys_create(void) {
+    for (int i = 0; i < THREAD_CACHES; i++) {
+        pthread_key_create(&thread_keys[i], bench_free);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: a critical section with an early return, uncontended. defer_lock
+// unlocks through a direct call, the defer variant through the usual void*
+// wrapper a cleanup function needs.
+// ---------------------------------------------------------------------------
+
+static pthread_mutex_t bench_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int bench_guarded[8];
+
+static void unlock_mutex(void* mutex) {
+    pthread_mutex_unlock((pthread_mutex_t*)mutex);
+}
+
+BENCH_NOINLINE int lock_defer_lock(int n) S_
+    defer_lock(bench_mutex);
+    if ((n & 7) == 0) {
+        RETURN -1;
+    }
+    bench_guarded[n & 7] += n;
+    RETURN bench_guarded[(n + 1) & 7];
+_S
+
+BENCH_NOINLINE int lock_defer(int n) S_
+    pthread_mutex_lock(&bench_mutex);
+    defer(unlock_mutex, bench_mutex);
+    if ((n & 7) == 0) {
+        RETURN -1;
+    }
+    bench_guarded[n & 7] += n;
+    RETURN bench_guarded[(n + 1) & 7];
+_S
+
+BENCH_NOINLINE int lock_goto(int n) {
+    int ret = -1;
+    pthread_mutex_lock(&bench_mutex);
+    if ((n & 7) == 0) {
+        goto out;
+    }
+    bench_guarded[n & 7] += n;
+    ret = bench_guarded[(n + 1) & 7];
+out:
+    pthread_mutex_unlock(&bench_mutex);
+    return ret;
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: a scope holding 10, 100 or 1000 fds (dups of /dev/null), closed
+// at scope exit by a defer_io.h batch, by defer_each with a close per fd, or
+// by a hand-written loop. In the _scattered scenarios the fds are registered
+// in a stride order instead of the order they were opened in, so the batch
+// can't close them as ranges and goes through io_uring. The dups are part of
+// every op, so syscalls_per_op is count plus what the exit costs. Run 10x
+// count fewer times than the others.
+// ---------------------------------------------------------------------------
+
+#define FDS_MAX 1000
+
+static int fds_base = -1;
+
+static void close_fd(void* fd) {
+    bench_syscall(SYS_close, *(int*)fd);
+}
+
+BENCH_NOINLINE static void fds_open(int* fds, int count, int stride) {
+    for (int i = 0; i < count; i++) {
+        fds[(i * stride) % count] = (int)bench_syscall(SYS_dup, fds_base);
+    }
+}
+
+BENCH_NOINLINE int fds_defer_close(int count, int stride) S_
+    int fds[FDS_MAX];
+    iobatchdecl(FDS_MAX);
+    fds_open(fds, count, stride);
+    FOR (int i = 0; i < count; i++) {
+        defer_close(fds[i]);
+    }
+    RETURN fds[0];
+_S
+
+BENCH_NOINLINE int fds_defer_each(int count, int stride) S_
+    int fds[FDS_MAX];
+    fds_open(fds, count, stride);
+    defer_each(close_fd, fds, count);
+    RETURN fds[0];
+_S
+
+BENCH_NOINLINE int fds_goto(int count, int stride) {
+    int fds[FDS_MAX];
+    fds_open(fds, count, stride);
+    int ret = fds[0];
+    for (int i = count - 1; i >= 0; i--) {
+        close_fd(&fds[i]);
+    }
+    return ret;
+}
+
+static void fds_setup(void) {
+    fds_base = open("/dev/null", O_RDONLY);
+    // Room for FDS_MAX more, where the soft limit is the usual 1024
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: request objects under multi-threaded churn. In pool_churn 4
+// threads each run a quarter of the ops, and every op borrows 4 256-byte
+// requests for the length of a scope, from a defer_pool.h pool or from
+// malloc with defer(free), or by hand. In pool_handoff every op is one request
+// made on the main thread and released on another: a pool object goes back
+// through its owner's return queue. ns/op is wall time over all threads.
+// ---------------------------------------------------------------------------
+
+#define CHURN_THREADS 4
+#define CHURN_OBJECTS 4
+#define HANDOFF_SLOTS 1024
+
+typedef struct churn_request {
+    int id;
+    char body[252];
+} churn_request;
+
+pooldef(churn_pool, churn_request);
+
+static unsigned long churn_total_mallocs = 0;
+
+static void churn_free(void* ptr) {
+    free(*(void**)ptr);
+}
+
+BENCH_NOINLINE static int churn_touch(churn_request* req, int value) {
+    req->id = value;
+    req->body[value & 127] = (char)value;
+    return req->id;
+}
+
+BENCH_NOINLINE int churn_pool_op(int n) S_
+    int total = 0;
+    FOR (int i = 0; i < CHURN_OBJECTS; i++) S_
+        churn_request* req = (churn_request*)pool_acquire(churn_pool);
+        defer_pool_release(req);
+        total += churn_touch(req, n + i);
+    _S
+    RETURN total;
+_S
+
+BENCH_NOINLINE int churn_malloc_op(int n) S_
+    int total = 0;
+    FOR (int i = 0; i < CHURN_OBJECTS; i++) S_
+        churn_request* req = (churn_request*)churn_malloc(sizeof(churn_request));
+        defer(churn_free, req);
+        total += churn_touch(req, n + i);
+    _S
+    RETURN total;
+_S
+
+BENCH_NOINLINE int churn_goto_op(int n) {
+    int total = 0;
+    for (int i = 0; i < CHURN_OBJECTS; i++) {
+        churn_request* req = (churn_request*)churn_malloc(sizeof(churn_request));
+        total += churn_touch(req, n + i);
+        free(req);
+    }
+    return total;
+}
+
+typedef struct churn_worker {
+    int (*op)(int);
+    long iterations;
+} churn_worker;
+
+static void* churn_worker_body(void* arg) {
+    churn_worker* worker = (churn_worker*)arg;
+    unsigned long sink = 0;
+    for (long i = 0; i < worker->iterations; i++) {
+        sink += (unsigned long)worker->op((int)i);
+    }
+    __atomic_add_fetch(&bench_sink, sink, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&churn_total_mallocs, churn_mallocs, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static void churn_run(int (*op)(int), long iterations) {
+    pthread_t threads[CHURN_THREADS];
+    churn_worker worker = { op, iterations / CHURN_THREADS };
+    churn_total_mallocs = 0;
+    for (int t = 0; t < CHURN_THREADS; t++) {
+        if (pthread_create(&threads[t], NULL, churn_worker_body, &worker) != 0) {
+            fprintf(stderr, "bench: pthread_create failed\n");
+            exit(1);
+        }
+    }
+    for (int t = 0; t < CHURN_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    bench_mallocs += churn_total_mallocs;
+}
+
+// Single producer, single consumer ring of requests, NULL ends the run
+typedef struct handoff_ring {
+    churn_request* slots[HANDOFF_SLOTS];
+    unsigned long head;  // written by the producer
+    unsigned long tail;  // written by the consumer
+    int pooled;
+} handoff_ring;
+
+static handoff_ring handoff;
+
+static void handoff_push(churn_request* req) {
+    unsigned long head = handoff.head;
+    for (; head - __atomic_load_n(&handoff.tail, __ATOMIC_ACQUIRE) == HANDOFF_SLOTS; ) {
+        sched_yield();
+    }
+    handoff.slots[head % HANDOFF_SLOTS] = req;
+    __atomic_store_n(&handoff.head, head + 1, __ATOMIC_RELEASE);
+}
+
+static churn_request* handoff_pop(void) {
+    unsigned long tail = handoff.tail;
+    for (; __atomic_load_n(&handoff.head, __ATOMIC_ACQUIRE) == tail; ) {
+        sched_yield();
+    }
+    churn_request* req = handoff.slots[tail % HANDOFF_SLOTS];
+    __atomic_store_n(&handoff.tail, tail + 1, __ATOMIC_RELEASE);
+    return req;
+}
+
+BENCH_NOINLINE int handoff_consume_pool(churn_request* req) S_
+    defer_pool_release(req);
+    int value = churn_touch(req, req->id + 1);
+    RETURN value;
+_S
+
+BENCH_NOINLINE int handoff_consume_malloc(churn_request* req) S_
+    defer(churn_free, req);
+    int value = churn_touch(req, req->id + 1);
+    RETURN value;
+_S
+
+static void* handoff_consumer(void* arg) {
+    unsigned long sink = 0;
+    for (churn_request* req; (req = handoff_pop()); ) {
+        sink += (unsigned long)(handoff.pooled ? handoff_consume_pool(req) : handoff_consume_malloc(req));
+    }
+    __atomic_add_fetch(&bench_sink, sink, __ATOMIC_RELAXED);
+    return arg;
+}
+
+static void handoff_run(int pooled, long iterations) {
+    pthread_t consumer;
+    handoff.pooled = pooled;
+    if (pthread_create(&consumer, NULL, handoff_consumer, NULL) != 0) {
+        fprintf(stderr, "bench: pthread_create failed\n");
+        exit(1);
+    }
+    unsigned long before = churn_mallocs;
+    for (long i = 0; i < iterations; i++) {
+        churn_request* req = (churn_request*)(pooled ? pool_acquire(churn_pool)
+                                                     : churn_malloc(sizeof(churn_request)));
+        churn_touch(req, (int)i);
+        handoff_push(req);
+    }
+    handoff_push(NULL);
+    pthread_join(consumer, NULL);
+    bench_mallocs += churn_mallocs - before;
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: 4 threads borrowing shared objects, as pool_churn runs them. Every
+// op takes 8 references, alternating between 2 objects, and counts each
+// borrow in a shared statistic. The references are dropped and the statistic
+// bumped at scope exit by a defer_ref.h batch (3 atomic adds, one per
+// counter), by defer_each with a drop per borrow (16), or by hand (16).
+// ---------------------------------------------------------------------------
+
+#define REF_BORROWS 8
+
+typedef struct ref_object {
+    int refs;
+    int id;
+    char pad[56];  // a cache line each
+} ref_object;
+
+static ref_object ref_objects[2] = { { 1, 0, {0} }, { 1, 1, {0} } };
+static struct {
+    long long borrows;
+    char pad[56];
+} ref_stats;
+
+// Never called, the objects keep a reference of their own
+static void ref_destroy(void* obj) {
+    bench_sink += (unsigned long)((ref_object*)obj)->id;
+}
+
+static void ref_drop(ref_object* obj) {
+    if (__atomic_sub_fetch(&obj->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        ref_destroy(obj);
+    }
+    __atomic_add_fetch(&ref_stats.borrows, 1, __ATOMIC_RELAXED);
+}
+
+static void ref_drop_deferred(void* obj) {
+    ref_drop(*(ref_object**)obj);
+}
+
+BENCH_NOINLINE static ref_object* ref_borrow(int i) {
+    ref_object* obj = &ref_objects[i & 1];
+    __atomic_add_fetch(&obj->refs, 1, __ATOMIC_RELAXED);
+    return obj;
+}
+
+BENCH_NOINLINE int refs_batch(int n) S_
+    int total = 0;
+    refbatchdecl(4);
+    FOR (int i = 0; i < REF_BORROWS; i++) {
+        ref_object* obj = ref_borrow(n + i);
+        defer_unref(&obj->refs, ref_destroy, obj);
+        defer_count(&ref_stats.borrows, 1);
+        total += obj->id;
+    }
+    RETURN total;
+_S
+
+BENCH_NOINLINE int refs_defer(int n) S_
+    ref_object* objs[REF_BORROWS];
+    int total = 0;
+    FOR (int i = 0; i < REF_BORROWS; i++) {
+        objs[i] = ref_borrow(n + i);
+        total += objs[i]->id;
+    }
+    defer_each(ref_drop_deferred, objs, REF_BORROWS);
+    RETURN total;
+_S
+
+BENCH_NOINLINE int refs_goto(int n) {
+    ref_object* objs[REF_BORROWS];
+    int total = 0;
+    for (int i = 0; i < REF_BORROWS; i++) {
+        objs[i] = ref_borrow(n + i);
+        total += objs[i]->id;
+    }
+    for (int i = REF_BORROWS - 1; i >= 0; i--) {
+        ref_drop(objs[i]);
+    }
+    return total;
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: shutting down with a large heap. A forked child builds 64 nested
+// levels of 1024 small blocks plus an index buffer (about 10 MB), each level
+// also holding a counter with an external effect, then unwinds and exits. The
+// fast_exit variant calls defer_fast_exit() first, so only the counters run.
+// One op is one child, from fork to reaped, so it includes building the heap
+// and tearing down the process; run 50000x fewer times than the others.
+// ---------------------------------------------------------------------------
+
+#define SHUTDOWN_LEVELS 64
+#define SHUTDOWN_BLOCKS 1024
+#define SHUTDOWN_SCALE 50000
+
+BENCH_NOINLINE static void shutdown_fill(void** blocks, int level) {
+    for (int i = 0; i < SHUTDOWN_BLOCKS; i++) {
+        blocks[i] = bench_malloc(32 + (size_t)((i * 7 + level) % 16) * 16);
+    }
+}
+
+BENCH_NOINLINE int shutdown_defer(int level, int fast) S_
+    void* blocks[SHUTDOWN_BLOCKS];
+    defer_free_each(blocks, SHUTDOWN_BLOCKS);
+    shutdown_fill(blocks, level);
+    char* index = (char*)bench_malloc(16384);
+    defer_mem(free_ptr, index);
+    int counter = touch_buf(index, level);
+    defer(cleanup_add, counter);
+    if (level > 0) {
+        RETURN shutdown_defer(level - 1, fast) + counter;
+    }
+    if (fast) {
+        defer_fast_exit();
+    }
+    RETURN counter;
+_S
+
+BENCH_NOINLINE int shutdown_goto(int level) {
+    void* blocks[SHUTDOWN_BLOCKS];
+    shutdown_fill(blocks, level);
+    char* index = (char*)bench_malloc(16384);
+    int counter = touch_buf(index, level);
+    int r = counter;
+    if (level > 0) {
+        r += shutdown_goto(level - 1);
+    }
+    release_add(&counter);
+    bench_free(index);
+    for (int i = SHUTDOWN_BLOCKS - 1; i >= 0; i--) {
+        bench_free(blocks[i]);
+    }
+    return r;
+}
+
+// variant: 0 defer, 1 fast_exit, 2 goto
+static void shutdown_child(int variant) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "bench: fork failed\n");
+        exit(1);
+    }
+    if (pid == 0) {
+        int r = variant == 2 ? shutdown_goto(SHUTDOWN_LEVELS - 1)
+                             : shutdown_defer(SHUTDOWN_LEVELS - 1, variant == 1);
+        _exit(r == -1);  // not exit(): no stdio flush or atexit dumps twice
+    }
+    int status;
+    waitpid(pid, &status, 0);
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: recursion with one defer per level
+// ---------------------------------------------------------------------------
+
+BENCH_NOINLINE void recurse_defer(int n) S_
+    int x = n;
+    defer(cleanup_add, x);
+    if (n > 0) {
+        recurse_defer(n - 1);
+    }
+_S
+
+BENCH_NOINLINE void recurse_goto(int n) {
+    int x = n;
+    if (n > 0) {
+        recurse_goto(n - 1);
+    }
+    release_add(&x);
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: deep recursion, two scopes and two defers per level
+//
+// This is the parser-like case where per-frame defer bookkeeping adds up. The
+// outermost and the deepest call record the address of the same local, which
+// gives the exact stack bytes used per call level.
+// ---------------------------------------------------------------------------
+
+#define DEEP_LEVELS 64
+
+static char* volatile deep_stack_top;
+static char* volatile deep_stack_bottom;
+
+BENCH_NOINLINE int deep_defer(int n) S_
+    int a = n;
+    defer(cleanup_add, a);
+    int r = 0;
+    S_
+        int b = n + 1;
+        defer(cleanup_add, b);
+        if (n > 0) {
+            if (n == DEEP_LEVELS) deep_stack_top = (char*)&b;
+            r = deep_defer(n - 1);
+        } else {
+            deep_stack_bottom = (char*)&b;
+        }
+    _S
+    RETURN r + a;
+_S
+
+BENCH_NOINLINE int deep_goto(int n) {
+    int a = n;
+    int r = 0;
+    int b = n + 1;
+    if (n > 0) {
+        if (n == DEEP_LEVELS) deep_stack_top = (char*)&b;
+        r = deep_goto(n - 1);
+    } else {
+        deep_stack_bottom = (char*)&b;
+    }
+    release_add(&b);
+    release_add(&a);
+    return r + a;
+}
+
+static double deep_stack_defer(void) {
+    deep_defer(DEEP_LEVELS);
+    return (double)(deep_stack_top - deep_stack_bottom) / DEEP_LEVELS;
+}
+
+static double deep_stack_goto(void) {
+    deep_goto(DEEP_LEVELS);
+    return (double)(deep_stack_top - deep_stack_bottom) / DEEP_LEVELS;
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: an interpreter-style error escape from 16 levels down, where
+// every 8th call fails at the bottom. Each level holds a defer and an
+// errdefer. The error either comes back up through a return code checked
+// with returnerr at every level, or jumps straight to the top with
+// defer_longjmp. Only built with DEFER_LONGJMP, which the other scenarios
+// then show the success path cost of.
+// ---------------------------------------------------------------------------
+
+#ifdef DEFER_LONGJMP
+#define ESCAPE_LEVELS 16
+
+BENCH_NOINLINE int escape_returnerr(int level, int fail) S_
+    int a = level;
+    defer(cleanup_add, a);
+    int b = level + 1;
+    errdefer(cleanup_add, b);
+    if (level == 0) {
+        if (fail) {
+            RETURNERR -1;
+        }
+        RETURN 0;
+    }
+    int r = escape_returnerr(level - 1, fail);
+    if (r < 0) {
+        RETURNERR r;
+    }
+    RETURN r + a;
+_S
+
+BENCH_NOINLINE int escape_dive(defer_jmp_buf* env, int level, int fail) S_
+    int a = level;
+    defer(cleanup_add, a);
+    int b = level + 1;
+    errdefer(cleanup_add, b);
+    if (level == 0) {
+        if (fail) {
+            defer_longjmp(*env, 1);
+        }
+        RETURN 0;
+    }
+    RETURN escape_dive(env, level - 1, fail) + a;
+_S
+
+BENCH_NOINLINE int escape_longjmp(int level, int fail) {
+    defer_jmp_buf env;
+    if (defer_setjmp(env)) {
+        return -1;
+    }
+    return escape_dive(&env, level, fail);
+}
+#endif // DEFER_LONGJMP
+
+// ---------------------------------------------------------------------------
+// Case table
+// ---------------------------------------------------------------------------
+
+static void run_register_defer(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)register_defer((int)_i)); }
+static void run_register_goto(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)register_goto((int)_i)); }
+static void run_errdefer_1_defer(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)errdefer_1_defer((int)_i)); }
+static void run_errdefer_1_goto(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)errdefer_1_goto((int)_i)); }
+static void run_errdefer_8_defer(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)errdefer_8_defer((int)_i)); }
+static void run_errdefer_8_goto(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)errdefer_8_goto((int)_i)); }
+static void run_errdefer_64_defer(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)errdefer_64_defer((int)_i)); }
+static void run_errdefer_64_goto(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)errdefer_64_goto((int)_i)); }
+static void run_nested_return_defer(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)nested_return_defer((int)_i)); }
+static void run_nested_return_goto(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)nested_return_goto((int)_i)); }
+static void run_loop_defer(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)loop_defer((int)_i)); }
+static void run_loop_goto(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)loop_goto((int)_i)); }
+static void run_multi_exit_break_to(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)multi_exit_break_to((int)_i)); }
+static void run_multi_exit_flag(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)multi_exit_flag((int)_i)); }
+static void run_multi_exit_goto(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)multi_exit_goto((int)_i)); }
+static void run_duff_defer(long iterations) { BENCH_LOOP(duff_defer(duff_src, duff_dst, 37)); }
+static void run_duff_goto(long iterations) { BENCH_LOOP(duff_goto(duff_src, duff_dst, 37)); }
+static void run_temporaries_defer(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)temporaries_defer((int)_i)); }
+static void run_temporaries_arena(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)temporaries_arena((int)_i)); }
+static void run_temporaries_goto(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)temporaries_goto((int)_i)); }
+static void run_requests_defer(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)requests_defer((int)_i)); }
+static void run_requests_scratch(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)requests_scratch((int)_i)); }
+static void run_requests_goto(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)requests_goto((int)_i)); }
+static void run_fanout_each(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)fanout_each((int)_i)); }
+static void run_fanout_free_each(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)fanout_free_each((int)_i)); }
+static void run_fanout_goto(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)fanout_goto((int)_i)); }
+static void run_coroutine_defer(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)coroutine_defer((int)_i)); }
+static void run_coroutine_goto(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)coroutine_goto((int)_i)); }
+static void run_thread_defer(long iterations) { BENCH_LOOP(thread_spawn(thread_defer_body)); }
+static void run_thread_key(long iterations) { BENCH_LOOP(thread_spawn(thread_key_body)); }
+static void run_thread_goto(long iterations) { BENCH_LOOP(thread_spawn(thread_goto_body)); }
+static void run_lock_defer_lock(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)lock_defer_lock((int)_i)); }
+static void run_lock_defer(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)lock_defer((int)_i)); }
+static void run_lock_goto(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)lock_goto((int)_i)); }
+#define FDS_RUNNERS(count, stride, name) \
+    static void run_##name##_defer_close(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)fds_defer_close(count, stride)); } \
+    static void run_##name##_defer_each(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)fds_defer_each(count, stride)); } \
+    static void run_##name##_goto(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)fds_goto(count, stride)); }
+FDS_RUNNERS(10, 1, fds_10)
+FDS_RUNNERS(100, 1, fds_100)
+FDS_RUNNERS(1000, 1, fds_1000)
+FDS_RUNNERS(10, 3, fds_10_scattered)
+FDS_RUNNERS(100, 37, fds_100_scattered)
+FDS_RUNNERS(1000, 37, fds_1000_scattered)
+static void run_churn_pool(long iterations) { churn_run(churn_pool_op, iterations); }
+static void run_churn_malloc(long iterations) { churn_run(churn_malloc_op, iterations); }
+static void run_churn_goto(long iterations) { churn_run(churn_goto_op, iterations); }
+static void run_handoff_pool(long iterations) { handoff_run(1, iterations); }
+static void run_handoff_malloc(long iterations) { handoff_run(0, iterations); }
+static void run_refs_batch(long iterations) { churn_run(refs_batch, iterations); }
+static void run_refs_defer(long iterations) { churn_run(refs_defer, iterations); }
+static void run_refs_goto(long iterations) { churn_run(refs_goto, iterations); }
+static void run_shutdown_defer(long iterations) { BENCH_LOOP(shutdown_child(0)); }
+static void run_shutdown_fast(long iterations) { BENCH_LOOP(shutdown_child(1)); }
+static void run_shutdown_goto(long iterations) { BENCH_LOOP(shutdown_child(2)); }
+static void run_recurse_defer(long iterations) { BENCH_LOOP(recurse_defer(8)); }
+static void run_recurse_goto(long iterations) { BENCH_LOOP(recurse_goto(8)); }
+static void run_deep_defer(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)deep_defer(DEEP_LEVELS)); }
+static void run_deep_goto(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)deep_goto(DEEP_LEVELS)); }
+#ifdef DEFER_LONGJMP
+static void run_escape_returnerr(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)escape_returnerr(ESCAPE_LEVELS, (_i & 7) == 0)); }
+static void run_escape_longjmp(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)escape_longjmp(ESCAPE_LEVELS, (_i & 7) == 0)); }
+#endif
+
+static const bench_case bench_cases[] = {
+    { "register",       "defer", run_register_defer },
+    { "register",       "goto",  run_register_goto },
+    { "errdefer_1",     "defer", run_errdefer_1_defer },
+    { "errdefer_1",     "goto",  run_errdefer_1_goto },
+    { "errdefer_8",     "defer", run_errdefer_8_defer },
+    { "errdefer_8",     "goto",  run_errdefer_8_goto },
+    { "errdefer_64",    "defer", run_errdefer_64_defer },
+    { "errdefer_64",    "goto",  run_errdefer_64_goto },
+    { "nested_return",  "defer", run_nested_return_defer },
+    { "nested_return",  "goto",  run_nested_return_goto },
+    { "break_continue", "defer", run_loop_defer },
+    { "break_continue", "goto",  run_loop_goto },
+    { "multi_exit",     "break_to", run_multi_exit_break_to },
+    { "multi_exit",     "flag",     run_multi_exit_flag },
+    { "multi_exit",     "goto",     run_multi_exit_goto },
+    { "duff_copy",      "defer", run_duff_defer },
+    { "duff_copy",      "goto",  run_duff_goto },
+    { "temporaries",    "defer", run_temporaries_defer },
+    { "temporaries",    "arena", run_temporaries_arena },
+    { "temporaries",    "goto",  run_temporaries_goto },
+    { "scratch",        "defer",   run_requests_defer },
+    { "scratch",        "scratch", run_requests_scratch },
+    { "scratch",        "goto",    run_requests_goto },
+    { "fanout",         "defer_each",      run_fanout_each },
+    { "fanout",         "defer_free_each", run_fanout_free_each },
+    { "fanout",         "goto",            run_fanout_goto },
+    { "coroutine",      "defer", run_coroutine_defer },
+    { "coroutine",      "goto",  run_coroutine_goto },
+    { "thread_exit",    "defer_thread", run_thread_defer, NULL, THREAD_SCALE },
+    { "thread_exit",    "pthread_key",  run_thread_key,   NULL, THREAD_SCALE },
+    { "thread_exit",    "goto",         run_thread_goto,  NULL, THREAD_SCALE },
+    { "lock",           "defer_lock", run_lock_defer_lock },
+    { "lock",           "defer",      run_lock_defer },
+    { "lock",           "goto",       run_lock_goto },
+#define FDS_CASES(count, name) \
+    { #name, "defer_close", run_##name##_defer_close, NULL, 10 * count }, \
+    { #name, "defer_each",  run_##name##_defer_each,  NULL, 10 * count }, \
+    { #name, "goto",        run_##name##_goto,        NULL, 10 * count },
+    FDS_CASES(10, fds_10)
+    FDS_CASES(100, fds_100)
+    FDS_CASES(1000, fds_1000)
+    FDS_CASES(10, fds_10_scattered)
+    FDS_CASES(100, fds_100_scattered)
+    FDS_CASES(1000, fds_1000_scattered)
+    { "pool_churn",     "pool",      run_churn_pool },
+    { "pool_churn",     "malloc",    run_churn_malloc },
+    { "pool_churn",     "goto",      run_churn_goto },
+    { "pool_handoff",   "pool",      run_handoff_pool },
+    { "pool_handoff",   "malloc",    run_handoff_malloc },
+    { "refs",           "defer_unref", run_refs_batch },
+    { "refs",           "defer",       run_refs_defer },
+    { "refs",           "goto",        run_refs_goto },
+    { "shutdown",       "defer",     run_shutdown_defer, NULL, SHUTDOWN_SCALE },
+    { "shutdown",       "fast_exit", run_shutdown_fast,  NULL, SHUTDOWN_SCALE },
+    { "shutdown",       "goto",      run_shutdown_goto,  NULL, SHUTDOWN_SCALE },
+    { "recursion",      "defer", run_recurse_defer },
+    { "recursion",      "goto",  run_recurse_goto },
+    { "deep_recursion", "defer", run_deep_defer, deep_stack_defer },
+    { "deep_recursion", "goto",  run_deep_goto,  deep_stack_goto },
+#ifdef DEFER_LONGJMP
+    { "error_escape",   "returnerr", run_escape_returnerr },
+    { "error_escape",   "longjmp",   run_escape_longjmp },
+#endif
+};
+
+#ifdef DEFER_TRACE
+// Events written to this thread's DEFER_TRACE ring so far
+static uint64_t trace_events(void) {
+    return _dfr_trace_self ? _dfr_trace_self->head : 0;
+}
+#endif
+
+int main(int argc, char** argv) {
+    for (int i = 0; i < 37; i++) duff_src[i] = i;
+    thread_keys_create();
+    fds_setup();
+
+#ifdef DEFER_TRACE
+    uint64_t (*events_fn)(void) = trace_events;
+#else
+    uint64_t (*events_fn)(void) = NULL;
+#endif
+    return bench_run(argc, argv, BENCH_BACKEND, bench_cases,
+                     sizeof(bench_cases) / sizeof(bench_cases[0]), events_fn);
+}
@@ -0,0 +1,336 @@
+// Runtime microbenchmarks for defer.hpp.
+//
+// The scenarios are the ones from bench_defer.c with the same names, so the
+// "c++" object lines up with the C backends in bench.json. Each exists three
+// times: with S_ _S scopes and defer.hpp guards, as the hand-written goto
+// cleanup ladder, and with std::unique_ptr and a custom deleter, the usual
+// C++ answer when there's no scope guard at hand. Errdefers become a
+// unique_ptr that is release()d on the success path.
+
+#include <memory>
+#include "bench_harness.h"
+#include "defer.hpp"
+
+static void cleanup_add(void* ptr) {
+    int* val = (int*)ptr;
+    bench_sink += (unsigned long)*val;
+}
+
+static void release_add(int* val) {
+    bench_sink += (unsigned long)*val;
+}
+
+struct add_deleter {
+    void operator()(int* val) const { release_add(val); }
+};
+
+struct free_deleter {
+    void operator()(char* buf) const { bench_free(buf); }
+};
+
+typedef std::unique_ptr<int, add_deleter> add_ptr;
+
+// ---------------------------------------------------------------------------
+// Scenario: defer/errdefer registration on a success path
+// ---------------------------------------------------------------------------
+
+BENCH_NOINLINE int register_defer(int n) S_
+    int a = n;
+    defer(cleanup_add, a);
+    int b = n + 1;
+    defer(cleanup_add, b);
+    int c = n + 2;
+    errdefer(cleanup_add, c);
+    int d = n + 3;
+    errdefer(cleanup_add, d);
+    return a + b;
+_S
+
+BENCH_NOINLINE int register_unique_ptr(int n) {
+    int a = n;
+    add_ptr pa(&a);
+    int b = n + 1;
+    add_ptr pb(&b);
+    int c = n + 2;
+    add_ptr pc(&c);
+    int d = n + 3;
+    add_ptr pd(&d);
+    int ret = a + b;
+    pd.release();
+    pc.release();
+    return ret;
+}
+
+BENCH_NOINLINE int register_goto(int n) {
+    int a = n;
+    int b = n + 1;
+    int c = n + 2;
+    int d = n + 3;
+    int ret = a + b;
+    (void)c;
+    (void)d;
+    release_add(&b);
+    release_add(&a);
+    return ret;
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: one defer and one errdefer that never fires
+// ---------------------------------------------------------------------------
+
+BENCH_NOINLINE int errdefer_1_defer(int n) S_
+    int a = n;
+    defer(cleanup_add, a);
+    int b = n + 1;
+    errdefer(cleanup_add, b);
+    return a + b;
+_S
+
+BENCH_NOINLINE int errdefer_1_unique_ptr(int n) {
+    int a = n;
+    add_ptr pa(&a);
+    int b = n + 1;
+    add_ptr pb(&b);
+    int ret = a + b;
+    pb.release();
+    return ret;
+}
+
+BENCH_NOINLINE int errdefer_1_goto(int n) {
+    int a = n;
+    int b = n + 1;
+    int ret = a + b;
+    (void)b;
+    release_add(&a);
+    return ret;
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: return through three nested scopes
+// ---------------------------------------------------------------------------
+
+BENCH_NOINLINE int nested_return_defer(int n) S_
+    int a = n;
+    defer(cleanup_add, a);
+    S_
+        int b = n * 2;
+        defer(cleanup_add, b);
+        S_
+            int c = n * 3;
+            defer(cleanup_add, c);
+            if (n >= 0) {
+                return c;
+            }
+        _S
+    _S
+    return 0;
+_S
+
+BENCH_NOINLINE int nested_return_unique_ptr(int n) {
+    int a = n;
+    add_ptr pa(&a);
+    {
+        int b = n * 2;
+        add_ptr pb(&b);
+        {
+            int c = n * 3;
+            add_ptr pc(&c);
+            if (n >= 0) {
+                return c;
+            }
+        }
+    }
+    return 0;
+}
+
+BENCH_NOINLINE int nested_return_goto(int n) {
+    int ret = 0;
+    int a = n;
+    int b = n * 2;
+    int c = n * 3;
+    if (n >= 0) {
+        ret = c;
+        goto cleanup;
+    }
+cleanup:
+    release_add(&c);
+    release_add(&b);
+    release_add(&a);
+    return ret;
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: break/continue out of a scoped loop body
+// ---------------------------------------------------------------------------
+
+BENCH_NOINLINE int loop_defer(int n) S_
+    int total = 0;
+    for (int i = 0; i < 16; i++) S_
+        int x = i + n;
+        defer(cleanup_add, x);
+        if (i == 12) {
+            break;
+        }
+        if (i & 1) {
+            continue;
+        }
+        total += x;
+    _S
+    return total;
+_S
+
+BENCH_NOINLINE int loop_unique_ptr(int n) {
+    int total = 0;
+    for (int i = 0; i < 16; i++) {
+        int x = i + n;
+        add_ptr px(&x);
+        if (i == 12) {
+            break;
+        }
+        if (i & 1) {
+            continue;
+        }
+        total += x;
+    }
+    return total;
+}
+
+BENCH_NOINLINE int loop_goto(int n) {
+    int total = 0;
+    for (int i = 0; i < 16; i++) {
+        int x = i + n;
+        if (i == 12) {
+            release_add(&x);
+            break;
+        }
+        if (i & 1) {
+            goto next;
+        }
+        total += x;
+next:
+        release_add(&x);
+    }
+    return total;
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: a dozen short lived temporaries, malloc + defer(free) per buffer
+// ---------------------------------------------------------------------------
+
+#define TEMPORARIES 12
+
+static void free_ptr(void* ptr) {
+    bench_free(*(void**)ptr);
+}
+
+// Out of line so the compiler can't pair up and drop malloc/free
+BENCH_NOINLINE int touch_buf(char* buf, int value) {
+    buf[0] = (char)value;
+    return buf[0];
+}
+
+BENCH_NOINLINE int temporaries_defer(int n) S_
+    int total = 0;
+    for (int i = 0; i < TEMPORARIES; i++) S_
+        char* buf = (char*)bench_malloc(64 + (size_t)i);
+        defer(free_ptr, buf);
+        total += touch_buf(buf, n + i);
+    _S
+    return total;
+_S
+
+BENCH_NOINLINE int temporaries_unique_ptr(int n) {
+    int total = 0;
+    for (int i = 0; i < TEMPORARIES; i++) {
+        std::unique_ptr<char, free_deleter> buf((char*)bench_malloc(64 + (size_t)i));
+        total += touch_buf(buf.get(), n + i);
+    }
+    return total;
+}
+
+BENCH_NOINLINE int temporaries_goto(int n) {
+    int total = 0;
+    for (int i = 0; i < TEMPORARIES; i++) {
+        char* buf = (char*)bench_malloc(64 + (size_t)i);
+        total += touch_buf(buf, n + i);
+        bench_free(buf);
+    }
+    return total;
+}
+
+// ---------------------------------------------------------------------------
+// Scenario: recursion, one defer per level
+// ---------------------------------------------------------------------------
+
+BENCH_NOINLINE void recurse_defer(int n) S_
+    int x = n;
+    defer(cleanup_add, x);
+    if (n > 0) {
+        recurse_defer(n - 1);
+    }
+_S
+
+BENCH_NOINLINE void recurse_unique_ptr(int n) {
+    int x = n;
+    add_ptr px(&x);
+    if (n > 0) {
+        recurse_unique_ptr(n - 1);
+    }
+}
+
+BENCH_NOINLINE void recurse_goto(int n) {
+    int x = n;
+    if (n > 0) {
+        recurse_goto(n - 1);
+    }
+    release_add(&x);
+}
+
+// ---------------------------------------------------------------------------
+// Case table
+// ---------------------------------------------------------------------------
+
+static void run_register_defer(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)register_defer((int)_i)); }
+static void run_register_unique_ptr(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)register_unique_ptr((int)_i)); }
+static void run_register_goto(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)register_goto((int)_i)); }
+static void run_errdefer_1_defer(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)errdefer_1_defer((int)_i)); }
+static void run_errdefer_1_unique_ptr(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)errdefer_1_unique_ptr((int)_i)); }
+static void run_errdefer_1_goto(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)errdefer_1_goto((int)_i)); }
+static void run_nested_return_defer(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)nested_return_defer((int)_i)); }
+static void run_nested_return_unique_ptr(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)nested_return_unique_ptr((int)_i)); }
+static void run_nested_return_goto(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)nested_return_goto((int)_i)); }
+static void run_loop_defer(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)loop_defer((int)_i)); }
+static void run_loop_unique_ptr(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)loop_unique_ptr((int)_i)); }
+static void run_loop_goto(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)loop_goto((int)_i)); }
+static void run_temporaries_defer(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)temporaries_defer((int)_i)); }
+static void run_temporaries_unique_ptr(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)temporaries_unique_ptr((int)_i)); }
+static void run_temporaries_goto(long iterations) { BENCH_LOOP(bench_sink += (unsigned long)temporaries_goto((int)_i)); }
+static void run_recurse_defer(long iterations) { BENCH_LOOP(recurse_defer(8)); }
+static void run_recurse_unique_ptr(long iterations) { BENCH_LOOP(recurse_unique_ptr(8)); }
+static void run_recurse_goto(long iterations) { BENCH_LOOP(recurse_goto(8)); }
+
+static const bench_case bench_cases[] = {
+    { "register",       "defer",      run_register_defer },
+    { "register",       "unique_ptr", run_register_unique_ptr },
+    { "register",       "goto",       run_register_goto },
+    { "errdefer_1",     "defer",      run_errdefer_1_defer },
+    { "errdefer_1",     "unique_ptr", run_errdefer_1_unique_ptr },
+    { "errdefer_1",     "goto",       run_errdefer_1_goto },
+    { "nested_return",  "defer",      run_nested_return_defer },
+    { "nested_return",  "unique_ptr", run_nested_return_unique_ptr },
+    { "nested_return",  "goto",       run_nested_return_goto },
+    { "break_continue", "defer",      run_loop_defer },
+    { "break_continue", "unique_ptr", run_loop_unique_ptr },
+    { "break_continue", "goto",       run_loop_goto },
+    { "temporaries",    "defer",      run_temporaries_defer },
+    { "temporaries",    "unique_ptr", run_temporaries_unique_ptr },
+    { "temporaries",    "goto",       run_temporaries_goto },
+    { "recursion",      "defer",      run_recurse_defer },
+    { "recursion",      "unique_ptr", run_recurse_unique_ptr },
+    { "recursion",      "goto",       run_recurse_goto },
+};
+
+int main(int argc, char** argv) {
+    return bench_run(argc, argv, "c++", bench_cases,
+                     sizeof(bench_cases) / sizeof(bench_cases[0]), NULL);
+}
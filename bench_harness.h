@@ -0,0 +1,244 @@
+#ifndef BENCH_HARNESS_H
+#define BENCH_HARNESS_H
+
+// Timing and reporting shared by bench_defer.c and bench_defer.cpp, so the C
+// backends and defer.hpp print the same JSON and can be compared line by
+// line. Include it before defer.h: the bodies here use plain keywords.
+//
+// Hardware counters come from perf_event_open when the kernel allows it
+// (perf_event_paranoid <= 2 is enough, the kernel is excluded). When it
+// doesn't, the counter fields are null and only ns/op is reported.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#if defined(__GNUC__) && !defined(__PCC__)
+#define BENCH_NOINLINE __attribute__((noinline))
+#define FALLTHROUGH __attribute__((fallthrough))
+#else
+#define BENCH_NOINLINE
+#define FALLTHROUGH
+#endif
+
+// Cleanups feed a global so none of the work can be optimized out.
+static volatile unsigned long bench_sink = 0;
+
+// Every scenario allocates through these, so the results can report how many
+// trips to the allocator each variant makes.
+static unsigned long bench_mallocs = 0;
+
+BENCH_NOINLINE static void* bench_malloc(size_t size) {
+    bench_mallocs++;
+    return malloc(size);
+}
+
+BENCH_NOINLINE static void bench_free(void* ptr) {
+    free(ptr);
+}
+
+// Likewise for kernel entries: scenarios that make syscalls make them through
+// bench_syscall, which takes syscall(2)'s arguments
+static unsigned long bench_syscalls = 0;
+
+#define bench_syscall(...) (bench_syscalls++, syscall(__VA_ARGS__))
+
+#define BENCH_COUNTERS 4
+
+typedef struct bench_counters {
+    int fd;            // group leader, -1 when perf is unavailable
+    int fds[BENCH_COUNTERS];
+} bench_counters;
+
+typedef struct bench_reading {
+    uint64_t values[BENCH_COUNTERS]; // instructions, branches, branch-misses, cache-misses
+} bench_reading;
+
+static void counters_open(bench_counters* c) {
+    c->fd = -1;
+#ifdef __linux__
+    static const uint64_t configs[BENCH_COUNTERS] = {
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_MISSES,
+    };
+    for (int i = 0; i < BENCH_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[i];
+        attr.disabled = i == 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : c->fd, 0);
+        if (fd < 0) {
+            for (int j = 0; j < i; j++) close(c->fds[j]);
+            c->fd = -1;
+            return;
+        }
+        c->fds[i] = fd;
+        if (i == 0) c->fd = fd;
+    }
+#endif
+}
+
+static void counters_close(bench_counters* c) {
+    if (c->fd < 0) {
+        return;
+    }
+    for (int i = 0; i < BENCH_COUNTERS; i++) close(c->fds[i]);
+}
+
+static void counters_start(bench_counters* c) {
+#ifdef __linux__
+    if (c->fd < 0) {
+        return;
+    }
+    ioctl(c->fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(c->fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#else
+    (void)c;
+#endif
+}
+
+static int counters_stop(bench_counters* c, bench_reading* out) {
+#ifdef __linux__
+    if (c->fd < 0) {
+        return 0;
+    }
+    ioctl(c->fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    uint64_t buf[BENCH_COUNTERS + 1];
+    if (read(c->fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf) || buf[0] != BENCH_COUNTERS) {
+        return 0;
+    }
+    for (int i = 0; i < BENCH_COUNTERS; i++) out->values[i] = buf[i + 1];
+    return 1;
+#else
+    (void)c;
+    (void)out;
+    return 0;
+#endif
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+typedef void (*bench_fn)(long iterations);
+
+#define BENCH_LOOP(call) do { \
+    for (long _i = 0; _i < iterations; _i++) { call; } \
+} while (0)
+
+typedef struct bench_case {
+    const char* scenario;
+    const char* variant;
+    bench_fn fn;
+    double (*stack_per_level)(void); // NULL when the scenario doesn't measure it
+    long scale;                      // run iterations / scale times, 0 for 1
+} bench_case;
+
+#define BENCH_REPEATS 5
+
+static void print_per_op(const char* name, int have, uint64_t value, long iterations, const char* sep) {
+    if (have) {
+        printf("\"%s\": %.3f%s", name, (double)value / (double)iterations, sep);
+    } else {
+        printf("\"%s\": null%s", name, sep);
+    }
+}
+
+// Runs every case BENCH_REPEATS times, keeps the fastest run and prints the
+// whole table as one JSON object. events counts trace records written so far
+// and is NULL when the build doesn't trace.
+static int bench_run(int argc, char** argv, const char* backend, const bench_case* cases,
+                     size_t n_cases, uint64_t (*events_fn)(void)) {
+    long iterations = 1000000;
+    if (argc > 1) iterations = atol(argv[1]);
+    if (iterations <= 0) {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    bench_counters counters;
+    counters_open(&counters);
+
+    printf("{\n");
+    printf("  \"backend\": \"%s\",\n", backend);
+#ifdef __VERSION__
+    printf("  \"compiler\": \"%s\",\n", __VERSION__);
+#endif
+    printf("  \"iterations\": %ld,\n", iterations);
+    printf("  \"perf_counters\": %s,\n", counters.fd >= 0 ? "true" : "false");
+    printf("  \"results\": [\n");
+
+    for (size_t c = 0; c < n_cases; c++) {
+        const bench_case* bc = &cases[c];
+        long ops = bc->scale ? iterations / bc->scale + 1 : iterations;
+        bc->fn(ops / 10 + 1); // warm up
+
+        uint64_t best_ns = UINT64_MAX;
+        bench_reading best = {{0}};
+        unsigned long best_mallocs = 0;
+        unsigned long best_syscalls = 0;
+        uint64_t best_events = 0;
+        int have_counters = counters.fd >= 0;
+        for (int r = 0; r < BENCH_REPEATS; r++) {
+            bench_reading reading = {{0}};
+            bench_mallocs = 0;
+            bench_syscalls = 0;
+            uint64_t events = events_fn ? events_fn() : 0;
+            counters_start(&counters);
+            uint64_t start = now_ns();
+            bc->fn(ops);
+            uint64_t elapsed = now_ns() - start;
+            if (!counters_stop(&counters, &reading)) have_counters = 0;
+            events = (events_fn ? events_fn() : 0) - events;
+            if (elapsed < best_ns) {
+                best_ns = elapsed;
+                best = reading;
+                best_mallocs = bench_mallocs;
+                best_syscalls = bench_syscalls;
+                best_events = events;
+            }
+        }
+
+        printf("    {\"scenario\": \"%s\", \"variant\": \"%s\", ", bc->scenario, bc->variant);
+        printf("\"ns_per_op\": %.3f, ", (double)best_ns / (double)ops);
+        print_per_op("instructions_per_op", have_counters, best.values[0], ops, ", ");
+        print_per_op("branches_per_op", have_counters, best.values[1], ops, ", ");
+        print_per_op("branch_misses_per_op", have_counters, best.values[2], ops, ", ");
+        print_per_op("cache_misses_per_op", have_counters, best.values[3], ops, ", ");
+        print_per_op("mallocs_per_op", 1, best_mallocs, ops, ", ");
+        print_per_op("syscalls_per_op", 1, best_syscalls, ops, "");
+        if (events_fn) {
+            printf(", ");
+            print_per_op("trace_events_per_op", 1, best_events, ops, "");
+        }
+        if (bc->stack_per_level) {
+            printf(", \"stack_bytes_per_level\": %.1f", bc->stack_per_level());
+        }
+        printf("}%s\n", c + 1 < n_cases ? "," : "");
+    }
+
+    printf("  ]\n");
+    printf("}\n");
+
+    counters_close(&counters);
+    return 0;
+}
+
+#endif // BENCH_HARNESS_H
@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+"""Preprocessing and parsing time of the C99 keyword modes of defer.h.
+
+Generates synthetic translation units with N top-level S_ _S scopes (one per
+function, each with a defer, a scoped loop with break and continue, a switch
+and a return), plus the same number of plain functions that never open a
+scope, and times the compiler on each of them in every mode:
+
+    global               keywords redefined everywhere, no configuration
+    macro-stack          macro_stack.h, generated for max(N, 1000) scopes the
+                         way `make macro_stack.h` does it
+    macro-stack-counted  macro_stack.h sized by make_macro_stack.py --count
+                         to the scopes the file has, as the Makefile's test
+                         and bench builds do
+    scope-enum           DEFER_SCOPE_ENUM, no generated header and no cap
+
+For every mode and size it reports the best of a few runs of `cc -E`
+(preprocessing only) and `cc -fsyntax-only` (preprocessing and parsing), and
+the number of lines the preprocessor had to read. The output is one JSON
+object, like the runtime benchmarks.
+
+Usage:
+    bench_preprocess.py [--cc CC] [--scopes 100,1000,5000] [--repeats N]
+
+"""
+
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+from typing import Dict, List, TextIO
+
+import make_macro_stack
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+DEFAULT_SCOPES = [100, 1000, 5000]
+DEFAULT_REPEATS = 5
+# Scopes make_macro_stack.sh is run with by the Makefile
+DEFAULT_STACK = 1000
+MODES = ["global", "macro-stack", "macro-stack-counted", "scope-enum"]
+
+FUNCTION = """
+static int scoped_{i}(int n) S_
+    int total = 0;
+    defer(release, total);
+    for (int j = 0; j < n; j++) S_
+        int x = j + {i};
+        defer(release, x);
+        if (x == 7) {{
+            break;
+        }}
+        if (x & 1) {{
+            continue;
+        }}
+        total += x;
+    _S
+    switch (n) {{
+        case 0: total++; break;
+        default: break;
+    }}
+    return total;
+_S
+
+static int plain_{i}(int n) {{
+    int total = 0;
+    for (int j = 0; j < n; j++) {{
+        if (j & 1) {{
+            continue;
+        }}
+        total += j;
+    }}
+    while (total > 100) total /= 2;
+    return total;
+}}
+"""
+
+
+def print_usage(stream: TextIO = sys.stderr) -> None:
+    stream.write("Usage: {} [--cc CC] [--scopes 100,1000,5000] [--repeats N]\n".format(sys.argv[0]))
+    stream.write("\n")
+    stream.write("  --cc       Compiler to time (default: $CC, else cc)\n")
+    stream.write("  --scopes   Top-level S_ _S scopes per generated translation unit\n")
+    stream.write("  --repeats  Runs per measurement, the fastest is kept (default: {})\n".format(
+        DEFAULT_REPEATS))
+
+
+def write_tu(path: str, scopes: int, mode: str) -> None:
+    with open(path, "w") as f:
+        if mode.startswith("macro-stack"):
+            f.write('#include "macro_stack.h"\n')
+        elif mode == "scope-enum":
+            f.write("#define DEFER_SCOPE_ENUM\n")
+        f.write("#define USE_C99_DEFER\n")
+        f.write('#include "defer.h"\n')
+        f.write("static void release(void* ptr) { (void)ptr; }\n")
+        for i in range(scopes):
+            f.write(FUNCTION.format(i=i))
+
+
+def best_time(cmd: List[str], repeats: int) -> float:
+    best = float("inf")
+    for _ in range(repeats):
+        start = time.perf_counter()
+        subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        best = min(best, time.perf_counter() - start)
+    return best
+
+
+def count_lines(*paths: str) -> int:
+    total = 0
+    for path in paths:
+        with open(path) as f:
+            total += sum(1 for _ in f)
+    return total
+
+
+def measure(cc: str, scopes: int, mode: str, repeats: int, workdir: str) -> Dict[str, object]:
+    include = os.path.join(workdir, mode)
+    os.makedirs(include, exist_ok=True)
+    headers = [os.path.join(HERE, "defer.h")]
+    tu = os.path.join(include, "tu_{}.c".format(scopes))
+    write_tu(tu, scopes, mode)
+    if mode.startswith("macro-stack"):
+        stack_path = os.path.join(include, "macro_stack.h")
+        if mode == "macro-stack":
+            length = max(scopes, DEFAULT_STACK)
+        else:
+            length, _files = make_macro_stack.count_scopes(tu, [HERE])
+        with open(stack_path, "w") as stack:
+            make_macro_stack.generate_macro_stack(length, "fail", stack)
+        headers.append(stack_path)
+    base = [cc, "-std=c99", "-I", include, "-I", HERE]
+    return {
+        "scopes": scopes,
+        "mode": mode,
+        "lines": count_lines(tu, *headers),
+        "preprocess_ms": round(best_time(base + ["-E", tu], repeats) * 1000, 3),
+        "syntax_ms": round(best_time(base + ["-fsyntax-only", tu], repeats) * 1000, 3),
+    }
+
+
+def main(argv: List[str]) -> int:
+    cc = os.environ.get("CC") or "cc"
+    sizes = DEFAULT_SCOPES
+    repeats = DEFAULT_REPEATS
+    args = argv[1:]
+    while args:
+        arg = args.pop(0)
+        try:
+            if arg == "--cc" and args:
+                cc = args.pop(0)
+            elif arg == "--scopes" and args:
+                sizes = [int(s) for s in args.pop(0).split(",") if s]
+            elif arg == "--repeats" and args:
+                repeats = int(args.pop(0))
+            else:
+                print_usage()
+                return 1
+        except ValueError:
+            print("Error: scopes and repeats must be integers", file=sys.stderr)
+            return 1
+    if repeats <= 0 or not sizes or min(sizes) <= 0:
+        print_usage()
+        return 1
+
+    results = []
+    with tempfile.TemporaryDirectory() as workdir:
+        for scopes in sizes:
+            for mode in MODES:
+                try:
+                    results.append(measure(cc, scopes, mode, repeats, workdir))
+                except (OSError, subprocess.CalledProcessError) as e:
+                    print("Error: {} failed on {} scopes in {} mode: {}".format(
+                        cc, scopes, mode, e), file=sys.stderr)
+                    return 1
+
+    json.dump({"compiler": cc, "repeats": repeats, "results": results}, sys.stdout, indent=2)
+    sys.stdout.write("\n")
+    return 0
+
+
+if __name__ == "__main__":  # pragma: no cover - CLI entry point
+    raise SystemExit(main(sys.argv))
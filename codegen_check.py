@@ -0,0 +1,420 @@
+#!/usr/bin/env python3
+"""Codegen and code-size regression check for defer.h.
+
+Compiles codegen_corpus.c with every available compiler, at every
+optimization level, in every backend, and records for each corpus function:
+
+    text            size of the function in .text (bytes)
+    indirect_calls  calls through a register or memory operand
+    stack           stack frame size from -fstack-usage (bytes)
+
+The numbers are compared against a checked-in baseline, and the check fails
+when any of them got worse. GCC's outlined cold parts (foo.cold) are listed
+separately, and their text may grow, since that's code moved off the hot
+path. Compilers that aren't installed, and compilers that have no entry in
+the baseline yet, are skipped with a note.
+
+With --identical-to REF the corpus is instead compiled against the current
+defer.h and against defer.h from git revision REF, and the check fails unless
+the disassembly is the same for every compiler, backend and optimization
+level. That's how opt-in features (DEFER_PROFILE) prove they cost nothing
+when they are off.
+
+With --cpp, codegen_corpus.cpp is compiled with the C++ compilers and
+-fno-exceptions instead, and the check fails unless every cg_<name>_guard
+function, written with the defer.hpp guards, disassembles to the same
+instructions as its hand-written cg_<name>_manual twin at -O2 and -O3 (at -Os
+it only has to be no longer).
+
+Usage:
+    codegen_check.py [--update] [--baseline FILE] [--compilers gcc,clang]
+                     [--tolerance BYTES] [--identical-to REF]
+    codegen_check.py --cpp [--compilers g++,clang++]
+
+"""
+
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+from typing import Dict, List, Optional, TextIO
+
+import make_macro_stack
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+CORPUS = os.path.join(HERE, "codegen_corpus.c")
+CORPUS_CPP = os.path.join(HERE, "codegen_corpus.cpp")
+DEFAULT_BASELINE = os.path.join(HERE, "codegen_baseline.json")
+DEFAULT_COMPILERS = ["gcc", "clang"]
+DEFAULT_CPP_COMPILERS = ["g++", "clang++"]
+OPT_LEVELS = ["-O1", "-O2", "-O3", "-Os"]
+# Where the guards are expected to vanish completely. At -Os GCC may lay out
+# the blocks of a twin differently, so there the guard version only has to be
+# no longer; -O1 doesn't inline the guard lambdas reliably and isn't checked.
+CPP_OPT_LEVELS = ["-O2", "-O3", "-Os"]
+CPP_SIZE_ONLY = ["-Os"]
+METRICS = ["text", "indirect_calls", "stack"]
+
+# backend name -> (std flag, extra flags)
+BACKENDS = {
+    "gnu": ("-std=gnu11", []),
+    "c99": ("-std=c99", ["-DUSE_C99_DEFER"]),
+    "c99-macro": ("-std=c99", ["-DUSE_C99_DEFER", "-DUSE_MACRO_STACK"]),
+    "c99-scope": ("-std=c99", ["-DUSE_C99_DEFER", "-DDEFER_SCOPE_ENUM"]),
+    "c99-nokw": ("-std=c99", ["-DUSE_C99_DEFER", "-DDONT_REDEFINE_KEYWORDS"]),
+    "c99-tls": ("-std=c99", ["-DUSE_TLS_DEFER"]),
+}
+
+# Indirect call mnemonics, per objdump syntax
+INDIRECT_CALL = re.compile(r"\t(?:call|callq|notrack call)\s+\*|\tblr\s")
+
+Results = Dict[str, Dict[str, int]]
+
+
+def print_usage(stream: TextIO = sys.stderr) -> None:
+    stream.write("Usage: {} [--update] [--baseline FILE] [--compilers gcc,clang] "
+                 "[--tolerance BYTES] [--identical-to REF] [--cpp]\n".format(sys.argv[0]))
+    stream.write("\n")
+    stream.write("  --update      Write the current numbers to the baseline instead of checking\n")
+    stream.write("  --baseline    Baseline file (default: codegen_baseline.json)\n")
+    stream.write("  --compilers   Comma separated compilers to try (default: gcc,clang)\n")
+    stream.write("  --tolerance   Allowed growth of text/stack in bytes (default: 0)\n")
+    stream.write("  --identical-to  Require the same object code as defer.h at git revision REF\n")
+    stream.write("  --cpp         Require defer.hpp guards to compile like the hand-written cleanups\n")
+
+
+def compiler_key(cc: str) -> Optional[str]:
+    """Baseline key for a compiler, e.g. gcc-12, or None if it isn't installed."""
+    if shutil.which(cc) is None:
+        return None
+    try:
+        version = subprocess.run([cc, "-dumpversion"], capture_output=True,
+                                 text=True, check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+    return "{}-{}".format(os.path.basename(cc), version.split(".")[0])
+
+
+def function_sizes(obj: str) -> Dict[str, int]:
+    out = subprocess.run(["nm", "-S", "--defined-only", obj], capture_output=True,
+                         text=True, check=True).stdout
+    sizes = {}
+    for line in out.splitlines():
+        parts = line.split()
+        if len(parts) == 4 and parts[2] in "Tt" and parts[3].startswith("cg_"):
+            sizes[parts[3]] = int(parts[1], 16)
+    return sizes
+
+
+def indirect_calls(obj: str) -> Dict[str, int]:
+    out = subprocess.run(["objdump", "-d", "--no-show-raw-insn", obj], capture_output=True,
+                         text=True, check=True).stdout
+    counts: Dict[str, int] = {}
+    current = None
+    for line in out.splitlines():
+        header = re.match(r"^[0-9a-f]+ <([^>]+)>:$", line)
+        if header:
+            # GCC outlines cold parts as foo.cold, count them with foo
+            current = header.group(1).split(".")[0]
+            counts.setdefault(current, 0)
+        elif current and INDIRECT_CALL.search(line):
+            counts[current] += 1
+    return counts
+
+
+def stack_usage(su_file: str) -> Dict[str, int]:
+    usage = {}
+    with open(su_file) as f:
+        for line in f:
+            location, size, _kind = line.rstrip("\n").split("\t")
+            name = location.rsplit(":", 1)[-1]
+            usage[name] = int(size)
+    return usage
+
+
+def measure(cc: str, backend: str, opt: str, workdir: str) -> Results:
+    std, extra = BACKENDS[backend]
+    obj = os.path.join(workdir, "corpus_{}{}.o".format(backend, opt))
+    cmd = [cc, std, opt, "-fstack-usage", "-I", HERE, "-I", workdir, *extra,
+           "-c", CORPUS, "-o", obj]
+    subprocess.run(cmd, check=True, stderr=subprocess.DEVNULL)
+    sizes = function_sizes(obj)
+    calls = indirect_calls(obj)
+    stack = stack_usage(obj[:-2] + ".su")
+    return {
+        name: {
+            "text": size,
+            "indirect_calls": calls.get(name, 0),
+            "stack": stack.get(name, 0),
+        }
+        for name, size in sorted(sizes.items())
+    }
+
+
+def disassemble(cc: str, backend: str, opt: str, include: str, workdir: str) -> str:
+    """Disassembly of the corpus compiled against the defer.h in include."""
+    std, extra = BACKENDS[backend]
+    obj = os.path.join(include, "corpus_{}{}.o".format(backend, opt))
+    corpus = os.path.join(include, os.path.basename(CORPUS))
+    cmd = [cc, std, opt, "-I", workdir, *extra, "-c", corpus, "-o", obj]
+    subprocess.run(cmd, check=True, stderr=subprocess.DEVNULL)
+    out = subprocess.run(["objdump", "-d", "--no-show-raw-insn", obj], capture_output=True,
+                         text=True, check=True).stdout
+    # Drop the header line, it names the object file
+    return out.split("\n", 2)[-1]
+
+
+def compare_identical(cc: str, ref: str, workdir: str) -> List[str]:
+    """Backend/opt combinations whose object code differs from defer.h at ref."""
+    old = os.path.join(workdir, "ref")
+    new = os.path.join(workdir, "new")
+    for path in (old, new):
+        os.makedirs(path, exist_ok=True)
+    # The corpus includes "defer.h", which resolves next to the corpus before
+    # any -I, so each directory gets its own copy of the corpus
+    headers = subprocess.run(["git", "-C", HERE, "show", "{}:defer.h".format(ref)],
+                             capture_output=True, check=True).stdout
+    with open(os.path.join(old, "defer.h"), "wb") as f:
+        f.write(headers)
+    shutil.copy(os.path.join(HERE, "defer.h"), os.path.join(new, "defer.h"))
+    for path in (old, new):
+        shutil.copy(CORPUS, path)
+    differences = []
+    for backend in BACKENDS:
+        for opt in OPT_LEVELS:
+            if disassemble(cc, backend, opt, old, workdir) != disassemble(cc, backend, opt, new, workdir):
+                differences.append("{} {} {}".format(cc, backend, opt))
+    return differences
+
+
+def function_bodies(obj: str) -> Dict[str, List[str]]:
+    """Instructions of each cg_ function, with addresses and its own name dropped.
+
+    Needs an object built with -ffunction-sections, so every function starts
+    at offset 0 and jumps inside it read the same in both twins.
+    """
+    out = subprocess.run(["objdump", "-dr", "--no-show-raw-insn", obj], capture_output=True,
+                         text=True, check=True).stdout
+    bodies: Dict[str, List[str]] = {}
+    current = None
+    for line in out.splitlines():
+        header = re.match(r"^[0-9a-f]+ <([^>]+)>:$", line)
+        if header:
+            current = header.group(1) if header.group(1).startswith("cg_") else None
+            if current:
+                bodies[current] = []
+            continue
+        if current is None or ":" not in line or line.startswith("Disassembly"):
+            continue
+        insn = " ".join(line.split(":", 1)[1].split())
+        bodies[current].append(insn.replace("<" + current, "<self"))
+    return bodies
+
+
+def compare_cpp(cxx: str, workdir: str) -> List[str]:
+    """cg_<name>_guard functions that don't compile like cg_<name>_manual."""
+    differences = []
+    for opt in CPP_OPT_LEVELS:
+        obj = os.path.join(workdir, "corpus_cpp{}.o".format(opt))
+        cmd = [cxx, "-std=c++17", opt, "-fno-exceptions", "-ffunction-sections",
+               "-I", HERE, "-c", CORPUS_CPP, "-o", obj]
+        subprocess.run(cmd, check=True, stderr=subprocess.DEVNULL)
+        bodies = function_bodies(obj)
+        for name in sorted(bodies):
+            if not name.endswith("_guard"):
+                continue
+            manual = name[:-len("_guard")] + "_manual"
+            if manual not in bodies:
+                differences.append("{} {} {}: no {}".format(cxx, opt, name, manual))
+            elif opt in CPP_SIZE_ONLY:
+                if len(bodies[name]) > len(bodies[manual]):
+                    differences.append("{} {} {}: {} instructions, {} has {}".format(
+                        cxx, opt, name, len(bodies[name]), manual, len(bodies[manual])))
+            elif bodies[name] != bodies[manual]:
+                differences.append("{} {} {}: {} instructions, {} has {}".format(
+                    cxx, opt, name, len(bodies[name]), manual, len(bodies[manual])))
+    return differences
+
+
+def check_cpp(compilers: List[str]) -> int:
+    differences: List[str] = []
+    measured = 0
+    with tempfile.TemporaryDirectory() as workdir:
+        for cxx in compilers:
+            if compiler_key(cxx) is None:
+                print("note: {} not found, skipped".format(cxx))
+                continue
+            try:
+                differences += compare_cpp(cxx, workdir)
+            except subprocess.CalledProcessError as e:
+                print("Error: {} failed".format(" ".join(e.cmd)), file=sys.stderr)
+                return 1
+            measured += 1
+
+    if measured == 0:
+        print("Error: none of {} is installed".format(", ".join(compilers)), file=sys.stderr)
+        return 1
+    if differences:
+        print("defer.hpp guards differ from the hand-written cleanups:")
+        for d in differences:
+            print("  " + d)
+        return 1
+    print("defer.hpp guards compile to the hand-written cleanups.")
+    return 0
+
+
+def collect(cc: str, workdir: str) -> Dict[str, Dict[str, Results]]:
+    return {
+        backend: {opt: measure(cc, backend, opt, workdir) for opt in OPT_LEVELS}
+        for backend in BACKENDS
+    }
+
+
+def compare(key: str, baseline: Dict[str, Dict[str, Results]],
+            current: Dict[str, Dict[str, Results]], tolerance: int) -> List[str]:
+    regressions = []
+    for backend, opts in current.items():
+        for opt, functions in opts.items():
+            base_functions = baseline.get(backend, {}).get(opt, {})
+            for name, metrics in functions.items():
+                base = base_functions.get(name)
+                if base is None:
+                    print("note: {} {} {} {} has no baseline".format(key, backend, opt, name))
+                    continue
+                for metric in METRICS:
+                    if metric == "text" and name.endswith(".cold"):
+                        continue
+                    allowed = base[metric] + (tolerance if metric != "indirect_calls" else 0)
+                    if metrics[metric] > allowed:
+                        regressions.append("{} {} {} {}: {} {} -> {}".format(
+                            key, backend, opt, name, metric, base[metric], metrics[metric]))
+    return regressions
+
+
+def print_report(key: str, current: Dict[str, Dict[str, Results]]) -> None:
+    print("== {} ==".format(key))
+    print("{:<10} {:<4} {:<28} {:>6} {:>9} {:>6}".format(
+        "backend", "opt", "function", "text", "indirect", "stack"))
+    for backend, opts in current.items():
+        for opt, functions in opts.items():
+            for name, m in functions.items():
+                print("{:<10} {:<4} {:<28} {:>6} {:>9} {:>6}".format(
+                    backend, opt, name, m["text"], m["indirect_calls"], m["stack"]))
+
+
+def check_identical(compilers: List[str], ref: str) -> int:
+    differences: List[str] = []
+    measured = 0
+    with tempfile.TemporaryDirectory() as workdir:
+        with open(os.path.join(workdir, "macro_stack.h"), "w") as stack:
+            make_macro_stack.generate_macro_stack(100, "fail", stack)
+        for cc in compilers:
+            if compiler_key(cc) is None:
+                print("note: {} not found, skipped".format(cc))
+                continue
+            try:
+                differences += compare_identical(cc, ref, workdir)
+            except subprocess.CalledProcessError as e:
+                print("Error: {} failed".format(" ".join(e.cmd)), file=sys.stderr)
+                return 1
+            measured += 1
+
+    if measured == 0:
+        print("Error: none of {} is installed".format(", ".join(compilers)), file=sys.stderr)
+        return 1
+    if differences:
+        print("Object code differs from defer.h at {}:".format(ref))
+        for d in differences:
+            print("  " + d)
+        return 1
+    print("Object code identical to defer.h at {}.".format(ref))
+    return 0
+
+
+def main(argv: List[str]) -> int:
+    update = False
+    baseline_path = DEFAULT_BASELINE
+    compilers: Optional[List[str]] = None
+    tolerance = 0
+    cpp = False
+    identical_to: Optional[str] = None
+    args = argv[1:]
+    while args:
+        arg = args.pop(0)
+        if arg == "--update":
+            update = True
+        elif arg == "--baseline" and args:
+            baseline_path = args.pop(0)
+        elif arg == "--compilers" and args:
+            compilers = [c for c in args.pop(0).split(",") if c]
+        elif arg == "--cpp":
+            cpp = True
+        elif arg == "--identical-to" and args:
+            identical_to = args.pop(0)
+        elif arg == "--tolerance" and args:
+            try:
+                tolerance = int(args.pop(0))
+            except ValueError:
+                print("Error: tolerance must be an integer", file=sys.stderr)
+                return 1
+        else:
+            print_usage()
+            return 1
+
+    if cpp:
+        return check_cpp(compilers or DEFAULT_CPP_COMPILERS)
+    if compilers is None:
+        compilers = DEFAULT_COMPILERS
+    if identical_to is not None:
+        return check_identical(compilers, identical_to)
+
+    baseline: Dict[str, Dict[str, Dict[str, Results]]] = {}
+    if os.path.exists(baseline_path):
+        with open(baseline_path) as f:
+            baseline = json.load(f)
+
+    regressions: List[str] = []
+    measured = 0
+    with tempfile.TemporaryDirectory() as workdir:
+        with open(os.path.join(workdir, "macro_stack.h"), "w") as stack:
+            make_macro_stack.generate_macro_stack(100, "fail", stack)
+        for cc in compilers:
+            key = compiler_key(cc)
+            if key is None:
+                print("note: {} not found, skipped".format(cc))
+                continue
+            current = collect(cc, workdir)
+            measured += 1
+            print_report(key, current)
+            if update:
+                baseline[key] = current
+            elif key not in baseline:
+                print("note: no baseline for {}, run with --update to record one".format(key))
+            else:
+                regressions += compare(key, baseline[key], current, tolerance)
+
+    if measured == 0:
+        print("Error: none of {} is installed".format(", ".join(compilers)), file=sys.stderr)
+        return 1
+
+    if update:
+        with open(baseline_path, "w") as f:
+            json.dump(baseline, f, indent=1, sort_keys=True)
+            f.write("\n")
+        print("Baseline written to {}".format(baseline_path))
+        return 0
+
+    if regressions:
+        print("\nCodegen regressions against {}:".format(os.path.basename(baseline_path)))
+        for r in regressions:
+            print("  " + r)
+        return 1
+    print("\nNo codegen regressions.")
+    return 0
+
+
+if __name__ == "__main__":  # pragma: no cover - CLI entry point
+    raise SystemExit(main(sys.argv))
@@ -0,0 +1,201 @@
+// Corpus of defer patterns for codegen_check.py.
+//
+// Every function here has external linkage so it's always emitted, and the
+// cleanup functions are only declared, so the compiler can't inline them away.
+// What's left in the object file is exactly what the defer machinery costs:
+// calls through _dfr_DeferNode function pointers show up as indirect calls,
+// scope contexts and nodes show up in the stack frame.
+//
+// Written with the uppercase keywords so the same source also builds with
+// DONT_REDEFINE_KEYWORDS.
+
+#include <stddef.h>
+#if defined(__GNUC__) && !defined(USE_C99_DEFER) && !defined(__PCC__)
+#undef USE_MACRO_STACK
+#endif
+#ifdef USE_MACRO_STACK
+#include "macro_stack.h"
+#endif // USE_MACRO_STACK
+#include "defer.h"
+
+#ifndef RETURN
+#define RETURN return
+#define RETURNERR returnerr
+#define BREAK break
+#define CONTINUE continue
+#define FOR for
+#define DO do
+#define WHILE while
+#define SWITCH switch
+#endif
+
+void cg_release(void* ptr);
+void cg_release_err(void* ptr);
+int cg_work(int value);
+
+struct cg_res;
+void cg_close(struct cg_res* res);
+DEFER_TYPED(cg_close, struct cg_res*);
+void cg_drop(int value);
+DEFER_TYPED(cg_drop, int);
+
+void cg_single_defer(int n) S_
+    int a = n;
+    defer(cg_release, a);
+    cg_work(a);
+_S
+
+int cg_defer_errdefer_success(int n) S_
+    int a = n;
+    defer(cg_release, a);
+    int b = n + 1;
+    errdefer(cg_release_err, b);
+    int c = n + 2;
+    errdefer(cg_release_err, c);
+    RETURN cg_work(a + b + c);
+_S
+
+int cg_returnerr(int n) S_
+    int a = n;
+    defer(cg_release, a);
+    int b = n + 1;
+    errdefer(cg_release_err, b);
+    if (cg_work(b) < 0) {
+        RETURNERR -1;
+    }
+    RETURN 0;
+_S
+
+int cg_nested_return(int n) S_
+    int a = n;
+    defer(cg_release, a);
+    S_
+        int b = n * 2;
+        defer(cg_release, b);
+        S_
+            int c = n * 3;
+            defer(cg_release, c);
+            if (cg_work(c)) {
+                RETURN c;
+            }
+        _S
+    _S
+    RETURN 0;
+_S
+
+int cg_loop_break_continue(int n) S_
+    int total = 0;
+    int i;
+    FOR (i = 0; i < n; i++) S_
+        int x = i;
+        defer(cg_release, x);
+        if (cg_work(x) == 3) {
+            BREAK;
+        }
+        if (i & 1) {
+            CONTINUE;
+        }
+        total += x;
+    _S
+    RETURN total;
+_S
+
+int cg_tight_loop(const int* values, int n) S_
+    int total = 0;
+    int i = 0;
+    WHILE (i < n) S_
+        int v = values[i];
+        defer(cg_release, v);
+        total += v;
+        i++;
+    _S
+    RETURN total;
+_S
+
+int cg_switch(int n) S_
+    int a = n;
+    defer(cg_release, a);
+    SWITCH (n & 3) {
+        case 0: S_
+            int b = 0;
+            defer(cg_release, b);
+            BREAK;
+        _S
+        case 1: S_
+            int c = 1;
+            defer(cg_release, c);
+            RETURN cg_work(c);
+        _S
+        default:
+            BREAK;
+    }
+    RETURN a;
+_S
+
+void cg_duff(int* from, int* to, size_t count) S_
+    int outer = 1;
+    defer(cg_release, outer);
+    if (count == 0) {
+        RETURN;
+    }
+    size_t n = (count + 7) / 8;
+    SWITCH (count % 8) {
+        case 0: DO {
+                *to++ = *from++;
+        case 7:      *to++ = *from++;
+        case 6:      *to++ = *from++;
+        case 5:      *to++ = *from++;
+        case 4:      *to++ = *from++;
+        case 3:      *to++ = *from++;
+        case 2:      *to++ = *from++;
+        case 1:      *to++ = *from++;
+        } WHILE (--n > 0);
+    }
+_S
+
+void cg_recurse(int n) S_
+    int x = n;
+    defer(cg_release, x);
+    if (n > 0) {
+        cg_recurse(n - 1);
+    }
+_S
+
+int cg_typed_defer(struct cg_res* res, int n) S_
+    tdefer(cg_close, res);
+    int a = n;
+    terrdefer(cg_drop, a);
+    if (cg_work(a) < 0) {
+        RETURNERR -1;
+    }
+    RETURN 0;
+_S
+
+#if DEFER_BLOCKS_AVAILABLE
+int cg_block_defer(int n) S_
+    int a = n;
+    deferblock(cg_drop(a);)
+    if (cg_work(a) < 0) {
+        RETURNERR -1;
+    }
+    RETURN 0;
+_S
+#endif
+
+// Errdefers with returnerr inside a loop, where the error flag is a runtime
+// value at the shared exit instead of a constant per path
+int cg_errdefer_loop(int n) S_
+    int a = n;
+    errdefer(cg_release_err, a);
+    int b = n + 1;
+    errdefer(cg_release_err, b);
+    int c = n + 2;
+    errdefer(cg_release_err, c);
+    int i;
+    FOR (i = 0; i < n; i++) {
+        if (cg_work(i) < 0) {
+            RETURNERR -1;
+        }
+    }
+    RETURN cg_work(a + b + c);
+_S
@@ -0,0 +1,169 @@
+// Corpus of defer.hpp patterns for codegen_check.py --cpp.
+//
+// Every pattern exists twice: cg_<name>_guard written with S_ _S scopes and
+// the defer.hpp guards, and cg_<name>_manual with the cleanup ladder written
+// out at each exit. The check compiles this file with -fno-exceptions and
+// fails unless each pair disassembles to the same instructions, which is
+// what "zero overhead" means for the guards.
+//
+// The functions are extern "C" so their names line up without demangling,
+// and the cleanup functions are only declared, so nothing is inlined away.
+
+#include "defer.hpp"
+
+extern "C" {
+
+void cg_release(void* ptr);
+void cg_release_err(void* ptr);
+int cg_work(int value);
+void cg_drop(int value);
+
+// ---------------------------------------------------------------------------
+
+int cg_basic_guard(int n) S_
+    int a = cg_work(n);
+    defer(cg_release, a);
+    int b = cg_work(a);
+    defer(cg_release, b);
+    return a + b;
+_S
+
+int cg_basic_manual(int n) {
+    int a = cg_work(n);
+    int b = cg_work(a);
+    int ret = a + b;
+    cg_release(&b);
+    cg_release(&a);
+    return ret;
+}
+
+// ---------------------------------------------------------------------------
+
+int cg_errdefer_guard(int n) S_
+    int a = cg_work(n);
+    defer(cg_release, a);
+    int b = cg_work(a);
+    errdefer(cg_release_err, b);
+    if (b < 0) {
+        returnerr -1;
+    }
+    return b;
+_S
+
+int cg_errdefer_manual(int n) {
+    int ret;
+    int a = cg_work(n);
+    int b = cg_work(a);
+    if (b < 0) {
+        ret = -1;
+        goto fail;
+    }
+    ret = b;
+    goto out;
+fail:
+    cg_release_err(&b);
+out:
+    cg_release(&a);
+    return ret;
+}
+
+// ---------------------------------------------------------------------------
+
+int cg_nested_return_guard(int n) S_
+    int a = cg_work(n);
+    defer(cg_release, a);
+    S_
+        int b = cg_work(a);
+        defer(cg_release, b);
+        if (b > 0) {
+            return b;
+        }
+    _S
+    return a;
+_S
+
+int cg_nested_return_manual(int n) {
+    int ret;
+    int a = cg_work(n);
+    {
+        int b = cg_work(a);
+        if (b > 0) {
+            ret = b;
+            cg_release(&b);
+            goto out;
+        }
+        cg_release(&b);
+    }
+    ret = a;
+out:
+    cg_release(&a);
+    return ret;
+}
+
+// ---------------------------------------------------------------------------
+
+int cg_loop_guard(int n) S_
+    int total = 0;
+    for (int i = 0; i < n; i++) S_
+        int x = cg_work(i);
+        defer(cg_release, x);
+        if (x == 12) {
+            break;
+        }
+        if (x & 1) {
+            continue;
+        }
+        total += x;
+    _S
+    return total;
+_S
+
+int cg_loop_manual(int n) {
+    int total = 0;
+    for (int i = 0; i < n; i++) {
+        int x = cg_work(i);
+        if (x == 12) {
+            cg_release(&x);
+            break;
+        }
+        if (x & 1) {
+            cg_release(&x);
+            continue;
+        }
+        total += x;
+        cg_release(&x);
+    }
+    return total;
+}
+
+// ---------------------------------------------------------------------------
+
+void cg_typed_guard(int n) S_
+    int a = cg_work(n);
+    tdefer(cg_drop, a);
+    deferblock(cg_drop(a + 1);)
+    cg_work(a);
+_S
+
+void cg_typed_manual(int n) {
+    int a = cg_work(n);
+    cg_work(a);
+    cg_drop(a + 1);
+    cg_drop(a);
+}
+
+// ---------------------------------------------------------------------------
+
+void cg_each_guard(int n) S_
+    int values[4] = { n, n + 1, n + 2, n + 3 };
+    defer_each(cg_release, values, 4);
+    cg_work(values[0]);
+_S
+
+void cg_each_manual(int n) {
+    int values[4] = { n, n + 1, n + 2, n + 3 };
+    cg_work(values[0]);
+    for (int i = 4; i > 0; i--) cg_release(&values[i - 1]);
+}
+
+} // extern "C"
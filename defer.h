@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define _CAT_IMPL(a, b) a##b
 #define _CAT(a, b) _CAT_IMPL(a, b)
@@ -24,6 +25,39 @@
   #define _UNIQUER __LINE__
 #endif
 
+// Compile error unless the thunk of DEFER_TYPED(fn, type) can read var
+// through a type*: var has that type, or both are object pointers (char* for
+// void*, say), or both are integers of the same size. The assignment also
+// gets the usual diagnostics for converting var to type. Elsewhere there's
+// only the assignment and a size check.
+#if defined(__GNUC__) && !defined(__PCC__)
+  // __builtin_classify_type: 1 to 4 are the integer kinds, 5 pointers
+  #define _DFR_TYPED_CLASS(x) \
+      (__builtin_classify_type(x) >= 1 && __builtin_classify_type(x) <= 4 ? 1 : __builtin_classify_type(x))
+  #define _DFR_TYPED_CHECK(fn, var) \
+      ((void)sizeof(*(_dfr_typed_type_##fn*)0 = (var)), \
+       (void)sizeof(char[__builtin_types_compatible_p(__typeof__(var), _dfr_typed_type_##fn) || \
+           (sizeof(var) == sizeof(_dfr_typed_type_##fn) && \
+            _DFR_TYPED_CLASS(var) == _DFR_TYPED_CLASS(*(_dfr_typed_type_##fn*)0) && \
+            (_DFR_TYPED_CLASS(var) == 1 || _DFR_TYPED_CLASS(var) == 5)) ? 1 : -1]))
+#else
+  #define _DFR_TYPED_CHECK(fn, var) \
+      ((void)sizeof(*(_dfr_typed_type_##fn*)0 = (var)), \
+       (void)sizeof(char[sizeof(var) == sizeof(_dfr_typed_type_##fn) ? 1 : -1]))
+#endif
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+  #define _dfr_thread_local _Thread_local
+#elif defined(__GNUC__)
+  #define _dfr_thread_local __thread
+#elif defined(_MSC_VER)
+  #define _dfr_thread_local __declspec(thread)
+#endif
+
+#if defined(USE_TLS_DEFER) && !defined(USE_C99_DEFER)
+  #define USE_C99_DEFER
+#endif
+
 #ifdef __has_attribute
   #if !__has_attribute(cleanup)
       #define USE_C99_DEFER
@@ -32,40 +66,744 @@
   #define USE_C99_DEFER
 #endif
 
+#ifdef USE_TLS_DEFER
+  #define USING_TLS_DEFER 1
+#else
+  #define USING_TLS_DEFER 0
+#endif
+
 #ifdef USE_C99_DEFER
   #define USING_GNUC_DEFER 0
-  #ifdef SCOPE_MACRO_STACK_AVAILABLE
+  #ifdef DEFER_SCOPE_ENUM
+    #define USING_SCOPE_ENUM 1
+    #define USING_MACRO_STACK 0
+  #elif defined(SCOPE_MACRO_STACK_AVAILABLE)
+    #define USING_SCOPE_ENUM 0
     #define USING_MACRO_STACK 1
   #else
+    #define USING_SCOPE_ENUM 0
     #define USING_MACRO_STACK 0
   #endif
 #else
   #define USING_GNUC_DEFER 1
+  #define USING_SCOPE_ENUM 0
   #define USING_MACRO_STACK 0
 #endif
 
+// The C99 version can redefine return and the loop keywords for the rest of
+// the translation unit, and a system header included after that would get
+// them in its inline functions (pthread_equal, the _FORTIFY_SOURCE wrappers).
+// The ones the companion headers use are included here, ahead of the keyword
+// macros, so those headers work whichever way round they're included. Your
+// own headers with inline functions still have to come before defer.h.
+#if defined(USE_C99_DEFER) && (defined(__unix__) || defined(__APPLE__))
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#define _DFR_HAVE_PTHREAD 1
+#endif
+
+// Error paths (errdefers, returnerr unwinding) are hinted as unlikely, so the
+// success path is laid out straight and GCC moves the rest to .text.unlikely
+#ifdef __GNUC__
+  #define _dfr_unlikely(x) __builtin_expect(!!(x), 0)
+#else
+  #define _dfr_unlikely(x) (x)
+#endif
+
+// State shared by every translation unit: one weak definition per TU, merged
+// by the linker. Without weak symbols each TU gets its own copy.
+#if defined(__GNUC__) && !defined(_WIN32) && !defined(__CYGWIN__) && !defined(__PCC__)
+  #define _dfr_shared __attribute__((weak))
+#else
+  #define _dfr_shared static
+#endif
+
+// The batches of defer_io.h and defer_ref.h: an array that starts out in the
+// scope's own frame and moves to the heap, doubling, once it's full. The
+// flush that empties it calls _dfr_batch_free.
+typedef struct _dfr_Batch {
+    void* ops;
+    unsigned len;
+    unsigned cap;
+    bool on_heap;   // ops has outgrown the scope's own array
+} _dfr_Batch;
+
+#ifdef __GNUC__
+__attribute__((noinline, cold))
+#endif
+static void _dfr_batch_grow(_dfr_Batch* batch, size_t size) {
+    unsigned cap = batch->cap * 2;
+    void* ops = batch->on_heap ? realloc(batch->ops, cap * size) : malloc(cap * size);
+    if (!ops) {
+        fputs("defer.h: out of memory growing a batch\n", stderr);
+        abort();
+    }
+    if (!batch->on_heap) {
+        memcpy(ops, batch->ops, batch->len * size);
+    }
+    batch->ops = ops;
+    batch->cap = cap;
+    batch->on_heap = true;
+}
+
+// Room for one more op of the given size, at the end
+static inline void* _dfr_batch_push(_dfr_Batch* batch, size_t size) {
+    if (batch->len == batch->cap) _dfr_batch_grow(batch, size);
+    return (char*)batch->ops + (size_t)batch->len++ * size;
+}
+
+static inline void _dfr_batch_free(_dfr_Batch* batch) {
+    batch->len = 0;
+    if (batch->on_heap) {
+        free(batch->ops);
+    }
+}
+
+#define _dfr_batch_decl(name, type, n) \
+    type _CAT(name, _mem)[(n) > 0 ? (n) : 1]; \
+    _dfr_Batch name = { _CAT(name, _mem), 0, (unsigned)(sizeof(_CAT(name, _mem)) / sizeof(type)), false }
+
+// Shared by DEFER_PROFILE and DEFER_TRACE below, and DEFER_LOCK_PROFILE in
+// defer_lock.h
+#if defined(DEFER_PROFILE) || defined(DEFER_TRACE) || defined(DEFER_LOCK_PROFILE)
+#ifndef __GNUC__
+#error "DEFER_PROFILE, DEFER_TRACE and DEFER_LOCK_PROFILE need GCC or clang (__atomic builtins)"
+#endif
+#ifndef _dfr_thread_local
+#error "DEFER_PROFILE, DEFER_TRACE and DEFER_LOCK_PROFILE need thread-local storage"
+#endif
+
+#include <stdint.h>
+#include <time.h>
+
+// Cycle counter: no syscall and no serialization, a few ns per read
+static inline uint64_t _dfr_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return (uint64_t)clock();
+#endif
+}
+#endif
+
+// Cleanup profiling. With DEFER_PROFILE defined, every defer/errdefer site
+// gets a static descriptor (file:line and cleanup name), and every cleanup
+// call goes through _dfr_invoke, which times it and adds it to a per-thread
+// record for that site: call count, total cycles, and a log2 histogram of
+// cycles per call. Records are only ever written by their own thread, so the
+// counters need no locks; threads and sites are published on lock-free lists.
+// defer_profile_dump(FILE*) prints everything, and so does exit, to the file
+// in $DEFER_PROFILE_OUT or DEFER_PROFILE_FILE (default defer_profile.txt).
+// tdefer/terrdefer and deferblock don't go through nodes and aren't profiled.
+//
+// Without DEFER_PROFILE none of this exists, and the generated code is
+// byte-identical to a build without the profiler (make codegen-identical).
+#ifdef DEFER_PROFILE
+#ifndef DEFER_PROFILE_FILE
+#define DEFER_PROFILE_FILE "defer_profile.txt"
+#endif
+
+#define _DFR_PROF_BUCKETS 32
+#define _DFR_PROF_PAGE 64      // records per page
+#define _DFR_PROF_PAGES 1024   // pages per thread, so up to 65536 sites
+
+typedef struct _dfr_ProfSite {
+    const char* file;
+    int line;
+    const char* func;
+    unsigned id;                 // 0 until the first call, then 1 based
+    struct _dfr_ProfSite* next;  // list of every site that has been called
+} _dfr_ProfSite;
+
+typedef struct _dfr_ProfRecord {
+    uint64_t calls;
+    uint64_t cycles;
+    uint64_t hist[_DFR_PROF_BUCKETS];  // [i]: calls taking [2^i, 2^(i+1)) cycles
+} _dfr_ProfRecord;
+
+typedef struct _dfr_ProfThread {
+    _dfr_ProfRecord* pages[_DFR_PROF_PAGES];
+    struct _dfr_ProfThread* next;
+} _dfr_ProfThread;
+
+_dfr_shared _dfr_ProfSite* _dfr_prof_sites;
+_dfr_shared _dfr_ProfThread* _dfr_prof_threads;
+_dfr_shared unsigned _dfr_prof_next_id;
+_dfr_shared int _dfr_prof_exit_hook;
+_dfr_shared _dfr_thread_local _dfr_ProfThread* _dfr_prof_self;
+
+static inline void defer_profile_dump(FILE* out) {
+    fprintf(out, "# site\tcleanup\tcalls\tcycles\tmean\thistogram (log2 cycles:calls)\n");
+    _dfr_ProfSite* site = __atomic_load_n(&_dfr_prof_sites, __ATOMIC_ACQUIRE);
+    for (; site; site = site->next) {
+        _dfr_ProfRecord total = {0, 0, {0}};
+        unsigned index = site->id - 1;
+        _dfr_ProfThread* thread = __atomic_load_n(&_dfr_prof_threads, __ATOMIC_ACQUIRE);
+        for (; thread; thread = thread->next) {
+            _dfr_ProfRecord* page = __atomic_load_n(&thread->pages[index / _DFR_PROF_PAGE], __ATOMIC_ACQUIRE);
+            if (!page) continue;
+            _dfr_ProfRecord* record = &page[index % _DFR_PROF_PAGE];
+            total.calls += __atomic_load_n(&record->calls, __ATOMIC_RELAXED);
+            total.cycles += __atomic_load_n(&record->cycles, __ATOMIC_RELAXED);
+            for (int b = 0; b < _DFR_PROF_BUCKETS; b++) {
+                total.hist[b] += __atomic_load_n(&record->hist[b], __ATOMIC_RELAXED);
+            }
+        }
+        if (!total.calls) continue;
+        fprintf(out, "%s:%d\t%s\t%llu\t%llu\t%.1f\t", site->file, site->line, site->func,
+            (unsigned long long)total.calls, (unsigned long long)total.cycles,
+            (double)total.cycles / (double)total.calls);
+        for (int b = 0; b < _DFR_PROF_BUCKETS; b++) {
+            if (total.hist[b]) fprintf(out, " %d:%llu", b, (unsigned long long)total.hist[b]);
+        }
+        fputc('\n', out);
+    }
+}
+
+static inline int defer_profile_dump_file(const char* path) {
+    FILE* out = fopen(path, "w");
+    if (!out) return -1;
+    defer_profile_dump(out);
+    return fclose(out);
+}
+
+static void _dfr_prof_dump_at_exit(void) {
+    const char* path = getenv("DEFER_PROFILE_OUT");
+    defer_profile_dump_file(path && *path ? path : DEFER_PROFILE_FILE);
+}
+
+// First call of a site: give it an id and publish it. Once the ids run out
+// the counter stays put, since sites without one come back on every call.
+__attribute__((noinline, cold))
+static unsigned _dfr_prof_register(_dfr_ProfSite* site) {
+    unsigned id = 0;
+    unsigned fresh = __atomic_load_n(&_dfr_prof_next_id, __ATOMIC_RELAXED);
+    do {
+        if (fresh >= _DFR_PROF_PAGE * _DFR_PROF_PAGES) return 0;
+    } while (!__atomic_compare_exchange_n(&_dfr_prof_next_id, &fresh, fresh + 1, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    fresh++;
+    if (!__atomic_compare_exchange_n(&site->id, &id, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return id;  // another thread got there first
+    }
+    site->next = __atomic_load_n(&_dfr_prof_sites, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&_dfr_prof_sites, &site->next, site, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    if (__atomic_exchange_n(&_dfr_prof_exit_hook, 1, __ATOMIC_ACQ_REL) == 0) {
+        atexit(_dfr_prof_dump_at_exit);
+    }
+    return fresh;
+}
+
+// First call of a site on this thread. Threads' records are never freed, so
+// they can still be dumped after the thread is gone.
+__attribute__((noinline, cold))
+static _dfr_ProfRecord* _dfr_prof_record_slow(unsigned index) {
+    _dfr_ProfThread* self = _dfr_prof_self;
+    if (!self) {
+        self = (_dfr_ProfThread*)calloc(1, sizeof(*self));
+        if (!self) return NULL;
+        self->next = __atomic_load_n(&_dfr_prof_threads, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&_dfr_prof_threads, &self->next, self, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+        _dfr_prof_self = self;
+    }
+    _dfr_ProfRecord* page = self->pages[index / _DFR_PROF_PAGE];
+    if (!page) {
+        page = (_dfr_ProfRecord*)calloc(_DFR_PROF_PAGE, sizeof(*page));
+        if (!page) return NULL;
+        __atomic_store_n(&self->pages[index / _DFR_PROF_PAGE], page, __ATOMIC_RELEASE);
+    }
+    return &page[index % _DFR_PROF_PAGE];
+}
+
+// Single writer per record: plain read, relaxed store so dumps don't race
+#define _dfr_prof_add(field, value) \
+    __atomic_store_n(&(field), (field) + (value), __ATOMIC_RELAXED)
+
+__attribute__((noinline))
+static void _dfr_invoke(_dfr_ProfSite* site, void (*func)(void*), void* arg) {
+    uint64_t start = _dfr_now();
+    func(arg);
+    uint64_t cycles = _dfr_now() - start;
+
+    unsigned id = __atomic_load_n(&site->id, __ATOMIC_ACQUIRE);
+    if (!id && !(id = _dfr_prof_register(site))) return;
+    unsigned index = id - 1;
+    _dfr_ProfThread* self = _dfr_prof_self;
+    _dfr_ProfRecord* page = self ? self->pages[index / _DFR_PROF_PAGE] : NULL;
+    _dfr_ProfRecord* record = page ? &page[index % _DFR_PROF_PAGE] : _dfr_prof_record_slow(index);
+    if (!record) return;
+
+    int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+    if (bucket >= _DFR_PROF_BUCKETS) bucket = _DFR_PROF_BUCKETS - 1;
+    _dfr_prof_add(record->calls, 1);
+    _dfr_prof_add(record->cycles, cycles);
+    _dfr_prof_add(record->hist[bucket], 1);
+}
+
+#define _DFR_PROF_SITE(cleanup_func) \
+    ({ static _dfr_ProfSite _dfr_site = { __FILE__, __LINE__, #cleanup_func, 0, NULL }; &_dfr_site; })
+#define _DFR_PROF_FIELD _dfr_ProfSite* site;
+#define _DFR_PROF_INIT(cleanup_func) , .site = _DFR_PROF_SITE(cleanup_func)
+#define _DFR_PROF_ARG(cleanup_func) , _DFR_PROF_SITE(cleanup_func)
+#define _DFR_PROF_PARAM , _dfr_ProfSite* site
+#define _DFR_INVOKE_AS(node, func, arg) _dfr_invoke((node)->site, (func), (arg))
+#else
+#define _DFR_PROF_FIELD
+#define _DFR_PROF_INIT(cleanup_func)
+#define _DFR_PROF_ARG(cleanup_func)
+#define _DFR_PROF_PARAM
+#define _DFR_INVOKE_AS(node, func, arg) (func)(arg)
+#endif // DEFER_PROFILE
+#define _DFR_INVOKE(node) _DFR_INVOKE_AS(node, (node)->func, (node)->arg)
+
+// Event tracing. With DEFER_TRACE defined, each thread writes fixed size
+// records into its own ring buffer of DEFER_TRACE_EVENTS events: scope enter
+// and exit, defer/errdefer registration, cleanup start and end, returnerr,
+// and in the C99 versions return/break/continue unwinds. Each record is a
+// cycle counter timestamp, the cleanup function if any, the source line and
+// the scope depth. The hot path is a thread-local load, a counter read and
+// four stores: no locks, no atomics beyond a release store of the ring head,
+// no syscalls. Only the newest DEFER_TRACE_EVENTS events per thread are kept.
+//
+// defer_trace_dump(FILE*) writes every thread's ring in a binary format read
+// by defer_trace.py, which prints a timeline or writes Chrome trace JSON.
+// Rings of threads that are still running are copied as they are, so their
+// oldest few events may already be overwritten by newer ones. At exit the
+// trace goes to $DEFER_TRACE_OUT, or DEFER_TRACE_FILE (default
+// defer_trace.bin).
+//
+// Scopes left without running their exit (goto out of a scope, say) are
+// closed in the trace at the next scope entry or exit in the enclosing code.
+#ifdef DEFER_TRACE
+#ifndef DEFER_TRACE_EVENTS
+#define DEFER_TRACE_EVENTS 4096
+#endif
+#if DEFER_TRACE_EVENTS & (DEFER_TRACE_EVENTS - 1)
+#error "DEFER_TRACE_EVENTS must be a power of two"
+#endif
+#ifndef DEFER_TRACE_FILE
+#define DEFER_TRACE_FILE "defer_trace.bin"
+#endif
+// The timestamp read per event. Under hypervisors that trap rdtsc that's
+// most of the cost; defining this to 0 keeps the order of events only.
+#ifndef DEFER_TRACE_TIMESTAMP
+#define DEFER_TRACE_TIMESTAMP() _dfr_now()
+#endif
+
+// Event kinds, also listed in defer_trace.py
+enum {
+    _DFR_EV_ENTER, _DFR_EV_EXIT, _DFR_EV_DEFER, _DFR_EV_ERRDEFER,
+    _DFR_EV_CLEANUP, _DFR_EV_CLEANUP_END, _DFR_EV_RETURN, _DFR_EV_RETURNERR,
+    _DFR_EV_BREAK, _DFR_EV_CONTINUE
+};
+
+typedef struct _dfr_TraceEvent {
+    uint64_t tsc;
+    uint64_t addr;   // cleanup function, or 0
+    uint32_t line;   // 0 for cleanups and scope exits
+    uint16_t kind;
+    uint16_t depth;  // scope depth on this thread, the same on enter and exit
+} _dfr_TraceEvent;
+
+typedef struct _dfr_TraceRing {
+    uint64_t head;   // events ever written, the newest is at head - 1
+    uint32_t thread;
+    uint32_t depth;
+    struct _dfr_TraceRing* next;
+    _dfr_TraceEvent events[DEFER_TRACE_EVENTS];
+} _dfr_TraceRing;
+
+_dfr_shared _dfr_TraceRing* _dfr_trace_rings;
+_dfr_shared uint32_t _dfr_trace_threads;
+_dfr_shared uint64_t _dfr_trace_start[2];  // cycles and clock ns at the first event
+_dfr_shared _dfr_thread_local _dfr_TraceRing* _dfr_trace_self;
+
+static inline uint64_t _dfr_trace_clock_ns(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#else
+    return (uint64_t)clock() * (1000000000u / CLOCKS_PER_SEC);
+#endif
+}
+
+// Binary dump, native endian and alignment:
+//   char magic[8] = "DFRTRACE", u32 version = 1, u32 ring size,
+//   u64 address of _dfr_trace_rings (to resolve cleanup addresses with nm),
+//   u64 cycles, u64 ns at the first event, u64 cycles, u64 ns now,
+//   then per thread: u32 thread, u32 count, count events oldest first
+static inline void defer_trace_dump(FILE* out) {
+    uint32_t header[2] = { 1, DEFER_TRACE_EVENTS };
+    uint64_t clocks[5] = { (uint64_t)(uintptr_t)&_dfr_trace_rings,
+        _dfr_trace_start[0], _dfr_trace_start[1], _dfr_now(), _dfr_trace_clock_ns() };
+    fwrite("DFRTRACE", 1, 8, out);
+    fwrite(header, sizeof(header), 1, out);
+    fwrite(clocks, sizeof(clocks), 1, out);
+    _dfr_TraceRing* ring = __atomic_load_n(&_dfr_trace_rings, __ATOMIC_ACQUIRE);
+    for (; ring; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = head > DEFER_TRACE_EVENTS ? head - DEFER_TRACE_EVENTS : 0;
+        uint32_t info[2] = { ring->thread, (uint32_t)(head - first) };
+        fwrite(info, sizeof(info), 1, out);
+        for (uint64_t i = first; i < head; i++) {
+            fwrite(&ring->events[i & (DEFER_TRACE_EVENTS - 1)], sizeof(_dfr_TraceEvent), 1, out);
+        }
+    }
+}
+
+static inline int defer_trace_dump_file(const char* path) {
+    FILE* out = fopen(path, "wb");
+    if (!out) return -1;
+    defer_trace_dump(out);
+    return fclose(out);
+}
+
+static void _dfr_trace_dump_at_exit(void) {
+    const char* path = getenv("DEFER_TRACE_OUT");
+    defer_trace_dump_file(path && *path ? path : DEFER_TRACE_FILE);
+}
+
+// First event on a thread. Rings are never freed, so they can still be dumped
+// after the thread is gone.
+__attribute__((noinline, cold))
+static _dfr_TraceRing* _dfr_trace_attach(void) {
+    _dfr_TraceRing* ring = (_dfr_TraceRing*)calloc(1, sizeof(*ring));
+    if (!ring) return NULL;
+    ring->thread = __atomic_add_fetch(&_dfr_trace_threads, 1, __ATOMIC_RELAXED);
+    if (ring->thread == 1) {
+        _dfr_trace_start[0] = _dfr_now();
+        _dfr_trace_start[1] = _dfr_trace_clock_ns();
+        atexit(_dfr_trace_dump_at_exit);
+    }
+    ring->next = __atomic_load_n(&_dfr_trace_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&_dfr_trace_rings, &ring->next, ring, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    _dfr_trace_self = ring;
+    return ring;
+}
+
+static inline void _dfr_trace(unsigned kind, uintptr_t addr, unsigned line) {
+    _dfr_TraceRing* ring = _dfr_trace_self;
+    if (__builtin_expect(!ring, 0) && !(ring = _dfr_trace_attach())) return;
+    uint64_t head = ring->head;
+    _dfr_TraceEvent* event = &ring->events[head & (DEFER_TRACE_EVENTS - 1)];
+    event->tsc = DEFER_TRACE_TIMESTAMP();
+    event->addr = addr;
+    event->line = line;
+    event->kind = (uint16_t)kind;
+    event->depth = (uint16_t)ring->depth;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Scope exits down to depth (one per scope still open above it)
+static inline void _dfr_trace_close(unsigned depth) {
+    _dfr_TraceRing* ring = _dfr_trace_self;
+    if (!ring) return;
+    for (; ring->depth > depth; ) {
+        ring->depth--;
+        _dfr_trace(_DFR_EV_EXIT, 0, 0);
+    }
+}
+
+// Enter a scope at depth, or at the thread's current depth with
+// _DFR_TRACE_TOP. Returns the scope's depth for the matching close.
+#define _DFR_TRACE_TOP 0xffffffffu
+static inline unsigned _dfr_trace_open(unsigned depth, unsigned line) {
+    _dfr_TraceRing* ring = _dfr_trace_self;
+    if (__builtin_expect(!ring, 0) && !(ring = _dfr_trace_attach())) return 0;
+    if (depth == _DFR_TRACE_TOP) depth = ring->depth;
+    _dfr_trace_close(depth);
+    ring->depth = depth;
+    _dfr_trace(_DFR_EV_ENTER, 0, line);
+    ring->depth = depth + 1;
+    return depth;
+}
+
+static inline void _dfr_trace_call(void (*func)(void*)) {
+    _dfr_trace(_DFR_EV_CLEANUP, (uintptr_t)func, 0);
+}
+
+static inline void _dfr_trace_called(void (*func)(void*)) {
+    _dfr_trace(_DFR_EV_CLEANUP_END, (uintptr_t)func, 0);
+}
+
+// C99 keyword hooks: nothing is recorded outside of S_ _S scopes
+static inline void _dfr_trace_keyword(unsigned kind, bool in_scope, unsigned line) {
+    if (in_scope) _dfr_trace(kind, 0, line);
+}
+
+// After the cleanups of a return/break/continue: close the scopes it left
+static inline void _dfr_trace_unwound(bool in_scope, unsigned depth) {
+    if (in_scope) _dfr_trace_close(depth);
+}
+
+static inline void _dfr_trace_scope_exit(unsigned* depth) {
+    _dfr_trace_close(*depth);
+}
+
+#define _DFR_TRACE_DEFER(kind, cleanup_func) \
+    (_dfr_trace(kind, (uintptr_t)(cleanup_func), __LINE__), (cleanup_func))
+// The cleanup can register defers of its own, and with USE_TLS_DEFER those
+// can reuse or realloc the record node points into, so it's read up front
+#define _DFR_CALL(node) ({ \
+    void (*_dfr_call_func)(void*) = (node)->func; \
+    void* _dfr_call_arg = (node)->arg; \
+    _dfr_trace_call(_dfr_call_func); \
+    _DFR_INVOKE_AS(node, _dfr_call_func, _dfr_call_arg); \
+    _dfr_trace_called(_dfr_call_func); \
+})
+// GNU C: the cleanup attribute closes the scope on every way out
+#define _DFR_TRACE_GNU_SCOPE \
+    unsigned _dfr_trace_depth __attribute__((cleanup(_dfr_trace_scope_exit), unused)) = \
+        _dfr_trace_open(_DFR_TRACE_TOP, __LINE__);
+#define _DFR_TRACE_GNU_RETURNERR _dfr_trace(_DFR_EV_RETURNERR, 0, __LINE__),
+// C99: a scope's depth is its lexical parent's plus one, and base is the
+// depth of the function's outermost scope, where return closes to. Like the
+// break and continue contexts, _dfr_trace_break/_continue hold the depth the
+// innermost loop or switch's body starts at, or _DFR_TRACE_TOP outside of one
+// (which unwinds to base).
+#define _DFR_TRACE_OPEN \
+    unsigned _dfr_trace_parent = _dfr_trace_depth, _dfr_trace_parent_base = _dfr_trace_base; \
+    unsigned _dfr_trace_parent_break = _dfr_trace_break, _dfr_trace_parent_continue = _dfr_trace_continue; \
+    unsigned _dfr_trace_depth = _dfr_trace_open(_dfr_ctx ? _dfr_trace_parent + 1 : _DFR_TRACE_TOP, __LINE__); \
+    unsigned _dfr_trace_base __attribute__((unused)) = _dfr_ctx ? _dfr_trace_parent_base : _dfr_trace_depth; \
+    unsigned _dfr_trace_break __attribute__((unused)) = _dfr_trace_parent_break; \
+    unsigned _dfr_trace_continue __attribute__((unused)) = _dfr_trace_parent_continue;
+#define _DFR_TRACE_CLOSE _dfr_trace_close(_dfr_trace_depth);
+#define _DFR_TRACE_KW(kind) _dfr_trace_keyword(kind, _dfr_ctx != NULL, __LINE__),
+#define _DFR_TRACE_RET , _dfr_trace_unwound(_dfr_ctx != NULL, _dfr_trace_base)
+#define _DFR_TRACE_TO(target) , _dfr_trace_unwound(_dfr_ctx != NULL, \
+    target == _DFR_TRACE_TOP ? _dfr_trace_base : target)
+// break_to closes down to the labelled scope's own depth
+#define _DFR_TRACE_LABEL(name) const unsigned _dfr_trace_label_##name = _dfr_trace_depth; \
+    (void)_dfr_trace_label_##name;
+#else
+#define _DFR_TRACE_DEFER(kind, cleanup_func) cleanup_func
+#define _DFR_CALL(node) _DFR_INVOKE(node)
+#define _DFR_TRACE_GNU_SCOPE
+#define _DFR_TRACE_GNU_RETURNERR
+#define _DFR_TRACE_OPEN
+#define _DFR_TRACE_CLOSE
+#define _DFR_TRACE_KW(kind)
+#define _DFR_TRACE_RET
+#define _DFR_TRACE_TO(target)
+#define _DFR_TRACE_LABEL(name)
+#endif // DEFER_TRACE
+
+// Fast exit: cleanups registered with defer_mem/errdefer_mem only give memory
+// back, which is wasted work when the process is about to end anyway. Once
+// defer_fast_exit() has been called, from any thread, every scope exit skips
+// them and still runs the other cleanups (flush, unlink, unlock...).
+//     char* buf = malloc(n);
+//     defer_mem(free_ptr, buf);   // skipped after defer_fast_exit()
+//     defer(flush_log, log);      // always runs
+// There's no way back, it's meant to be called once shutdown has started.
+// Without weak symbols (see _dfr_shared) it only affects the calling TU.
+_dfr_shared int _dfr_fast_exit_flag;
+
+static inline void defer_fast_exit(void) {
+#ifdef __GNUC__
+    __atomic_store_n(&_dfr_fast_exit_flag, 1, __ATOMIC_RELAXED);
+#else
+    *(volatile int*)&_dfr_fast_exit_flag = 1;
+#endif
+}
+
+static inline bool defer_fast_exiting(void) {
+#ifdef __GNUC__
+    return __atomic_load_n(&_dfr_fast_exit_flag, __ATOMIC_RELAXED) != 0;
+#else
+    return *(volatile int*)&_dfr_fast_exit_flag != 0;
+#endif
+}
+
+// Flagging the node itself would grow every defer, so where the executor
+// can't check the switch (the linked list and TLS versions, and the GNU C
+// nodes defer_longjmp calls directly) defer_mem goes through a descriptor
+// like defer_each, whose cleanup checks it first.
+typedef struct _dfr_MemDesc {
+    void (*func)(void*);
+    void* arg;
+} _dfr_MemDesc;
+
+static inline void _dfr_run_mem(void* arg) {
+    _dfr_MemDesc* mem = (_dfr_MemDesc*)arg;
+    if (!defer_fast_exiting()) mem->func(mem->arg);
+}
+
+// longjmp across defer scopes, opt-in with DEFER_LONGJMP. A plain longjmp
+// skips the cleanups of every scope it leaves; defer_longjmp first runs every
+// defer and errdefer registered since the matching defer_setjmp, newest first
+// and as if each skipped scope had ended in returnerr, then jumps:
+//     defer_jmp_buf on_error;
+//     if (defer_setjmp(on_error)) {
+//         return -1;             // every scope eval() was in is cleaned up
+//     }
+//     eval(tree, &on_error);     // anywhere below: defer_longjmp(*env, 1);
+// defer_setjmp has the same restrictions as setjmp (call it as a whole
+// condition). Defers the setjmp scope itself registers after defer_setjmp
+// count as skipped too: the jump runs them, and that scope's exit doesn't run
+// them again. The GNU C and linked list versions find the skipped defers
+// through a thread-local list of their nodes and scopes, which costs a couple
+// of stores per defer or scope and is why this is opt-in. The TLS stack
+// already is such a list. Only defer and errdefer (and what's built on them)
+// are seen: in GNU C, cleanupdecl and deferblock are plain cleanup attributes
+// and are skipped like with longjmp.
+// Without weak symbols (see _dfr_shared) only defers from the calling TU are.
+#ifdef DEFER_LONGJMP
+#include <setjmp.h>
+
+#ifndef _dfr_thread_local
+#error "DEFER_LONGJMP needs thread-local storage (C11 _Thread_local, __thread or __declspec(thread))"
+#endif
+
+typedef struct defer_jmp_buf {
+    jmp_buf buf;
+#ifdef USE_TLS_DEFER
+    unsigned mark;  // defer stack top at defer_setjmp
+#else
+    void* mark;     // newest node or scope at defer_setjmp
+#endif
+#if !defined(__GNUC__) || defined(USE_C99_DEFER)
+    unsigned seq;   // the marked scope's next seq at defer_setjmp
+#endif
+} defer_jmp_buf;
+
+#ifndef USE_TLS_DEFER
+_dfr_shared _dfr_thread_local void* _dfr_jmp_top;
+
+// Entries are always popped before their scope ends, which GCC 12+ can't
+// see through and warns about in the linked list version
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdangling-pointer"
+#endif
+static inline void* _dfr_jmp_push(void* entry) {
+    void* next = _dfr_jmp_top;
+    _dfr_jmp_top = entry;
+    return next;
+}
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#pragma GCC diagnostic pop
+#endif
+
+#define _DFR_JMP_FIELD void* _dfr_jmp_next;
+#define _DFR_JMP_POP(entry) _dfr_jmp_top = (entry)->_dfr_jmp_next;
+#endif
+
+#define defer_setjmp(env) setjmp(*_dfr_jmp_mark(&(env)))
+#define defer_longjmp(env, val) _dfr_longjmp(&(env), (val))
+#endif // DEFER_LONGJMP
+
+#ifndef _DFR_JMP_FIELD
+#define _DFR_JMP_FIELD
+#define _DFR_JMP_POP(entry)
+#endif
+
+// Array cleanups: one defer covering count elements of array, cleaned up in
+// reverse index order with a pointer to each element, like a defer per
+// element would. The array and count are read at registration.
+//     FILE* files[16] = {0};
+//     defer_each(close_file, files, 16);  // close_file(&files[15]) ... (&files[0])
+// Shared by both versions, and defined before either redefines keywords.
+typedef struct _dfr_EachDesc {
+    void (*func)(void*);
+    char* base;
+    size_t size;
+    size_t count;
+} _dfr_EachDesc;
+
+static inline void _dfr_run_each(void* arg) {
+    _dfr_EachDesc* each = (_dfr_EachDesc*)arg;
+    size_t i = each->count;
+    while (i > 0) {
+        i--;
+        each->func(each->base + i * each->size);
+    }
+}
+
+#define _dfr_each_impl(kind, cleanup_func, array, count, unique) \
+    _dfr_EachDesc _CAT(_dfr_each, unique) = \
+        { cleanup_func, (char*)(array), sizeof((array)[0]), (size_t)(count) }; \
+    kind(_dfr_run_each, _CAT(_dfr_each, unique))
+
+#define defer_each(cleanup_func, array, count) \
+    _dfr_each_impl(defer, cleanup_func, array, count, _UNIQUER)
+#define errdefer_each(cleanup_func, array, count) \
+    _dfr_each_impl(errdefer, cleanup_func, array, count, _UNIQUER)
+
 #if defined (__GNUC__) && !defined(USE_C99_DEFER)
 
 typedef struct _dfr_DeferNode {
+    _DFR_JMP_FIELD
     void (*func)(void*);
     void* arg;
+    _DFR_PROF_FIELD
 } _dfr_DeferNode;
 
+// Starts like _dfr_DeferNode, so defer_longjmp can run either
 typedef struct _dfr_ErrDeferNode {
+    _DFR_JMP_FIELD
     void (*func)(void*);
     void* arg;
+    _DFR_PROF_FIELD
     bool* err_occurred;
 } _dfr_ErrDeferNode;
 
 static void _dfr_execute_defer (_dfr_DeferNode* node) {
-    node->func(node->arg);
+    _DFR_JMP_POP(node)
+    _DFR_CALL(node);
 } 
 
+// Only runs after returnerr: hinted so the call lands in the caller's cold
+// part, and a successful exit pays one load and a predicted branch
 static void _dfr_execute_errdefer (_dfr_ErrDeferNode* node) {
-    if (*node->err_occurred) node->func(node->arg);
+    _DFR_JMP_POP(node)
+    if (_dfr_unlikely(*node->err_occurred)) _DFR_CALL(node);
 } 
 
-#define S_ { bool _dfr_err __attribute__((unused)) = false;
+#ifndef DEFER_LONGJMP
+static void _dfr_execute_memdefer (_dfr_DeferNode* node) {
+    if (!defer_fast_exiting()) _DFR_CALL(node);
+}
+
+static void _dfr_execute_memerrdefer (_dfr_ErrDeferNode* node) {
+    if (_dfr_unlikely(*node->err_occurred) && !defer_fast_exiting()) _DFR_CALL(node);
+}
+#endif
+
+#ifdef DEFER_LONGJMP
+#define _DFR_JMP_INIT(name) ._dfr_jmp_next = _dfr_jmp_push(&(name)),
+
+static inline jmp_buf* _dfr_jmp_mark(defer_jmp_buf* env) {
+    env->mark = _dfr_jmp_top;
+    return &env->buf;
+}
+
+// The cleanup attributes of the frames being skipped never run, so every node
+// they'd have run is called here instead, errdefers included
+__attribute__((noinline, cold, noreturn))
+static void _dfr_longjmp(defer_jmp_buf* env, int val) {
+    while (_dfr_jmp_top != env->mark) {
+        _dfr_DeferNode* node = (_dfr_DeferNode*)_dfr_jmp_top;
+        _dfr_jmp_top = node->_dfr_jmp_next;
+        _DFR_CALL(node);
+    }
+    longjmp(env->buf, val);
+}
+#else
+#define _DFR_JMP_INIT(name)
+#endif // DEFER_LONGJMP
+
+#define S_ { bool _dfr_err __attribute__((unused)) = false; _DFR_TRACE_GNU_SCOPE
 #ifdef __clang__
 #define _S _Pragma("GCC diagnostic push") \
     _Pragma("GCC diagnostic ignored \"-Wreturn-type\"") \
@@ -74,18 +812,104 @@ static void _dfr_execute_errdefer (_dfr_ErrDeferNode* node) {
 #define _S }
 #endif
 
+// One node per defer, run by its executor through the cleanup attribute
+#define _dfr_node_impl(type, executor, kind, cleanup_func, var, name, ...) \
+    type name __attribute__((cleanup(executor))) = \
+    (type){_DFR_JMP_INIT(name) .func = _DFR_TRACE_DEFER(kind, cleanup_func), .arg = &var \
+        __VA_ARGS__ _DFR_PROF_INIT(cleanup_func)};
+
 #define defer(cleanup_func, var) \
-    _dfr_DeferNode _CAT(_defer, __COUNTER__) __attribute__((cleanup(_dfr_execute_defer))) = \
-    (_dfr_DeferNode){.func = cleanup_func, .arg = &var};
+    _dfr_node_impl(_dfr_DeferNode, _dfr_execute_defer, _DFR_EV_DEFER, \
+        cleanup_func, var, _CAT(_defer, __COUNTER__))
 
 // If you can defer at declaration time, this is lighter than defer
 #define cleanupdecl(lvalue, rvalue, cleanup_fn) lvalue __attribute__((cleanup(cleanup_fn))) = rvalue
 
 #define errdefer(cleanup_func, var) \
-    _dfr_ErrDeferNode _CAT(_defer, __COUNTER__) __attribute__((cleanup(_dfr_execute_errdefer))) = \
-    (_dfr_ErrDeferNode){.func = cleanup_func, .arg = &var, .err_occurred = &_dfr_err};
+    _dfr_node_impl(_dfr_ErrDeferNode, _dfr_execute_errdefer, _DFR_EV_ERRDEFER, \
+        cleanup_func, var, _CAT(_defer, __COUNTER__), , .err_occurred = &_dfr_err)
+
+// Memory-only defers, see defer_fast_exit(). defer_longjmp calls nodes
+// directly instead of through their executor, so there they take the
+// descriptor like the other versions.
+#ifndef DEFER_LONGJMP
+#define defer_mem(cleanup_func, var) \
+    _dfr_node_impl(_dfr_DeferNode, _dfr_execute_memdefer, _DFR_EV_DEFER, \
+        cleanup_func, var, _CAT(_defer, __COUNTER__))
+
+#define errdefer_mem(cleanup_func, var) \
+    _dfr_node_impl(_dfr_ErrDeferNode, _dfr_execute_memerrdefer, _DFR_EV_ERRDEFER, \
+        cleanup_func, var, _CAT(_defer, __COUNTER__), , .err_occurred = &_dfr_err)
+#else
+#define _dfr_mem_impl(kind, cleanup_func, var, unique) \
+    _dfr_MemDesc _CAT(_dfr_mem, unique) = { cleanup_func, &(var) }; \
+    kind(_dfr_run_mem, _CAT(_dfr_mem, unique))
+
+#define defer_mem(cleanup_func, var) _dfr_mem_impl(defer, cleanup_func, var, _UNIQUER)
+#define errdefer_mem(cleanup_func, var) _dfr_mem_impl(errdefer, cleanup_func, var, _UNIQUER)
+#endif
+
+#define returnerr if (_DFR_TRACE_GNU_RETURNERR ( _dfr_err = true), 0) {} else return
+
+// Labelled scopes, see break_to below. The enum constant only exists so that
+// break_to fails to compile outside of the scope it names; the cleanup
+// attributes already run on a goto out of their scope.
+#define S_LABEL(name) S_ enum { _dfr_label_##name };
+#define break_to(name) if ((void)_dfr_label_##name, 0) {} else goto _dfr_end_##name
+
+// Typed defers call the cleanup function directly with the variable's real
+// type, so `fclose(FILE*)` or `free(void*)` work without a void* wrapper.
+// Declare each cleanup function once at file scope:
+//     DEFER_TYPED(fclose, FILE*);
+// then use tdefer(fclose, f) / terrdefer(fclose, f) in S_ _S scopes.
+// The variable is still captured by reference, the call sees its value at
+// scope exit. A variable the thunk can't read as type (see _DFR_TYPED_CHECK)
+// is a compile error rather than a cast. Here the cleanup attribute points
+// straight at a thunk with a known callee, so the call can be inlined.
+#ifndef DEFER_LONGJMP
+#define DEFER_TYPED(fn, type) \
+    typedef type _dfr_typed_type_##fn; \
+    static inline void _dfr_typed_##fn(void* const* ref) { fn(*(type*)*ref); } \
+    static inline void _dfr_typed_err_##fn(_dfr_ErrDeferNode* node) { \
+        if (_dfr_unlikely(*node->err_occurred)) fn(*(type*)node->arg); \
+    } \
+    struct _dfr_typed_##fn##_declared
+
+#define tdefer(fn, var) \
+    void* const _CAT(_defer, __COUNTER__) __attribute__((cleanup(_dfr_typed_##fn))) = \
+    (_DFR_TYPED_CHECK(fn, var), (void)sizeof((fn(var)), 0), (void*)&(var));
+
+#define terrdefer(fn, var) \
+    _dfr_ErrDeferNode _CAT(_defer, __COUNTER__) __attribute__((cleanup(_dfr_typed_err_##fn))) = \
+    (_dfr_ErrDeferNode){.func = NULL, .arg = (_DFR_TYPED_CHECK(fn, var), (void)sizeof((fn(var)), 0), &(var)), .err_occurred = &_dfr_err};
+#else
+// defer_longjmp has to be able to run them, so they're ordinary nodes with a
+// void* wrapper, as in the C99 version
+#define DEFER_TYPED(fn, type) \
+    typedef type _dfr_typed_type_##fn; \
+    static inline void _dfr_typed_##fn(void* arg) { fn(*(type*)arg); } \
+    struct _dfr_typed_##fn##_declared
 
-#define returnerr if (( _dfr_err = true), 0) {} else return
+#define tdefer(fn, var) defer(_dfr_typed_##fn, *(_DFR_TYPED_CHECK(fn, var), &(var)))
+#define terrdefer(fn, var) errdefer(_dfr_typed_##fn, *(_DFR_TYPED_CHECK(fn, var), &(var)))
+#endif // DEFER_LONGJMP
+
+// Inline cleanup blocks: deferblock(close(fd);) runs the statements on scope
+// exit, errdeferblock(...) only after returnerr. GCC nested functions
+// give the block a direct call from the cleanup attribute, so no trampoline
+// or executable stack is involved and the body is inlined at each exit.
+// Locals are seen by reference, as with defer. Don't return from the block.
+#if !defined(__clang__)
+#define DEFER_BLOCKS_AVAILABLE 1
+#define _dfr_block_impl(guard, unique, ...) \
+    void _CAT(_dfr_block_fn, unique)(char* _dfr_unused __attribute__((unused))) { \
+        guard { __VA_ARGS__ } \
+    } \
+    char _CAT(_dfr_block, unique) __attribute__((cleanup(_CAT(_dfr_block_fn, unique)))) = 0;
+
+#define deferblock(...) _dfr_block_impl(, __COUNTER__, __VA_ARGS__)
+#define errdeferblock(...) _dfr_block_impl(if (_dfr_unlikely(_dfr_err)), __COUNTER__, __VA_ARGS__)
+#endif // !__clang__
 
 #ifdef DONT_REDEFINE_KEYWORDS
 #define RETURN return
@@ -101,18 +925,25 @@ static void _dfr_execute_errdefer (_dfr_ErrDeferNode* node) {
 
 #else
 
+#ifndef USE_TLS_DEFER
+
 typedef struct _dfr_DeferNode {
     struct _dfr_DeferNode* next;
-    bool is_err;
+    unsigned seq;   // registration order within the scope
     void (*func)(void*);
     void* arg;
+    _DFR_PROF_FIELD
 } _dfr_DeferNode;
 
+// Defers and errdefers are kept on separate chains, newest first, so a
+// successful exit only ever walks the defers. An error exit merges the two
+// chains back into registration order by seq.
 typedef struct _dfr_ScopeCtx {
     bool error_occurred;
-    _dfr_DeferNode* head;
-    _dfr_DeferNode* old_head;
+    unsigned seq;
+    _dfr_DeferNode* head[2];  // [0] defer, [1] errdefer
     struct _dfr_ScopeCtx* parent;
+    _DFR_JMP_FIELD
 } _dfr_ScopeCtx;
 
 // Global dummy contexts allow keyword macros
@@ -122,44 +953,50 @@ typedef struct _dfr_ScopeCtx {
 static _dfr_ScopeCtx* const _dfr_ctx = NULL;
 static _dfr_ScopeCtx* _dfr_break_ctx = NULL;
 static _dfr_ScopeCtx* _dfr_continue_ctx = NULL;
+#ifdef DEFER_TRACE
+static const unsigned _dfr_trace_depth = 0;
+static const unsigned _dfr_trace_base = 0;
+static unsigned _dfr_trace_break = _DFR_TRACE_TOP;
+static unsigned _dfr_trace_continue = _DFR_TRACE_TOP;
+#endif
 
-static inline void _dfr_execute_defers(_dfr_ScopeCtx* ctx) {
-    if (!ctx) return;
-    bool error_occurred = ctx->error_occurred;
-    _dfr_DeferNode* node = ctx->head;
-    if (error_occurred) {
-        while(node) {
-            node->func(node->arg);
-            node = node->next;
-        }
-    } else {
-        while(node) {
-            if (!node->is_err) {
-                node->func(node->arg);
-            }
+// Out of line so the merge doesn't get inlined into every exit of every scope
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+static void _dfr_run_scope_err(_dfr_DeferNode* node, _dfr_DeferNode* err_node) {
+    while(node || err_node) {
+        if (!node || (err_node && err_node->seq > node->seq)) {
+            _DFR_CALL(err_node);
+            err_node = err_node->next;
+        } else {
+            _DFR_CALL(node);
             node = node->next;
         }
     }
 }
 
+static inline void _dfr_run_scope(_dfr_ScopeCtx* ctx, bool error_occurred) {
+    _DFR_JMP_POP(ctx)
+    if (error_occurred) {
+        _dfr_run_scope_err(ctx->head[0], ctx->head[1]);
+        return;
+    }
+    for (_dfr_DeferNode* node = ctx->head[0]; node; node = node->next) {
+        _DFR_CALL(node);
+    }
+}
+
+static inline void _dfr_execute_defers(_dfr_ScopeCtx* ctx) {
+    if (!ctx) return;
+    _dfr_run_scope(ctx, ctx->error_occurred);
+}
+
 static inline void _dfr_execute_all_defers(_dfr_ScopeCtx* ctx) {
     if (!ctx) return;
     bool error_occurred = ctx->error_occurred;
     for (_dfr_ScopeCtx* current = ctx; current; current = current->parent) {
-        _dfr_DeferNode* node = current->head;
-        if (error_occurred) {
-            while(node) {
-                node->func(node->arg);
-                node = node->next;
-            }
-        } else {
-            while(node) {
-                if (!node->is_err) {
-                    node->func(node->arg);
-                }
-                node = node->next;
-            }
-        }
+        _dfr_run_scope(current, error_occurred);
     }
 }
 
@@ -170,13 +1007,7 @@ static inline void _dfr_execute_some_defers(_dfr_ScopeCtx* start, _dfr_ScopeCtx*
         return;
     };
     for (_dfr_ScopeCtx* current = start; current && current != end; current = current->parent) {
-        _dfr_DeferNode* node = current->head;
-        while(node) {
-            if (!node->is_err) {
-                node->func(node->arg);
-            }
-            node = node->next;
-        }
+        _dfr_run_scope(current, false);
     }
 }
 
@@ -185,28 +1016,68 @@ static inline _dfr_ScopeCtx* _dfr_scope_helper(_dfr_ScopeCtx* _dfr_ctx) {
     return NULL;
 }
 
-#define S_ { \
-    _dfr_ScopeCtx* _dfr_parent_break_ctx = _dfr_break_ctx; \
-    _dfr_ScopeCtx* _dfr_break_ctx = _dfr_parent_break_ctx; \
-    _dfr_ScopeCtx* _dfr_parent_continue_ctx = _dfr_continue_ctx; \
-    _dfr_ScopeCtx* _dfr_continue_ctx = _dfr_parent_continue_ctx; \
-    _dfr_ScopeCtx _dfr_ctx_ = (_dfr_ScopeCtx){ false, NULL, NULL, _dfr_ctx}, *_dfr_ctx = &_dfr_ctx_;
-#ifdef __clang__
-#define _S ;_Pragma("clang diagnostic push") \
-    _Pragma("clang diagnostic ignored \"-Wreturn-type\"") \
-    _dfr_scope_helper(_dfr_ctx);} \
-    _Pragma("clang diagnostic pop")
-#else
-#define _S ; _dfr_scope_helper(_dfr_ctx); }
+// break_to unwinds up to the labelled scope's parent, NULL (everything) when
+// it's the function's outermost scope
+#define _DFR_LABEL_TYPE _dfr_ScopeCtx*
+#define _DFR_LABEL_END _dfr_ctx_.parent
+
+#ifdef DEFER_LONGJMP
+// Every scope links itself in when it opens, and _dfr_run_scope unlinks it on
+// whichever exit runs its defers
+#define _DFR_JMP_INIT , _dfr_jmp_push(&_dfr_ctx_)
+
+static inline jmp_buf* _dfr_jmp_mark(defer_jmp_buf* env) {
+    env->mark = _dfr_jmp_top;
+    env->seq = env->mark ? ((_dfr_ScopeCtx*)env->mark)->seq : 0;
+    return &env->buf;
+}
+
+// Unlinks the nodes at the front of the chain at head registered from seq on,
+// returning them as a chain of their own
+static inline _dfr_DeferNode* _dfr_unlink_since(_dfr_DeferNode** head, unsigned seq) {
+    _dfr_DeferNode** link = head;
+    while (*link && (*link)->seq >= seq) link = &(*link)->next;
+    if (link == head) return NULL;
+    _dfr_DeferNode* since = *head;
+    *head = *link;
+    *link = NULL;
+    return since;
+}
+
+// The setjmp scope stays open, so of its defers only those registered after
+// defer_setjmp run, and come off its chains so its own exit doesn't rerun them
+#ifdef __GNUC__
+__attribute__((noinline, cold, noreturn))
 #endif
+static void _dfr_longjmp(defer_jmp_buf* env, int val) {
+    while (_dfr_jmp_top != env->mark) {
+        _dfr_run_scope((_dfr_ScopeCtx*)_dfr_jmp_top, true);
+    }
+    _dfr_ScopeCtx* ctx = (_dfr_ScopeCtx*)env->mark;
+    if (ctx) {
+        _dfr_DeferNode* node = _dfr_unlink_since(&ctx->head[0], env->seq);
+        _dfr_run_scope_err(node, _dfr_unlink_since(&ctx->head[1], env->seq));
+    }
+    longjmp(env->buf, val);
+}
+#else
+#define _DFR_JMP_INIT
+#endif // DEFER_LONGJMP
 
-#define _CAT_IMPL(a, b) a##b
-#define _CAT(a, b) _CAT_IMPL(a, b)
+#define _dfr_scope_open \
+    _dfr_ScopeCtx* _dfr_parent_break_ctx = _dfr_break_ctx; \
+    _dfr_ScopeCtx* _dfr_break_ctx _attribute((unused)) = _dfr_parent_break_ctx; \
+    _dfr_ScopeCtx* _dfr_parent_continue_ctx = _dfr_continue_ctx; \
+    _dfr_ScopeCtx* _dfr_continue_ctx _attribute((unused)) = _dfr_parent_continue_ctx; \
+    _DFR_TRACE_OPEN \
+    _dfr_ScopeCtx _dfr_ctx_ = (_dfr_ScopeCtx){ false, 0, { NULL, NULL }, _dfr_ctx _DFR_JMP_INIT }, \
+        *_dfr_ctx = &_dfr_ctx_;
 
-static inline _dfr_DeferNode* link_defer_node(_dfr_DeferNode** old_head, _dfr_DeferNode** new_node) {
-    _dfr_DeferNode* ret = *old_head;
-    *old_head = *new_node;
-    return ret;
+// Pushes node onto the chain at head, returning the node it now points past
+static inline _dfr_DeferNode* link_defer_node(_dfr_DeferNode** head, _dfr_DeferNode* node) {
+    _dfr_DeferNode* next = *head;
+    *head = node;
+    return next;
 }
 
 #ifndef __PCC__
@@ -216,36 +1087,292 @@ static inline _dfr_DeferNode* link_defer_node(_dfr_DeferNode** old_head, _dfr_De
 // behavior. You don't need to conditionally defer though. Just use errdefer
 // instead.
 #define _dfr_defer_impl(cleanup_func, var, err, unique) \
-    _dfr_DeferNode _CAT(node, unique) = ( \
-        (_dfr_ctx_.head = &_CAT(node, unique)), \
+    _dfr_DeferNode _CAT(node, unique) = \
         (_dfr_DeferNode){ \
-            .next = link_defer_node(&_dfr_ctx_.old_head, &_dfr_ctx_.head), \
-            .is_err = err, \
-            .func = cleanup_func, \
+            .next = link_defer_node(&_dfr_ctx_.head[err], &_CAT(node, unique)), \
+            .seq = _dfr_ctx_.seq++, \
+            .func = _DFR_TRACE_DEFER((err) ? _DFR_EV_ERRDEFER : _DFR_EV_DEFER, cleanup_func), \
             .arg = &(var) \
-        } \
-    )
+            _DFR_PROF_INIT(cleanup_func) \
+        }
 #else // defined(__PCC__)
 // Not unbraced if safe in PCC
 // PCC won't safely take the address of a variable during its initialization
 #define _dfr_defer_impl(cleanup_func, var, err, unique) \
     _dfr_DeferNode _CAT(node, unique) = \
         (_dfr_DeferNode){ \
-            .next = _dfr_ctx_.head, \
-            .is_err = err, \
-            .func = cleanup_func, \
+            .next = _dfr_ctx_.head[err], \
+            .seq = _dfr_ctx_.seq++, \
+            .func = _DFR_TRACE_DEFER((err) ? _DFR_EV_ERRDEFER : _DFR_EV_DEFER, cleanup_func), \
             .arg = &(var) \
+            _DFR_PROF_INIT(cleanup_func) \
         }; \
-        _dfr_ctx_.head = &_CAT(node, unique)
+        _dfr_ctx_.head[err] = &_CAT(node, unique)
 
 #endif // __PCC__
 
+static inline int _dfr_loop_helper(_dfr_ScopeCtx** _dfr_break_ctx, _dfr_ScopeCtx** _dfr_continue_ctx, _dfr_ScopeCtx* _dfr_ctx) {
+    *_dfr_break_ctx = _dfr_ctx;
+    *_dfr_continue_ctx = _dfr_ctx;
+    return 1;
+}
+
+static inline int _dfr_switch_helper(_dfr_ScopeCtx** _dfr_break_ctx, _dfr_ScopeCtx* _dfr_ctx) {
+    *_dfr_break_ctx = _dfr_ctx;
+    return 1;
+}
+
+#else // USE_TLS_DEFER
+
+// Thread-local defer stack. Instead of linking nodes through the caller's
+// frame, every defer pushes a record onto one growable array per thread (per
+// translation unit, the array is static). A scope only remembers where the
+// stack was when it opened, and break/continue remember where it was when
+// their loop started, so every exit is "run records down to a watermark".
+// The caller's frame holds a 12 byte context and four marks per scope, and
+// nothing per defer.
+
+#ifndef _dfr_thread_local
+#error "USE_TLS_DEFER needs thread-local storage (C11 _Thread_local, __thread or __declspec(thread))"
+#endif
+
+#include <limits.h>
+
+typedef struct _dfr_DeferRecord {
+    void (*func)(void*);
+    void* arg;
+    bool is_err;
+    _DFR_PROF_FIELD
+} _dfr_DeferRecord;
+
+typedef struct _dfr_DeferStack {
+    _dfr_DeferRecord* records;
+    unsigned top;
+    unsigned cap;
+} _dfr_DeferStack;
+
+static _dfr_thread_local _dfr_DeferStack _dfr_stack;
+
+// The array is freed at thread exit by a pthread key destructor, one key per
+// translation unit like the array. The key's value is the thread's own
+// _dfr_stack, set when the array is first allocated. Thread-exit cleanups that
+// run after it and open scopes allocate a new array and set the value again,
+// which has pthreads call the destructor once more. Without pthreads, or on the
+// thread that calls exit(), the array lives until the process ends.
+#ifdef _DFR_HAVE_PTHREAD
+static pthread_key_t _dfr_stack_key;
+static pthread_once_t _dfr_stack_key_once = PTHREAD_ONCE_INIT;
+
+static void _dfr_stack_free(void* value) {
+    _dfr_DeferStack* stack = (_dfr_DeferStack*)value;
+    free(stack->records);
+    stack->records = NULL;
+    stack->top = 0;
+    stack->cap = 0;
+}
+
+static void _dfr_stack_key_create(void) {
+    pthread_key_create(&_dfr_stack_key, _dfr_stack_free);
+}
+#endif
+
+typedef struct _dfr_ScopeCtx {
+    unsigned mark;  // first record owned by this scope
+    unsigned base;  // mark of the outermost scope in the function, where return stops
+    bool error_occurred;
+} _dfr_ScopeCtx;
+
+// Break and continue targets are stack marks. Outside of any loop they hold
+// _DFR_NO_MARK, which unwinds the whole function like the NULL break context
+// does in the linked list version.
+#define _DFR_NO_MARK UINT_MAX
+
+static _dfr_ScopeCtx* const _dfr_ctx = NULL;
+static unsigned _dfr_break_ctx = _DFR_NO_MARK;
+static unsigned _dfr_continue_ctx = _DFR_NO_MARK;
+#ifdef DEFER_TRACE
+static const unsigned _dfr_trace_depth = 0;
+static const unsigned _dfr_trace_base = 0;
+static unsigned _dfr_trace_break = _DFR_TRACE_TOP;
+static unsigned _dfr_trace_continue = _DFR_TRACE_TOP;
+#endif
+
+#ifdef __GNUC__
+__attribute__((noinline, cold))
+#endif
+static void _dfr_grow_stack(_dfr_DeferStack* stack) {
+    unsigned cap = stack->cap ? stack->cap * 2 : 64;
+    _dfr_DeferRecord* records = (_dfr_DeferRecord*)realloc(stack->records, cap * sizeof(*records));
+    if (!records) {
+        fputs("defer.h: out of memory growing the defer stack\n", stderr);
+        abort();
+    }
+#ifdef _DFR_HAVE_PTHREAD
+    if (!stack->records) {
+        pthread_once(&_dfr_stack_key_once, _dfr_stack_key_create);
+        pthread_setspecific(_dfr_stack_key, stack);
+    }
+#endif
+    stack->records = records;
+    stack->cap = cap;
+}
+
+static inline void _dfr_push_defer(_dfr_ScopeCtx* ctx, void (*func)(void*), void* arg, bool is_err _DFR_PROF_PARAM) {
+    (void)ctx;
+    _dfr_DeferStack* stack = &_dfr_stack;
+    if (stack->top == stack->cap) _dfr_grow_stack(stack);
+    _dfr_DeferRecord* record = &stack->records[stack->top++];
+    record->func = func;
+    record->arg = arg;
+    record->is_err = is_err;
+#ifdef DEFER_PROFILE
+    record->site = site;
+#endif
+}
+
+// Kept out of line: callers then only hold a mark across the body instead of
+// the unwind loop's registers, which is most of the frame in deep recursion.
+// Successful exits skip the errdefer records.
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+static void _dfr_unwind_to(unsigned mark) {
+    _dfr_DeferStack* stack = &_dfr_stack;
+    while (stack->top > mark) {
+        _dfr_DeferRecord* record = &stack->records[--stack->top];
+        if (!record->is_err) {
+            _DFR_CALL(record);
+        }
+    }
+}
+
+// The returnerr version runs every record, and is cold
+#ifdef __GNUC__
+__attribute__((noinline, cold))
+#endif
+static void _dfr_unwind_err_to(unsigned mark) {
+    _dfr_DeferStack* stack = &_dfr_stack;
+    while (stack->top > mark) {
+        _dfr_DeferRecord* record = &stack->records[--stack->top];
+        _DFR_CALL(record);
+    }
+}
+
+static inline void _dfr_unwind(unsigned mark, bool error_occurred) {
+    if (_dfr_unlikely(error_occurred)) {
+        _dfr_unwind_err_to(mark);
+        return;
+    }
+    _dfr_unwind_to(mark);
+}
+
+static inline void _dfr_execute_defers(_dfr_ScopeCtx* ctx) {
+    if (!ctx) return;
+    _dfr_unwind(ctx->mark, ctx->error_occurred);
+}
+
+static inline void _dfr_execute_all_defers(_dfr_ScopeCtx* ctx) {
+    if (!ctx) return;
+    _dfr_unwind(ctx->base, ctx->error_occurred);
+}
+
+// break and continue, never after returnerr
+static inline void _dfr_execute_some_defers(_dfr_ScopeCtx* start, unsigned end) {
+    if (!start) return;
+    _dfr_unwind_to(end == _DFR_NO_MARK ? start->base : end);
+}
+
+static inline _dfr_ScopeCtx* _dfr_scope_helper(_dfr_ScopeCtx* _dfr_ctx) {
+    _dfr_execute_defers(_dfr_ctx);
+    return NULL;
+}
+
+// break_to unwinds down to the labelled scope's own mark
+#define _DFR_LABEL_TYPE unsigned
+#define _DFR_LABEL_END _dfr_ctx_.mark
+
+#ifdef DEFER_LONGJMP
+// The records above the mark are exactly the skipped defers
+static inline jmp_buf* _dfr_jmp_mark(defer_jmp_buf* env) {
+    env->mark = _dfr_stack.top;
+    return &env->buf;
+}
+
+#ifdef __GNUC__
+__attribute__((noinline, cold, noreturn))
+#endif
+static void _dfr_longjmp(defer_jmp_buf* env, int val) {
+    _dfr_unwind_err_to(env->mark);
+    longjmp(env->buf, val);
+}
+#endif // DEFER_LONGJMP
+
+#define _dfr_scope_open \
+    unsigned _dfr_parent_break_ctx = _dfr_break_ctx; \
+    unsigned _dfr_break_ctx _attribute((unused)) = _dfr_parent_break_ctx; \
+    unsigned _dfr_parent_continue_ctx = _dfr_continue_ctx; \
+    unsigned _dfr_continue_ctx _attribute((unused)) = _dfr_parent_continue_ctx; \
+    _DFR_TRACE_OPEN \
+    _dfr_ScopeCtx _dfr_ctx_ = (_dfr_ScopeCtx){ _dfr_stack.top, \
+        _dfr_ctx ? _dfr_ctx->base : _dfr_stack.top, false }, *_dfr_ctx = &_dfr_ctx_;
+
+// A plain statement, so unlike the linked list version it's fine under an
+// unbraced if: the record is popped by the enclosing S_ _S scope either way.
+#define _dfr_defer_impl(cleanup_func, var, err, unique) \
+    _dfr_push_defer(&_dfr_ctx_, _DFR_TRACE_DEFER((err) ? _DFR_EV_ERRDEFER : _DFR_EV_DEFER, cleanup_func), \
+        &(var), err _DFR_PROF_ARG(cleanup_func))
+
+static inline int _dfr_loop_helper(unsigned* _dfr_break_ctx, unsigned* _dfr_continue_ctx, _dfr_ScopeCtx* _dfr_ctx) {
+    if (_dfr_ctx) {
+        *_dfr_break_ctx = _dfr_stack.top;
+        *_dfr_continue_ctx = _dfr_stack.top;
+    }
+    return 1;
+}
+
+static inline int _dfr_switch_helper(unsigned* _dfr_break_ctx, _dfr_ScopeCtx* _dfr_ctx) {
+    if (_dfr_ctx) {
+        *_dfr_break_ctx = _dfr_stack.top;
+    }
+    return 1;
+}
+
+#endif // USE_TLS_DEFER
+
+#ifdef DEFER_TRACE
+// The keyword macros call these at the start of every loop and switch, which
+// is where the depth break and continue unwind to is known
+#define _dfr_loop_helper(break_ctx, continue_ctx, ctx) \
+    ((void)((ctx) && (_dfr_trace_break = _dfr_trace_continue = _dfr_trace_depth + 1)), \
+        (_dfr_loop_helper)(break_ctx, continue_ctx, ctx))
+#define _dfr_switch_helper(break_ctx, ctx) \
+    ((void)((ctx) && (_dfr_trace_break = _dfr_trace_depth + 1)), (_dfr_switch_helper)(break_ctx, ctx))
+#endif
+
+#define S_ { _dfr_scope_open
+#ifdef __clang__
+#define _S ;_Pragma("clang diagnostic push") \
+    _Pragma("clang diagnostic ignored \"-Wreturn-type\"") \
+    _dfr_scope_helper(_dfr_ctx); _DFR_TRACE_CLOSE } \
+    _Pragma("clang diagnostic pop")
+#else
+#define _S ; _dfr_scope_helper(_dfr_ctx); _DFR_TRACE_CLOSE }
+#endif
+
 #define _dfr_defer(cleanup_func, var, err) \
     _dfr_defer_impl(cleanup_func, var, err, _UNIQUER)
 
 #define defer(cleanup_func, var) _dfr_defer(cleanup_func, var, false)
 #define errdefer(cleanup_func, var) _dfr_defer(cleanup_func, var, true)
 
+// Memory-only defers, see _dfr_MemDesc
+#define _dfr_mem_impl(cleanup_func, var, err, unique) \
+    _dfr_MemDesc _CAT(_dfr_mem, unique) = { cleanup_func, &(var) }; \
+    _dfr_defer(_dfr_run_mem, _CAT(_dfr_mem, unique), err)
+
+#define defer_mem(cleanup_func, var) _dfr_mem_impl(cleanup_func, var, false, _UNIQUER)
+#define errdefer_mem(cleanup_func, var) _dfr_mem_impl(cleanup_func, var, true, _UNIQUER)
+
 // Included for compatibility with gnuc path, but this version is
 // macro unhygienic! Don't use it with unbraced if/for/while! (Though that's 
 // user error anyway due to implicit scope creation of those statements
@@ -253,16 +1380,26 @@ static inline _dfr_DeferNode* link_defer_node(_dfr_DeferNode** old_head, _dfr_De
 #define cleanupdecl(lvalue, rvalue, cleanup_fn) lvalue = rvalue; \
     _dfr_defer(cleanup_fn, lvalue, false)
 
-static inline int _dfr_loop_helper(_dfr_ScopeCtx** _dfr_break_ctx, _dfr_ScopeCtx** _dfr_continue_ctx, _dfr_ScopeCtx* _dfr_ctx) {
-    *_dfr_break_ctx = _dfr_ctx;
-    *_dfr_continue_ctx = _dfr_ctx;
-    return 1;
-}
+// Typed defers, see the GNU C version above. There's no cleanup attribute to
+// point at a typed thunk here, so DEFER_TYPED generates the void* wrapper you'd
+// otherwise write by hand and the node calls it like any other defer. The
+// type check goes on var, since profiling names the site after fn.
+#define DEFER_TYPED(fn, type) \
+    typedef type _dfr_typed_type_##fn; \
+    static inline void _dfr_typed_##fn(void* arg) { fn(*(type*)arg); } \
+    struct _dfr_typed_##fn##_declared
 
-static inline int _dfr_switch_helper(_dfr_ScopeCtx** _dfr_break_ctx, _dfr_ScopeCtx* _dfr_ctx) {
-    *_dfr_break_ctx = _dfr_ctx;
-    return 1;
-}
+#define tdefer(fn, var) _dfr_defer(_dfr_typed_##fn, *(_DFR_TYPED_CHECK(fn, var), &(var)), false)
+#define terrdefer(fn, var) _dfr_defer(_dfr_typed_##fn, *(_DFR_TYPED_CHECK(fn, var), &(var)), true)
+
+// Labelled scopes, see break_to below. The label remembers where unwinding
+// stops for its scope, like the break and continue contexts do for a loop,
+// and break_to runs every scope from the innermost one down to it.
+#define S_LABEL(name) S_ _DFR_LABEL_TYPE const _dfr_label_##name = _DFR_LABEL_END; \
+    (void)_dfr_label_##name; _DFR_TRACE_LABEL(name)
+#define break_to(name) if (_DFR_TRACE_KW(_DFR_EV_BREAK) \
+    _dfr_execute_some_defers(_dfr_ctx, _dfr_label_##name) \
+    _DFR_TRACE_TO(_dfr_trace_label_##name), 0) {} else goto _dfr_end_##name
 
 #ifndef DONT_REDEFINE_KEYWORDS
 
@@ -271,7 +1408,38 @@ static inline int _dfr_switch_helper(_dfr_ScopeCtx** _dfr_break_ctx, _dfr_ScopeC
 #define PUSH_MACRO_SUPPORTED 0
 #pragma pop_macro("PUSH_MACRO_SUPPORTED")
 
-#if PUSH_MACRO_SUPPORTED && defined(SCOPE_MACRO_STACK_AVAILABLE)
+#if defined(DEFER_SCOPE_ENUM)
+// Scope detection without a macro stack. Every S_ declares an enum constant
+// that shadows the file scope one, so _dfr_in_scope is an integer constant
+// expression that's 1 inside S_ _S scopes and 0 everywhere else, with no cap
+// on how many scopes a file has and no generated header. The keywords are
+// still macros everywhere, but outside scopes the wrapper is `if (0 && ...)`,
+// which the compiler folds at parse time, even at -O0: the code generated
+// there is exactly the plain keyword's, as with return0/for0 and friends.
+//
+// Only push_macro can change what a macro expands to mid file, and every
+// change pops a value that had to be pushed beforehand, which is why the
+// macro stack needs its pre-generated entries. The compiler's own scoping
+// has no such limit.
+enum { _dfr_in_scope = 0 };
+
+#undef S_
+#define S_ { enum { _dfr_in_scope = 1 }; _dfr_scope_open
+
+#define return if (_dfr_in_scope && (_DFR_TRACE_KW(_DFR_EV_RETURN) \
+    _dfr_execute_all_defers(_dfr_ctx) _DFR_TRACE_RET, 0)) {} else return
+#define returnerr if (_DFR_TRACE_KW(_DFR_EV_RETURNERR) (_dfr_ctx_.error_occurred = true), 0) {} else return
+#define break if (_dfr_in_scope && (_DFR_TRACE_KW(_DFR_EV_BREAK) \
+    _dfr_execute_some_defers(_dfr_ctx, _dfr_break_ctx) _DFR_TRACE_TO(_dfr_trace_break), 0)) {} else break
+#define continue if (_dfr_in_scope && (_DFR_TRACE_KW(_DFR_EV_CONTINUE) \
+    _dfr_execute_some_defers(_dfr_ctx, _dfr_continue_ctx) _DFR_TRACE_TO(_dfr_trace_continue), 0)) {} else continue
+#define for if (_dfr_in_scope && (_dfr_loop_helper(&_dfr_break_ctx, &_dfr_continue_ctx, _dfr_ctx), 0)) {} else for
+#define do if (_dfr_in_scope && (_dfr_loop_helper(&_dfr_break_ctx, &_dfr_continue_ctx, _dfr_ctx), 0)) {} else do
+#define while(...) while((void)(_dfr_in_scope && _dfr_loop_helper(&_dfr_break_ctx, &_dfr_continue_ctx, _dfr_ctx)), \
+    (__VA_ARGS__))
+#define switch if (_dfr_in_scope && (_dfr_switch_helper(&_dfr_break_ctx, _dfr_ctx), 0)) {} else switch
+
+#elif PUSH_MACRO_SUPPORTED && defined(SCOPE_MACRO_STACK_AVAILABLE)
 // This is the let's try to mostly not globally redefine keywords version
 /* Example macro stack to provide via generated header:
 #define IN_SCOPE 1
@@ -300,48 +1468,40 @@ static inline int _dfr_switch_helper(_dfr_ScopeCtx** _dfr_break_ctx, _dfr_ScopeC
  _Pragma("GCC error \"defer.h macro stack exhausted. Consider increasing the \
 macro_stack.h size via `./make_macro_stack.sh 9999` or don't #include it anymore\"")
 
-#define S_0 { _Pragma("pop_macro(\"IN_SCOPE\")"); \
-    _dfr_ScopeCtx* _dfr_parent_break_ctx = _dfr_break_ctx; \
-    _dfr_ScopeCtx* _dfr_break_ctx = _dfr_parent_break_ctx; \
-    _dfr_ScopeCtx* _dfr_parent_continue_ctx = _dfr_continue_ctx; \
-    _dfr_ScopeCtx* _dfr_continue_ctx = _dfr_parent_continue_ctx; \
-    _dfr_ScopeCtx _dfr_ctx_ = (_dfr_ScopeCtx){ false, NULL, NULL, _dfr_ctx}, *_dfr_ctx = &_dfr_ctx_;
+#define S_0 { _Pragma("pop_macro(\"IN_SCOPE\")"); _dfr_scope_open
 
-#define S_1 { _Pragma("push_macro(\"IN_SCOPE\")"); \
-    _dfr_ScopeCtx* _dfr_parent_break_ctx = _dfr_break_ctx; \
-    _dfr_ScopeCtx* _dfr_break_ctx = _dfr_parent_break_ctx; \
-    _dfr_ScopeCtx* _dfr_parent_continue_ctx = _dfr_continue_ctx; \
-    _dfr_ScopeCtx* _dfr_continue_ctx = _dfr_parent_continue_ctx; \
-    _dfr_ScopeCtx _dfr_ctx_ = (_dfr_ScopeCtx){ false, NULL, NULL, _dfr_ctx}, *_dfr_ctx = &_dfr_ctx_;
+#define S_1 { _Pragma("push_macro(\"IN_SCOPE\")"); _dfr_scope_open
 
 #undef S_
 #define S_ _CAT(S_, IN_SCOPE)
 
 
 #undef _S
-#define _S ; _dfr_scope_helper(_dfr_ctx); _Pragma("pop_macro(\"IN_SCOPE\")"); }
+#define _S ; _dfr_scope_helper(_dfr_ctx); _DFR_TRACE_CLOSE _Pragma("pop_macro(\"IN_SCOPE\")"); }
 
 #define returnERROR_DEFER_SCOPE_STACK_DEPLETED \
  _Pragma("GCC error \"defer.h macro stack exhausted. Consider increasing the \
 macro_stack.h size via `./make_macro_stack.sh 9999` or don't #include it anymore\"")
 #define return0 return
-#define return1 if ((_dfr_execute_all_defers(_dfr_ctx)), 0) {} else return
+#define return1 if ((_DFR_TRACE_KW(_DFR_EV_RETURN) _dfr_execute_all_defers(_dfr_ctx) _DFR_TRACE_RET), 0) {} else return
 #define return _CAT(return, IN_SCOPE)
 
-#define returnerr if ((_dfr_ctx_.error_occurred = true), 0) {} else return
+#define returnerr if (_DFR_TRACE_KW(_DFR_EV_RETURNERR) (_dfr_ctx_.error_occurred = true), 0) {} else return
 
 #define breakERROR_DEFER_SCOPE_STACK_DEPLETED \
  _Pragma("GCC error \"defer.h macro stack exhausted. Consider increasing the \
 macro_stack.h size via `./make_macro_stack.sh 9999` or don't #include it anymore\"")
 #define break0 break
-#define break1 if (_dfr_execute_some_defers(_dfr_ctx, _dfr_break_ctx), 0) {} else break
+#define break1 if (_DFR_TRACE_KW(_DFR_EV_BREAK) _dfr_execute_some_defers(_dfr_ctx, _dfr_break_ctx) \
+    _DFR_TRACE_TO(_dfr_trace_break), 0) {} else break
 #define break _CAT(break, IN_SCOPE)
 
 #define continueERROR_DEFER_SCOPE_STACK_DEPLETED \
  _Pragma("GCC error \"defer.h macro stack exhausted. Consider increasing the \
 macro_stack.h size via `./make_macro_stack.sh 9999` or don't #include it anymore\"")
 #define continue0 continue
-#define continue1 if (_dfr_execute_some_defers(_dfr_ctx, _dfr_continue_ctx), 0) {} else continue
+#define continue1 if (_DFR_TRACE_KW(_DFR_EV_CONTINUE) _dfr_execute_some_defers(_dfr_ctx, _dfr_continue_ctx) \
+    _DFR_TRACE_TO(_dfr_trace_continue), 0) {} else continue
 #define continue _CAT(continue, IN_SCOPE)
 
 #define doERROR_DEFER_SCOPE_STACK_DEPLETED \
@@ -378,24 +1538,60 @@ macro_stack.h size via `./make_macro_stack.sh 9999` or don't #include it anymore
 // anywhere keywords are used (As far as I can conceive and have tested), 
 // thanks to the static global dummy variables.
 
-#define return if (_dfr_execute_all_defers(_dfr_ctx), 0) {} else return
-#define returnerr if ((_dfr_ctx_.error_occurred = true), 0) {} else return
-#define break if (_dfr_execute_some_defers(_dfr_ctx, _dfr_break_ctx), 0) {} else break
-#define continue if (_dfr_execute_some_defers(_dfr_ctx, _dfr_continue_ctx), 0) {} else continue
+#define return if (_DFR_TRACE_KW(_DFR_EV_RETURN) _dfr_execute_all_defers(_dfr_ctx) _DFR_TRACE_RET, 0) {} else return
+#define returnerr if (_DFR_TRACE_KW(_DFR_EV_RETURNERR) (_dfr_ctx_.error_occurred = true), 0) {} else return
+#define break if (_DFR_TRACE_KW(_DFR_EV_BREAK) _dfr_execute_some_defers(_dfr_ctx, _dfr_break_ctx) \
+    _DFR_TRACE_TO(_dfr_trace_break), 0) {} else break
+#define continue if (_DFR_TRACE_KW(_DFR_EV_CONTINUE) _dfr_execute_some_defers(_dfr_ctx, _dfr_continue_ctx) \
+    _DFR_TRACE_TO(_dfr_trace_continue), 0) {} else continue
 #define for if (_dfr_loop_helper(&_dfr_break_ctx, &_dfr_continue_ctx, _dfr_ctx), 0) {} else for
 #define do if (_dfr_loop_helper(&_dfr_break_ctx, &_dfr_continue_ctx, _dfr_ctx), 0) {} else do
 #define while(...) while(_dfr_loop_helper(&_dfr_break_ctx, &_dfr_continue_ctx, _dfr_ctx), (__VA_ARGS__))
 #define switch if (_dfr_switch_helper(&_dfr_break_ctx, _dfr_ctx), 0) {} else switch
 #endif // PUSH_MACRO_SUPPORTED
 #else
-#define RETURN if (_dfr_execute_all_defers(_dfr_ctx), 0) {} else return
-#define RETURNERR if ((_dfr_ctx_.error_occurred = true), _dfr_execute_all_defers(_dfr_ctx), 0) {} else return
-#define BREAK if (_dfr_execute_some_defers(_dfr_ctx, _dfr_break_ctx), 0) {} else break
-#define CONTINUE if (_dfr_execute_some_defers(_dfr_ctx, _dfr_continue_ctx), 0) {} else continue
-#define FOR if (_dfr_loop_helper(_dfr_break_ctx, _dfr_continue_ctx, _dfr_ctx), 0) {} else for
-#define DO if (_dfr_loop_helper(_dfr_break_ctx, _dfr_continue_ctx, _dfr_ctx), 0) {} else do
-#define WHILE(...) while(_dfr_loop_helper(&_dfr_break_ctx, &_dfr_continue_ctx, &_dfr_ctx), (__VA_ARGS__))
-#define SWITCH if (_dfr_switch_helper(&_dfr_break_ctx, &_dfr_ctx), 0) {} else switch
+#define RETURN if (_DFR_TRACE_KW(_DFR_EV_RETURN) _dfr_execute_all_defers(_dfr_ctx) _DFR_TRACE_RET, 0) {} else return
+#define RETURNERR if (_DFR_TRACE_KW(_DFR_EV_RETURNERR) (_dfr_ctx_.error_occurred = true), \
+    _dfr_execute_all_defers(_dfr_ctx) _DFR_TRACE_RET, 0) {} else return
+#define BREAK if (_DFR_TRACE_KW(_DFR_EV_BREAK) _dfr_execute_some_defers(_dfr_ctx, _dfr_break_ctx) \
+    _DFR_TRACE_TO(_dfr_trace_break), 0) {} else break
+#define CONTINUE if (_DFR_TRACE_KW(_DFR_EV_CONTINUE) _dfr_execute_some_defers(_dfr_ctx, _dfr_continue_ctx) \
+    _DFR_TRACE_TO(_dfr_trace_continue), 0) {} else continue
+#define FOR if (_dfr_loop_helper(&_dfr_break_ctx, &_dfr_continue_ctx, _dfr_ctx), 0) {} else for
+#define DO if (_dfr_loop_helper(&_dfr_break_ctx, &_dfr_continue_ctx, _dfr_ctx), 0) {} else do
+#define WHILE(...) while(_dfr_loop_helper(&_dfr_break_ctx, &_dfr_continue_ctx, _dfr_ctx), (__VA_ARGS__))
+#define SWITCH if (_dfr_switch_helper(&_dfr_break_ctx, _dfr_ctx), 0) {} else switch
 #endif // DONT_REDEFINE_KEYWORDS
 #endif // __GNUC__
+
+// Inline cleanup blocks need GCC nested functions. Elsewhere there's no way to
+// turn a block into something a defer node can call, so fail loudly rather
+// than silently dropping the cleanup.
+#ifndef DEFER_BLOCKS_AVAILABLE
+#define DEFER_BLOCKS_AVAILABLE 0
+#define deferblock(...) \
+    _Pragma("GCC error \"deferblock needs GCC nested functions, use defer with a cleanup function\"") \
+    _dfr_deferblock_unavailable;
+#define errdeferblock(...) \
+    _Pragma("GCC error \"errdeferblock needs GCC nested functions, use errdefer with a cleanup function\"") \
+    _dfr_errdeferblock_unavailable;
+#endif // DEFER_BLOCKS_AVAILABLE
+
+// Multi-level exits: break_to(name) leaves every scope up to and including
+// the one opened with S_LABEL(name), running their defers like a return
+// that stops there, and carries on after its _S_LABEL(name):
+//     S_LABEL(parse)
+//         for (...) S_
+//             defer(free_ptr, line);
+//             switch (state) {
+//                 case DONE: break_to(parse);   // frees line, leaves both scopes
+//             }
+//         _S
+//     _S_LABEL(parse)
+// The label is lexically scoped: break_to only compiles inside the scope it
+// names. Names must be unique within a function, as labels are. It's a plain
+// goto in GNU C, where cleanup attributes already run on the way out; the
+// C99 versions unwind with the same code break uses. Plain goto out of a
+// scope is still unsafe there.
+#define _S_LABEL(name) _S if (0) goto _dfr_end_##name; _dfr_end_##name: ;
 #endif // DEFER_H
@@ -0,0 +1,164 @@
+#ifndef DEFER_HPP
+#define DEFER_HPP
+
+// C++ companion to defer.h, with the same vocabulary: S_ _S scopes, defer,
+// errdefer, returnerr, tdefer, deferblock, cleanupdecl. Nothing is redefined
+// here, C++ destructors already run on every way out of a scope, so each
+// defer is a scope guard object holding a lambda:
+//
+//     int load(const char* path) S_
+//         FILE* f = fopen(path, "r");
+//         if (!f) {
+//             returnerr -1;
+//         }
+//         defer(close_file, f);        // close_file(&f) on every exit
+//         char* buf = (char*)malloc(4096);
+//         errdefer(free_ptr, buf);     // only after returnerr, or a throw
+//         ...
+//         return 0;
+//     _S
+//
+// The guards are templates over the lambda's own type: no std::function, no
+// type erasure and no allocation, so at -O2 a defer is the call you'd have
+// written by hand at each exit (make codegen-cpp checks exactly that).
+//
+// errdefer fires after returnerr, like in C, and also when the scope is left
+// by an exception: the guard compares std::uncaught_exceptions() at scope exit
+// with its value at registration, so a scope that runs inside a destructor
+// during some other unwind and exits normally still counts as a success.
+// Built with -fno-exceptions there's nothing to compare and only returnerr
+// counts.
+//
+// As in defer.h's GNU C version, returnerr marks the innermost S_ scope, and
+// cleanups must not throw (the guards' destructors are noexcept). Don't
+// include defer.h in the same translation unit.
+
+#include <exception>
+#include <utility>
+
+#if !defined(_MSVC_LANG) && __cplusplus < 201703L
+#error "defer.hpp needs C++17"
+#endif
+
+#ifdef DEFER_H
+#error "defer.hpp and defer.h can't be used in the same translation unit"
+#endif
+
+#ifndef _CAT
+#define _CAT_IMPL(a, b) a##b
+#define _CAT(a, b) _CAT_IMPL(a, b)
+#endif
+
+#ifndef _UNIQUER
+#ifdef __COUNTER__
+#define _UNIQUER __COUNTER__
+#else
+#define _UNIQUER __LINE__
+#endif
+#endif
+
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+#define _DFR_CPP_EXCEPTIONS 1
+#else
+#define _DFR_CPP_EXCEPTIONS 0
+#endif
+
+#if defined(__GNUC__)
+#define _dfr_unlikely(x) __builtin_expect(!!(x), 0)
+#else
+#define _dfr_unlikely(x) (x)
+#endif
+
+namespace dfr {
+
+// Runs f when the scope ends, however it ends
+template <class F>
+class scope_exit {
+public:
+    explicit scope_exit(F&& f) noexcept : f_(std::move(f)) {}
+    scope_exit(const scope_exit&) = delete;
+    scope_exit& operator=(const scope_exit&) = delete;
+    ~scope_exit() noexcept { f_(); }
+
+private:
+    F f_;
+};
+
+// Runs f when the scope ends through returnerr or an exception
+template <class F>
+class scope_fail {
+public:
+    scope_fail(F&& f, const bool& err) noexcept
+        : f_(std::move(f)), err_(err)
+#if _DFR_CPP_EXCEPTIONS
+        , exceptions_(std::uncaught_exceptions())
+#endif
+    {}
+    scope_fail(const scope_fail&) = delete;
+    scope_fail& operator=(const scope_fail&) = delete;
+    ~scope_fail() noexcept {
+#if _DFR_CPP_EXCEPTIONS
+        if (_dfr_unlikely(err_) || _dfr_unlikely(std::uncaught_exceptions() > exceptions_)) f_();
+#else
+        if (_dfr_unlikely(err_)) f_();
+#endif
+    }
+
+private:
+    F f_;
+    const bool& err_;
+#if _DFR_CPP_EXCEPTIONS
+    int exceptions_;
+#endif
+};
+
+} // namespace dfr
+
+#define S_ { [[maybe_unused]] bool _dfr_err = false;
+#define _S }
+
+#define returnerr if ((_dfr_err = true), false) {} else return
+
+#define _dfr_guard_impl(guard, unique, ...) \
+    ::dfr::guard _CAT(_dfr_guard, unique)(__VA_ARGS__);
+
+#define defer(cleanup_func, var) \
+    _dfr_guard_impl(scope_exit, _UNIQUER, [&] { cleanup_func(&(var)); })
+#define errdefer(cleanup_func, var) \
+    _dfr_guard_impl(scope_fail, _UNIQUER, [&] { cleanup_func(&(var)); }, _dfr_err)
+
+// The variable is declared and registered in one step, as in the C99 version
+#define cleanupdecl(lvalue, rvalue, cleanup_fn) lvalue = rvalue; defer(cleanup_fn, lvalue)
+
+// Typed defers need no declaration here, the lambda calls fn with the real
+// type. DEFER_TYPED is kept so code shared with C compiles unchanged.
+#define DEFER_TYPED(fn, type) struct _dfr_typed_##fn##_declared
+#define tdefer(fn, var) _dfr_guard_impl(scope_exit, _UNIQUER, [&] { fn(var); })
+#define terrdefer(fn, var) _dfr_guard_impl(scope_fail, _UNIQUER, [&] { fn(var); }, _dfr_err)
+
+#define DEFER_BLOCKS_AVAILABLE 1
+#define deferblock(...) _dfr_guard_impl(scope_exit, _UNIQUER, [&] { __VA_ARGS__ })
+#define errdeferblock(...) _dfr_guard_impl(scope_fail, _UNIQUER, [&] { __VA_ARGS__ }, _dfr_err)
+
+// Array cleanups, func(&array[i]) for each element, last first
+#define _dfr_each_lambda(cleanup_func, array, count) \
+    [&, _dfr_base = &(array)[0], _dfr_count = (count)] { \
+        for (auto _dfr_i = _dfr_count; _dfr_i > 0; _dfr_i--) cleanup_func(&_dfr_base[_dfr_i - 1]); \
+    }
+#define defer_each(cleanup_func, array, count) \
+    _dfr_guard_impl(scope_exit, _UNIQUER, _dfr_each_lambda(cleanup_func, array, count))
+#define errdefer_each(cleanup_func, array, count) \
+    _dfr_guard_impl(scope_fail, _UNIQUER, _dfr_each_lambda(cleanup_func, array, count), _dfr_err)
+
+// Keywords are never redefined in C++, the uppercase spellings are plain
+// aliases so sources written for DONT_REDEFINE_KEYWORDS build unchanged
+#define RETURN return
+#define RETURNERR returnerr
+#define BREAK break
+#define CONTINUE continue
+#define FOR for
+#define DO do
+#define WHILE while
+#define SWITCH switch
+
+#endif // DEFER_HPP
@@ -0,0 +1,330 @@
+#ifndef DEFER_ALLOC_H
+#define DEFER_ALLOC_H
+
+// Scope-bound allocation for defer.h: per-thread arenas, and scratch buffers
+// in the scope's own stack frame (further down).
+//
+// S_ARENA opens a defer scope together with an arena mark. arena_alloc()
+// bump-allocates from a per-thread chunk list, and every way out of the scope
+// (falling off _S, return, returnerr, break, continue) rewinds the arena to
+// the mark in one step, instead of one defer node and one free() per buffer.
+//
+//     S_ARENA
+//         char* path = arena_alloc(PATH_MAX);
+//         int* counts = arena_alloc(n * sizeof(int));
+//         ...
+//     _S  // both released here
+//
+// S_ERRARENA is the errdefer flavour: the arena is only rewound on returnerr.
+// On success the allocations stay, and belong to whichever S_ARENA further up
+// the call chain (on the same thread) rewinds past them. That's how a
+// constructor hands arena memory back to its caller.
+//
+// Chunks released by a rewind are cached per thread and reused before going
+// back to malloc. Call arena_trim() to give the cache back, e.g. before a
+// thread exits. Arena memory is never valid past the scope that rewinds it,
+// don't hand it to anything that outlives that scope.
+
+#include <stddef.h>
+#include <stdint.h>
+#include "defer.h"
+
+#ifndef _dfr_thread_local
+#error "defer_alloc.h needs thread-local storage (C11 _Thread_local, __thread or __declspec(thread))"
+#endif
+
+// Default chunk size, including the chunk header. Larger requests get a chunk
+// of their own.
+#ifndef DEFER_ARENA_CHUNK
+#define DEFER_ARENA_CHUNK (64 * 1024)
+#endif
+
+// Alignment of every arena_alloc and scratch_alloc result, must be a power
+// of two
+#ifndef DEFER_ARENA_ALIGN
+#define DEFER_ARENA_ALIGN 16
+#endif
+
+// Where arena chunks and scratch spills come from
+#ifndef DEFER_ALLOC_MALLOC
+#define DEFER_ALLOC_MALLOC malloc
+#endif
+#ifndef DEFER_ALLOC_FREE
+#define DEFER_ALLOC_FREE free
+#endif
+
+// The arena state is _dfr_shared (see defer.h), so a pointer returned from an
+// S_ERRARENA in one file is released by an S_ARENA in another. Without weak
+// symbols each translation unit gets its own arena, which is still correct as
+// long as memory doesn't cross files.
+
+typedef struct _dfr_ArenaChunk {
+    struct _dfr_ArenaChunk* prev;  // older chunk in use, or next chunk in the cache
+    size_t size;                   // usable bytes after the header
+} _dfr_ArenaChunk;
+
+typedef struct _dfr_Arena {
+    _dfr_ArenaChunk* chunk;  // chunk being bumped into, NULL before the first allocation
+    char* ptr;
+    size_t left;
+    _dfr_ArenaChunk* cache;  // chunks released by rewinds
+} _dfr_Arena;
+
+typedef struct _dfr_ArenaMark {
+    _dfr_ArenaChunk* chunk;
+    char* ptr;
+} _dfr_ArenaMark;
+
+_dfr_shared _dfr_thread_local _dfr_Arena _dfr_arena;
+
+#define _DFR_ARENA_ROUND(size) \
+    (((size) + (DEFER_ARENA_ALIGN - 1)) & ~(size_t)(DEFER_ARENA_ALIGN - 1))
+#define _DFR_ARENA_HEADER _DFR_ARENA_ROUND(sizeof(_dfr_ArenaChunk))
+
+static inline char* _dfr_chunk_data(_dfr_ArenaChunk* chunk) {
+    return (char*)chunk + _DFR_ARENA_HEADER;
+}
+
+// Slow path: move on to a cached chunk that fits, or malloc a new one
+#ifdef __GNUC__
+__attribute__((noinline, cold))
+#endif
+static void* _dfr_arena_grow(size_t size) {
+    _dfr_Arena* arena = &_dfr_arena;
+    _dfr_ArenaChunk** link = &arena->cache;
+    _dfr_ArenaChunk* chunk;
+    while ((chunk = *link) && chunk->size < size) {
+        link = &chunk->prev;
+    }
+    if (chunk) {
+        *link = chunk->prev;
+    } else {
+        size_t cap = DEFER_ARENA_CHUNK - _DFR_ARENA_HEADER;
+        if (size > cap) {
+            if (size > SIZE_MAX - _DFR_ARENA_HEADER) {
+                return NULL;
+            }
+            cap = size;
+        }
+        chunk = (_dfr_ArenaChunk*)DEFER_ALLOC_MALLOC(_DFR_ARENA_HEADER + cap);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->size = cap;
+    }
+    chunk->prev = arena->chunk;
+    arena->chunk = chunk;
+    arena->ptr = _dfr_chunk_data(chunk) + size;
+    arena->left = chunk->size - size;
+    return _dfr_chunk_data(chunk);
+}
+
+static inline void* _dfr_arena_alloc(size_t size) {
+    _dfr_Arena* arena = &_dfr_arena;
+    if (size > SIZE_MAX - DEFER_ARENA_ALIGN) {
+        return NULL;
+    }
+    size = _DFR_ARENA_ROUND(size);
+    if (size <= arena->left) {
+        void* ptr = arena->ptr;
+        arena->ptr += size;
+        arena->left -= size;
+        return ptr;
+    }
+    return _dfr_arena_grow(size);
+}
+
+// Cleanup function registered by S_ARENA / S_ERRARENA
+static inline void _dfr_arena_rewind(void* arg) {
+    _dfr_ArenaMark* mark = (_dfr_ArenaMark*)arg;
+    _dfr_Arena* arena = &_dfr_arena;
+    while (arena->chunk != mark->chunk) {
+        _dfr_ArenaChunk* chunk = arena->chunk;
+        arena->chunk = chunk->prev;
+        chunk->prev = arena->cache;
+        arena->cache = chunk;
+    }
+    arena->ptr = mark->ptr;
+    arena->left = mark->chunk
+        ? (size_t)(_dfr_chunk_data(mark->chunk) + mark->chunk->size - mark->ptr)
+        : 0;
+}
+
+// Free the chunks cached by this thread. Chunks still in use are untouched.
+static inline void arena_trim(void) {
+    _dfr_Arena* arena = &_dfr_arena;
+    while (arena->cache) {
+        _dfr_ArenaChunk* chunk = arena->cache;
+        arena->cache = chunk->prev;
+        DEFER_ALLOC_FREE(chunk);
+    }
+}
+
+#define _dfr_arena_open(kind) \
+    _dfr_ArenaMark _dfr_arena_mark = { _dfr_arena.chunk, _dfr_arena.ptr }; \
+    kind(_dfr_arena_rewind, _dfr_arena_mark);
+
+#define S_ARENA S_ _dfr_arena_open(defer)
+#define S_ERRARENA S_ _dfr_arena_open(errdefer)
+
+// Only usable inside an S_ARENA / S_ERRARENA scope (or one nested in it).
+// Returns memory aligned to DEFER_ARENA_ALIGN, or NULL if malloc failed.
+#define arena_alloc(size) ((void)_dfr_arena_mark, _dfr_arena_alloc(size))
+
+// Scratch buffers: a fixed-size buffer in the scope's own stack frame that
+// scratch_alloc() carves allocations out of. When it runs out, allocations
+// spill to the heap, and the spilled blocks are freed by a defer on every exit
+// from the scope. Sized for the common case, nothing touches the allocator.
+//
+//     S_
+//         scratchdecl(4096);
+//         char* line = scratch_alloc(len + 1);
+//         ...
+//     _S
+//
+// One scratchdecl per scope. A nested scope can declare its own, otherwise
+// scratch_alloc uses the enclosing one and the memory lives until that
+// scope exits.
+
+typedef struct _dfr_ScratchSpill {
+    struct _dfr_ScratchSpill* next;
+} _dfr_ScratchSpill;
+
+typedef struct _dfr_Scratch {
+    char* ptr;
+    size_t left;
+    _dfr_ScratchSpill* spills;
+} _dfr_Scratch;
+
+// Element type of the inline buffer, for alignment without C11 _Alignas
+typedef union _dfr_ScratchUnit {
+    long double ld;
+    long long ll;
+    void* ptr;
+    void (*fn)(void);
+    char bytes[DEFER_ARENA_ALIGN];
+} _dfr_ScratchUnit;
+
+#define _DFR_SCRATCH_HEADER _DFR_ARENA_ROUND(sizeof(_dfr_ScratchSpill))
+
+#ifdef __GNUC__
+__attribute__((noinline, cold))
+#endif
+static void* _dfr_scratch_spill(_dfr_Scratch* scratch, size_t size) {
+    if (size > SIZE_MAX - _DFR_SCRATCH_HEADER) {
+        return NULL;
+    }
+    _dfr_ScratchSpill* spill = (_dfr_ScratchSpill*)DEFER_ALLOC_MALLOC(_DFR_SCRATCH_HEADER + size);
+    if (!spill) {
+        return NULL;
+    }
+    spill->next = scratch->spills;
+    scratch->spills = spill;
+    return (char*)spill + _DFR_SCRATCH_HEADER;
+}
+
+static inline void* _dfr_scratch_alloc(_dfr_Scratch* scratch, size_t size) {
+    if (size > SIZE_MAX - DEFER_ARENA_ALIGN) {
+        return NULL;
+    }
+    size = _DFR_ARENA_ROUND(size);
+    if (size <= scratch->left) {
+        void* ptr = scratch->ptr;
+        scratch->ptr += size;
+        scratch->left -= size;
+        return ptr;
+    }
+    return _dfr_scratch_spill(scratch, size);
+}
+
+// Cleanup function registered by scratchdecl
+static inline void _dfr_scratch_release(void* arg) {
+    _dfr_Scratch* scratch = (_dfr_Scratch*)arg;
+    _dfr_ScratchSpill* spill = scratch->spills;
+    while (spill) {
+        _dfr_ScratchSpill* next = spill->next;
+        DEFER_ALLOC_FREE(spill);
+        spill = next;
+    }
+}
+
+#define scratchdecl(size) \
+    _dfr_ScratchUnit _dfr_scratch_mem[((size) + sizeof(_dfr_ScratchUnit) - 1) / sizeof(_dfr_ScratchUnit)]; \
+    _dfr_Scratch _dfr_scratch = { (char*)_dfr_scratch_mem, sizeof(_dfr_scratch_mem), NULL }; \
+    defer(_dfr_scratch_release, _dfr_scratch)
+
+// Returns memory aligned to DEFER_ARENA_ALIGN, or NULL if a spill failed
+#define scratch_alloc(size) _dfr_scratch_alloc(&_dfr_scratch, size)
+
+// Batch free: defer_free_each(array, count) frees every non-NULL pointer in
+// array[count - 1] ... array[0] with one defer. The NULL check is done a block
+// of four pointers at a time (an OR of the whole block, which compilers turn
+// into a couple of vector ops), so sparse fan-out arrays, where most slots
+// never got a buffer, cost one branch per block instead of one per slot.
+// Not SSE intrinsics: <emmintrin.h> has inline functions that break if it's
+// included after defer.h has redefined return.
+//
+// defer_free_each_sized passes the common allocation size to
+// DEFER_FREE_SIZED(ptr, size) when it's defined (e.g. C23 free_sized, or a
+// wrapper around jemalloc's sdallocx), and falls back to DEFER_ALLOC_FREE.
+//
+// The loops here are for loops on purpose: a redefined for only costs anything
+// on entry, a redefined while on every iteration.
+
+typedef struct _dfr_FreeEach {
+    void** base;
+    size_t count;
+    size_t size;  // 0 when unknown
+} _dfr_FreeEach;
+
+static inline void _dfr_free_one(void* ptr, size_t size) {
+#ifdef DEFER_FREE_SIZED
+    if (size) {
+        DEFER_FREE_SIZED(ptr, size);
+        return;
+    }
+#endif
+    (void)size;
+    DEFER_ALLOC_FREE(ptr);
+}
+
+static inline void _dfr_free_range(void** base, size_t from, size_t to, size_t size) {
+    for (size_t i = to; i > from; i--) {
+        if (base[i - 1]) {
+            _dfr_free_one(base[i - 1], size);
+        }
+    }
+}
+
+// Cleanup function registered by defer_free_each. Memory-only, so it does
+// nothing after defer_fast_exit().
+static inline void _dfr_free_each(void* arg) {
+    if (defer_fast_exiting()) {
+        return;
+    }
+    _dfr_FreeEach* each = (_dfr_FreeEach*)arg;
+    void** base = each->base;
+    size_t blocks = each->count / 4;
+    // Ragged end first, to keep reverse order
+    _dfr_free_range(base, blocks * 4, each->count, each->size);
+    for (size_t b = blocks; b > 0; b--) {
+        void** block = base + (b - 1) * 4;
+        if ((uintptr_t)block[0] | (uintptr_t)block[1] | (uintptr_t)block[2] | (uintptr_t)block[3]) {
+            _dfr_free_range(block, 0, 4, each->size);
+        }
+    }
+}
+
+#define _dfr_free_each_impl(kind, array, count, size, unique) \
+    _dfr_FreeEach _CAT(_dfr_free_each, unique) = \
+        { (void**)(array), (size_t)(count), (size_t)(size) }; \
+    kind(_dfr_free_each, _CAT(_dfr_free_each, unique))
+
+#define defer_free_each(array, count) \
+    _dfr_free_each_impl(defer, array, count, 0, _UNIQUER)
+#define errdefer_free_each(array, count) \
+    _dfr_free_each_impl(errdefer, array, count, 0, _UNIQUER)
+#define defer_free_each_sized(array, count, size) \
+    _dfr_free_each_impl(defer, array, count, size, _UNIQUER)
+
+#endif // DEFER_ALLOC_H
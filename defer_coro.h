@@ -0,0 +1,216 @@
+#ifndef DEFER_CORO_H
+#define DEFER_CORO_H
+
+// Defers that survive suspension, for stackless coroutines in the style of
+// protothreads: a handler function is re-entered through a switch on its
+// resume point, like the Duff's device in the tests, so nothing on its stack
+// lives across a yield. Its state lives in a caller-provided frame that
+// embeds a defer_coro, and so do its pending defers: coro_defer registers
+// a cleanup in the frame, and it runs when the coroutine finishes, either by
+// reaching CORO_END, through CORO_RETURN/CORO_RETURNERR, or when the owner
+// calls defer_coro_cancel() on a suspended one.
+//
+//     typedef struct {
+//         defer_coro co;
+//         int fd;
+//         char* buf;
+//     } conn_task;
+//
+//     int conn_step(conn_task* t) {
+//         CORO_BEGIN(&t->co);
+//         t->fd = open_conn();
+//         coro_defer(&t->co, close_fd, t->fd);
+//         CORO_AWAIT(&t->co, readable(t->fd));
+//         t->buf = malloc(4096);
+//         coro_errdefer(&t->co, free_ptr, t->buf);  // only if cancelled or failed
+//         CORO_YIELD(&t->co);
+//         ...
+//         CORO_END(&t->co);  // close_fd runs here
+//     }
+//
+// Step functions return DEFER_CORO_YIELDED while suspended, and
+// DEFER_CORO_DONE once finished (after that, stepping again is a no-op). A
+// zeroed defer_coro is a coroutine that hasn't started. Thousands of
+// suspended tasks cost one frame each: up to DEFER_CORO_INLINE defers are kept
+// in the frame itself, more spill to the heap.
+//
+// The usual protothread rules apply: locals don't survive a yield, so
+// anything that does, including every variable handed to coro_defer, must
+// live in the frame; and don't yield from inside a switch of your own.
+// Plain S_ _S scopes are fine between yields, but not around one, since their
+// contexts are on the stack. S_CORO(co) ... _S_CORO(co) is the coroutine
+// equivalent: a scope whose defers are in the frame and run at its end, even
+// if it yielded in between. Leave those scopes only through their end or
+// CORO_RETURN/CORO_RETURNERR, not with break, continue, return or goto.
+
+#include <string.h>
+#include "defer.h"
+
+// Defers kept in the frame before spilling to the heap
+#ifndef DEFER_CORO_INLINE
+#define DEFER_CORO_INLINE 4
+#endif
+
+// Maximum nesting of S_CORO scopes
+#ifndef DEFER_CORO_DEPTH
+#define DEFER_CORO_DEPTH 4
+#endif
+
+enum { DEFER_CORO_DONE = 0, DEFER_CORO_YIELDED = 1 };
+
+// resume value of a finished coroutine, matches no case of CORO_BEGIN
+#define _DFR_CORO_FINISHED 0xffffffffu
+
+typedef struct _dfr_CoroRecord {
+    void (*func)(void*);
+    void* arg;
+    bool is_err;
+} _dfr_CoroRecord;
+
+typedef struct defer_coro {
+    unsigned resume;  // 0 before the first step, then the case to jump to
+    unsigned top;     // defers registered and not run yet
+    unsigned cap;     // capacity of spill, 0 while the inline records suffice
+    unsigned depth;   // open S_CORO scopes
+    unsigned marks[DEFER_CORO_DEPTH];  // top at the start of each open scope
+    _dfr_CoroRecord* spill;
+    _dfr_CoroRecord records[DEFER_CORO_INLINE];
+} defer_coro;
+
+static inline _dfr_CoroRecord* _dfr_coro_records(defer_coro* co) {
+    return co->spill ? co->spill : co->records;
+}
+
+#ifdef __GNUC__
+__attribute__((noinline, cold))
+#endif
+static void _dfr_coro_grow(defer_coro* co) {
+    unsigned cap = co->cap ? co->cap * 2 : DEFER_CORO_INLINE * 2;
+    _dfr_CoroRecord* spill = (_dfr_CoroRecord*)malloc(cap * sizeof(*spill));
+    if (!spill) {
+        fputs("defer_coro.h: out of memory growing a coroutine's defers\n", stderr);
+        abort();
+    }
+    memcpy(spill, _dfr_coro_records(co), co->top * sizeof(*spill));
+    free(co->spill);
+    co->spill = spill;
+    co->cap = cap;
+}
+
+static inline void _dfr_coro_push(defer_coro* co, void (*func)(void*), void* arg, bool is_err) {
+    if (co->top == (co->spill ? co->cap : DEFER_CORO_INLINE)) {
+        _dfr_coro_grow(co);
+    }
+    _dfr_CoroRecord* record = &_dfr_coro_records(co)[co->top++];
+    record->func = func;
+    record->arg = arg;
+    record->is_err = is_err;
+}
+
+// Run the defers registered since mark, newest first. A cleanup may register
+// more defers on the same coroutine, they run too.
+static inline void _dfr_coro_unwind(defer_coro* co, unsigned mark, bool error_occurred) {
+    for (; co->top > mark; ) {
+        _dfr_CoroRecord* record = &_dfr_coro_records(co)[--co->top];
+        if (error_occurred || !record->is_err) {
+            record->func(record->arg);
+        }
+    }
+}
+
+// Runs every pending defer (errdefers too if error_occurred) and marks the
+// coroutine finished. Finishing a finished coroutine does nothing.
+static inline void defer_coro_finish(defer_coro* co, bool error_occurred) {
+    _dfr_coro_unwind(co, 0, error_occurred);
+    free(co->spill);
+    co->spill = NULL;
+    co->cap = 0;
+    co->depth = 0;
+    co->resume = _DFR_CORO_FINISHED;
+}
+
+// Abandon a suspended coroutine: its defers and errdefers run now
+static inline void defer_coro_cancel(defer_coro* co) {
+    if (co->resume != _DFR_CORO_FINISHED) {
+        defer_coro_finish(co, true);
+    }
+}
+
+static inline bool defer_coro_done(const defer_coro* co) {
+    return co->resume == _DFR_CORO_FINISHED;
+}
+
+static inline void _dfr_coro_open(defer_coro* co) {
+    if (co->depth == DEFER_CORO_DEPTH) {
+        fputs("defer_coro.h: S_CORO scopes nested deeper than DEFER_CORO_DEPTH\n", stderr);
+        abort();
+    }
+    co->marks[co->depth++] = co->top;
+}
+
+static inline void _dfr_coro_close(defer_coro* co) {
+    _dfr_coro_unwind(co, co->marks[--co->depth], false);
+}
+
+#define coro_defer(co, cleanup_func, var) \
+    _dfr_coro_push(co, cleanup_func, &(var), false)
+#define coro_errdefer(co, cleanup_func, var) \
+    _dfr_coro_push(co, cleanup_func, &(var), true)
+
+// Falling into a resume point is the point, -Wimplicit-fallthrough aside
+#ifdef __has_attribute
+  #if __has_attribute(fallthrough)
+    #define _DFR_CORO_FALLTHROUGH __attribute__((fallthrough))
+  #endif
+#endif
+#ifndef _DFR_CORO_FALLTHROUGH
+  #define _DFR_CORO_FALLTHROUGH (void)0
+#endif
+
+// Resume points are numbered with _UNIQUER, offset by one since 0 is the start.
+// Braced instead of do/while(0), like defer_thread, so a surrounding C99
+// scope's break and continue keep their targets.
+#define CORO_BEGIN(co) switch ((co)->resume) { case 0:
+
+#define CORO_YIELD(co) _dfr_coro_yield(co, _UNIQUER)
+#define _dfr_coro_yield(co, id) \
+    if (1) { \
+        (co)->resume = (id) + 1; \
+        return DEFER_CORO_YIELDED; \
+        _DFR_CORO_FALLTHROUGH; \
+        case (id) + 1:; \
+    } else (void)0
+
+// Yield until cond holds, checking it again on every step
+#define CORO_AWAIT(co, cond) _dfr_coro_await(co, cond, _UNIQUER)
+#define _dfr_coro_await(co, cond, id) \
+    if (1) { \
+        (co)->resume = (id) + 1; \
+        _DFR_CORO_FALLTHROUGH; \
+        case (id) + 1: \
+        if (!(cond)) { \
+            return DEFER_CORO_YIELDED; \
+        } \
+    } else (void)0
+
+#define CORO_RETURN(co) \
+    if (1) { \
+        defer_coro_finish(co, false); \
+        return DEFER_CORO_DONE; \
+    } else (void)0
+
+#define CORO_RETURNERR(co) \
+    if (1) { \
+        defer_coro_finish(co, true); \
+        return DEFER_CORO_DONE; \
+    } else (void)0
+
+#define CORO_END(co) \
+    } \
+    defer_coro_finish(co, false); \
+    return DEFER_CORO_DONE
+
+#define S_CORO(co) { _dfr_coro_open(co);
+#define _S_CORO(co) _dfr_coro_close(co); }
+
+#endif // DEFER_CORO_H
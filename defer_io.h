@@ -0,0 +1,430 @@
+#ifndef DEFER_IO_H
+#define DEFER_IO_H
+
+// Batched syscall cleanups for defer.h. iobatchdecl(n) declares a batch in
+// the current scope, and defer_close(fd), defer_unlink(path) and
+// defer_munmap(addr, len) add to it instead of registering a defer each. The
+// batch is released by one defer, on every way out of the scope:
+//
+//     int ingest(const char* dir, int parts) S_
+//         iobatchdecl(64);
+//         for (int i = 0; i < parts; i++) {
+//             int fd = open_part(dir, i);
+//             if (fd < 0) {
+//                 returnerr -1;      // every fd so far closed here
+//             }
+//             defer_close(fd);
+//             ...
+//         }
+//         return 0;                  // or here
+//     _S
+//
+// What the release does, with the fewest kernel entries it can:
+//   - closes of consecutive fds (in the order they were added, as opening in
+//     a loop gives them) go out as one close_range() per run;
+//   - the other closes and the unlinks go to the thread's io_uring as one
+//     submission (per DEFER_IO_RING_ENTRIES operations), which is waited for
+//     before the scope is left;
+//   - munmaps, which io_uring can't do, are merged where the ranges touch
+//     and unmapped one call per range.
+// Without io_uring or close_range (not Linux, an old kernel, a seccomp
+// filter, or DEFER_IO_NO_URING) the rest is a plain loop of syscalls.
+//
+// Unlike defer, the values are taken when they're added, not at scope exit,
+// because the batch can outlive the scope of the variable (a loop body, as
+// above). Paths are not copied and have to stay valid until the batch runs.
+// Negative fds, NULL paths and MAP_FAILED are skipped. The operations run
+// where the batch's defer is, in no particular order among themselves, and
+// their errors are ignored. After defer_fast_exit() the munmaps are skipped,
+// the kernel unmaps everything at exit anyway, but closes still run: they can
+// release locks or tell a peer the stream ended before the process is gone.
+//
+// One iobatchdecl per scope. A nested scope can declare its own, otherwise
+// defer_close and friends add to the enclosing one. The first n operations
+// are kept in the scope's frame, more go to the heap.
+
+#if !defined(__unix__) && !defined(__APPLE__)
+#error "defer_io.h needs a unix"
+#endif
+// Before defer.h, whose keywords would otherwise end up in these headers'
+// inline functions if this is the first include
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#if defined(__GNUC__) && !defined(DEFER_IO_NO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <pthread.h>
+// IORING_OP_UNLINKAT came with IORING_FEAT_EXT_ARG, in 5.11
+#if defined(IORING_FEAT_EXT_ARG) && defined(__NR_io_uring_setup)
+#define _DFR_IO_URING 1
+#endif
+#endif
+#endif
+#endif
+
+#include "defer.h"
+#ifdef _DFR_IO_URING
+#include "defer_thread.h"
+#endif
+
+// How a batch enters the kernel at scope exit on Linux, e.g. a wrapper that
+// counts the calls. Called like syscall(2), which <unistd.h> only declares
+// with _DEFAULT_SOURCE.
+#if defined(__linux__) && !defined(DEFER_IO_SYSCALL)
+#define DEFER_IO_SYSCALL syscall
+long syscall(long number, ...);
+#endif
+
+// Operations per io_uring submission, and the size of each thread's ring
+#ifndef DEFER_IO_RING_ENTRIES
+#define DEFER_IO_RING_ENTRIES 256
+#endif
+
+// Fewest operations worth a trip through the ring instead of a syscall each
+#ifndef DEFER_IO_URING_MIN
+#define DEFER_IO_URING_MIN 2
+#endif
+
+enum { _DFR_IO_CLOSE, _DFR_IO_UNLINK, _DFR_IO_MUNMAP };
+
+typedef struct _dfr_IoOp {
+    int kind;
+    int fd;            // _DFR_IO_CLOSE
+    const void* ptr;   // the path, or the address to unmap
+    size_t len;        // _DFR_IO_MUNMAP
+} _dfr_IoOp;
+
+// Nothing to release is dropped here, so the flush only sees real operations
+static inline void _dfr_io_push(_dfr_Batch* batch, int kind, int fd, const void* ptr, size_t len) {
+    if (kind == _DFR_IO_CLOSE ? fd < 0 : kind == _DFR_IO_UNLINK ? !ptr : ptr == MAP_FAILED) {
+        return;
+    }
+    _dfr_IoOp* op = (_dfr_IoOp*)_dfr_batch_push(batch, sizeof(*op));
+    op->kind = kind;
+    op->fd = fd;
+    op->ptr = ptr;
+    op->len = len;
+}
+
+// One operation, the slow way
+static void _dfr_io_run_one(const _dfr_IoOp* op) {
+#ifdef __linux__
+    if (op->kind == _DFR_IO_CLOSE) {
+        DEFER_IO_SYSCALL(SYS_close, op->fd);
+    } else if (op->kind == _DFR_IO_UNLINK) {
+#ifdef SYS_unlink
+        DEFER_IO_SYSCALL(SYS_unlink, (const char*)op->ptr);
+#else
+        DEFER_IO_SYSCALL(SYS_unlinkat, AT_FDCWD, (const char*)op->ptr, 0);
+#endif
+    } else {
+        DEFER_IO_SYSCALL(SYS_munmap, (void*)op->ptr, op->len);
+    }
+#else
+    if (op->kind == _DFR_IO_CLOSE) {
+        close(op->fd);
+    } else if (op->kind == _DFR_IO_UNLINK) {
+        unlink((const char*)op->ptr);
+    } else {
+        munmap((void*)op->ptr, op->len);
+    }
+#endif
+}
+
+// close_range() is Linux 5.9, and may be filtered; set once it failed
+_dfr_shared int _dfr_io_no_close_range;
+
+// Closes the fds from lo to hi in one call, false if it can't
+static bool _dfr_io_close_range(int lo, int hi) {
+#if defined(__linux__) && defined(SYS_close_range)
+    if (!_dfr_io_no_close_range) {
+        if (DEFER_IO_SYSCALL(SYS_close_range, (unsigned)lo, (unsigned)hi, 0) == 0) {
+            return true;
+        }
+        _dfr_io_no_close_range = 1;
+    }
+#else
+    (void)lo;
+    (void)hi;
+#endif
+    return false;
+}
+
+// Length of the run of closes of consecutive fds (up or down) starting at i.
+// The loops in here are for loops, as in defer_alloc.h: a redefined for only
+// costs anything on entry, a redefined while on every iteration.
+static unsigned _dfr_io_fd_run(const _dfr_IoOp* ops, unsigned i, unsigned n) {
+    unsigned end = i + 1;
+    if (end < n && ops[end].kind == _DFR_IO_CLOSE &&
+        (ops[end].fd == ops[i].fd + 1 || ops[end].fd == ops[i].fd - 1)) {
+        int step = ops[end].fd - ops[i].fd;
+        for (; end < n && ops[end].kind == _DFR_IO_CLOSE && ops[end].fd == ops[end - 1].fd + step; end++) {}
+    }
+    return end - i;
+}
+
+#ifdef _DFR_IO_URING
+// Each thread's ring, set up by the first batch that needs it and closed when
+// the thread exits
+typedef struct _dfr_IoRing {
+    int state;             // 0 not set up yet, 1 ready, -1 unavailable
+    int fd;
+    unsigned entries;
+    unsigned unsupported;  // 1 << kind for opcodes the kernel rejected
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_map;
+    size_t sq_map_size;
+    void* cq_map;          // NULL when it shares sq_map
+    size_t cq_map_size;
+    size_t sqes_size;
+} _dfr_IoRing;
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+#if defined(IORING_SETUP_SUBMIT_ALL) && defined(IORING_SETUP_COOP_TASKRUN) && defined(IORING_SETUP_SINGLE_ISSUER)
+#define _DFR_IO_SETUP_FLAGS (IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER)
+#else
+#define _DFR_IO_SETUP_FLAGS 0
+#endif
+
+_dfr_shared _dfr_thread_local _dfr_IoRing _dfr_io_ring;
+_dfr_shared pthread_once_t _dfr_io_atfork_once = PTHREAD_ONCE_INIT;
+
+static void _dfr_io_ring_close(void* arg) {
+    _dfr_IoRing* ring = (_dfr_IoRing*)arg;
+    if (ring->state != 1) {
+        return;
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+    ring->state = 0;
+}
+
+// The child of a fork shares the ring's memory with the parent, so it drops
+// its copy and sets up its own
+static void _dfr_io_atfork_child(void) {
+    _dfr_io_ring_close(&_dfr_io_ring);
+}
+
+static void _dfr_io_atfork_register(void) {
+    pthread_atfork(NULL, NULL, _dfr_io_atfork_child);
+}
+
+#ifdef __GNUC__
+__attribute__((noinline, cold))
+#endif
+static bool _dfr_io_ring_setup(_dfr_IoRing* ring) {
+    ring->state = -1;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Submit every entry even if one fails, and only this thread submits.
+    // Older kernels reject the flags, then go without.
+    params.flags = _DFR_IO_SETUP_FLAGS;
+    long fd = syscall(__NR_io_uring_setup, DEFER_IO_RING_ENTRIES, &params);
+    if (fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        fd = syscall(__NR_io_uring_setup, DEFER_IO_RING_ENTRIES, &params);
+    }
+    if (fd < 0) {
+        return false;
+    }
+    ring->fd = (int)fd;
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size) ring->sq_map_size = ring->cq_map_size;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = NULL;
+    ring->sqes = (struct io_uring_sqe*)MAP_FAILED;
+    char* cq = (char*)ring->sq_map;
+    if (ring->sq_map != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        cq = (char*)ring->cq_map;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (cq != (char*)MAP_FAILED) {
+        ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    }
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_map && ring->cq_map != MAP_FAILED) munmap(ring->cq_map, ring->cq_map_size);
+        if (ring->sq_map != MAP_FAILED) munmap(ring->sq_map, ring->sq_map_size);
+        close(ring->fd);
+        return false;
+    }
+    char* sq = (char*)ring->sq_map;
+    ring->entries = params.sq_entries;
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    pthread_once(&_dfr_io_atfork_once, _dfr_io_atfork_register);
+    defer_thread(_dfr_io_ring_close, _dfr_io_ring);
+    ring->unsupported = 0;
+    ring->state = 1;
+    return true;
+}
+
+static void _dfr_io_ring_failed(_dfr_IoRing* ring) {
+    // Unconsumed entries go away with the ring instead of running later
+    _dfr_io_ring_close(ring);
+    ring->state = -1;
+}
+
+// Waits for count completions of the submission of ops, and runs the ones
+// the kernel doesn't support by hand. False if the ring broke.
+static bool _dfr_io_ring_reap(_dfr_IoRing* ring, const _dfr_IoOp* ops, unsigned count) {
+    for (unsigned reaped = 0; reaped < count; ) {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++, reaped++) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->res == -EINVAL) {
+                const _dfr_IoOp* op = &ops[cqe->user_data];
+                ring->unsupported |= 1u << op->kind;
+                _dfr_io_run_one(op);
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        if (reaped < count &&
+            DEFER_IO_SYSCALL(__NR_io_uring_enter, ring->fd, 0, count - reaped,
+                             IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Runs ops through the ring, one submission per ring full, and returns how
+// many it took care of; the caller does the rest by hand
+static unsigned _dfr_io_ring_run(_dfr_IoOp* ops, unsigned n) {
+    _dfr_IoRing* ring = &_dfr_io_ring;
+    if (ring->state != 1 && (ring->state < 0 || !_dfr_io_ring_setup(ring))) {
+        return 0;
+    }
+    for (unsigned done = 0; done < n; ) {
+        unsigned count = n - done < ring->entries ? n - done : ring->entries;
+        unsigned tail = *ring->sq_tail;
+        unsigned mask = *ring->sq_mask;
+        for (unsigned i = 0; i < count; i++, tail++) {
+            const _dfr_IoOp* op = &ops[done + i];
+            struct io_uring_sqe* sqe = &ring->sqes[tail & mask];
+            memset(sqe, 0, sizeof(*sqe));
+            if (op->kind == _DFR_IO_CLOSE) {
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = op->fd;
+            } else {
+                sqe->opcode = IORING_OP_UNLINKAT;
+                sqe->fd = AT_FDCWD;
+                sqe->addr = (uint64_t)(uintptr_t)op->ptr;
+            }
+            sqe->user_data = done + i;
+            ring->sq_array[tail & mask] = tail & mask;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        long submitted = -1;
+        for (int tries = 0; submitted < 0 && tries < 8; tries++) {
+            submitted = DEFER_IO_SYSCALL(__NR_io_uring_enter, ring->fd, count, count,
+                                         IORING_ENTER_GETEVENTS, NULL, 0);
+            if (submitted < 0 && errno != EINTR) {
+                tries = 8;
+            }
+        }
+        if (submitted < 0) {
+            submitted = 0;
+        }
+        // The kernel takes entries in order, so the first ones are in flight
+        if (!_dfr_io_ring_reap(ring, ops, (unsigned)submitted) || (unsigned)submitted < count) {
+            _dfr_io_ring_failed(ring);
+            return done + (unsigned)submitted;
+        }
+        done += count;
+    }
+    return n;
+}
+#endif // _DFR_IO_URING
+
+// Cleanup function registered by iobatchdecl
+static void _dfr_io_flush(void* arg) {
+    _dfr_Batch* batch = (_dfr_Batch*)arg;
+    _dfr_IoOp* ops = (_dfr_IoOp*)batch->ops;
+    unsigned n = batch->len;
+    bool fast_exit = defer_fast_exiting();
+    // Closes in runs and munmaps go now, what's left is moved to the front
+    unsigned rest = 0;
+    for (unsigned i = 0, run = 1; i < n; i += run) {
+        _dfr_IoOp* op = &ops[i];
+        run = 1;
+        if (op->kind == _DFR_IO_CLOSE) {
+            run = _dfr_io_fd_run(ops, i, n);
+            int first = op->fd, last = ops[i + run - 1].fd;
+            if (run < 2 || !_dfr_io_close_range(first < last ? first : last, first < last ? last : first)) {
+                run = 1;
+                ops[rest++] = *op;
+            }
+        } else if (op->kind == _DFR_IO_UNLINK) {
+            ops[rest++] = *op;
+        } else if (!fast_exit) {
+            // Ranges added next to each other, in either order, unmap together
+            _dfr_IoOp range = *op;
+            for (; i + run < n && ops[i + run].kind == _DFR_IO_MUNMAP; run++) {
+                const _dfr_IoOp* next = &ops[i + run];
+                if ((const char*)range.ptr + range.len == (const char*)next->ptr) {
+                    range.len += next->len;
+                } else if ((const char*)next->ptr + next->len == (const char*)range.ptr) {
+                    range.ptr = next->ptr;
+                    range.len += next->len;
+                } else {
+                    break;
+                }
+            }
+            _dfr_io_run_one(&range);
+        }
+    }
+    unsigned done = 0;
+#ifdef _DFR_IO_URING
+    if (rest >= DEFER_IO_URING_MIN && !_dfr_io_ring.unsupported) {
+        done = _dfr_io_ring_run(ops, rest);
+    }
+#endif
+    for (; done < rest; done++) {
+        _dfr_io_run_one(&ops[done]);
+    }
+    _dfr_batch_free(batch);
+}
+
+#define iobatchdecl(n) \
+    _dfr_batch_decl(_dfr_iobatch, _dfr_IoOp, n); \
+    defer(_dfr_io_flush, _dfr_iobatch)
+
+// Only usable in a scope with an iobatchdecl, or one nested in it
+#define defer_close(fd) _dfr_io_push(&_dfr_iobatch, _DFR_IO_CLOSE, (fd), NULL, 0)
+#define defer_unlink(path) _dfr_io_push(&_dfr_iobatch, _DFR_IO_UNLINK, -1, (path), 0)
+#define defer_munmap(addr, len) _dfr_io_push(&_dfr_iobatch, _DFR_IO_MUNMAP, -1, (addr), (len))
+
+#endif // DEFER_IO_H
@@ -0,0 +1,428 @@
+#ifndef DEFER_LOCK_H
+#define DEFER_LOCK_H
+
+// Lock scopes for pthread mutexes, rwlocks and spinlocks. defer_lock(m) locks
+// m and unlocks it on every way out of the enclosing S_ _S scope, and
+// defer_unlock(m) only registers the unlock, for a lock taken some other way:
+//
+//     int queue_push(queue* q, item* it) S_
+//         defer_lock(q->mutex);
+//         if (q->len == q->cap) {
+//             returnerr -1;        // unlocked here
+//         }
+//         q->items[q->len++] = it;
+//         return 0;                // and here
+//     _S
+//
+//     defer_lock(mutex)        defer_unlock(mutex)        pthread_mutex_t
+//     defer_rdlock(rwlock)     defer_rwunlock(rwlock)     pthread_rwlock_t
+//     defer_wrlock(rwlock)
+//     defer_spin_lock(spin)    defer_spin_unlock(spin)    pthread_spinlock_t
+//
+// The argument is the lock object itself, not a pointer to it, and is taken
+// by reference like defer's var. In GNU C the cleanup attribute calls the
+// unlock function directly with the lock's real type, so it inlines like a
+// hand-written unlock; the C99 versions (and DEFER_LONGJMP, which has to be
+// able to run them) go through an ordinary defer node. Like defer, these are
+// declarations: use them as statements of an S_ _S scope. Lock errors are
+// ignored, as they usually are at a lock call; use defer_unlock after your
+// own checked lock if you need them.
+//
+// Lock profiling. With DEFER_LOCK_PROFILE defined for the whole build, every
+// lock site gets a static descriptor (file:line, the lock expression and its
+// kind) and a per-thread record of:
+//   - acquisitions through defer_lock and friends, and how many of them found
+//     the lock taken (a trylock fails first), with a log2 histogram of cycles
+//     spent waiting for those;
+//   - holds, from acquisition (or defer_unlock) to the unlock at scope exit,
+//     whichever exit that was, with their total, maximum and log2 histogram.
+// The fast path of an uncontended lock is a trylock and two cycle counter
+// reads. Records are only written by their own thread, so the counters need
+// no locks; threads and sites are published on lock-free lists, as
+// DEFER_PROFILE does for cleanups. defer_lock_collect() returns the totals
+// per site, defer_lock_report(FILE*) prints them, the sites that waited
+// longest first, and so does exit, to $DEFER_LOCK_PROFILE_OUT or
+// DEFER_LOCK_PROFILE_FILE (default defer_lock_profile.txt). Without
+// DEFER_LOCK_PROFILE none of it exists.
+
+#if !defined(__unix__) && !defined(__APPLE__)
+#error "defer_lock.h needs pthreads"
+#endif
+// Before defer.h, whose keywords would otherwise end up in pthread.h's inline
+// functions if this is the first include
+#include <pthread.h>
+#include <unistd.h>
+
+#include "defer.h"
+
+// rwlocks and spinlocks need _POSIX_C_SOURCE >= 200112L or the like, and
+// spinlocks aren't everywhere (macOS). PTHREAD_RWLOCK_INITIALIZER comes with
+// the rwlock declarations.
+#ifdef PTHREAD_RWLOCK_INITIALIZER
+#define DEFER_RWLOCKS_AVAILABLE 1
+#else
+#define DEFER_RWLOCKS_AVAILABLE 0
+#endif
+#if DEFER_RWLOCKS_AVAILABLE && defined(_POSIX_SPIN_LOCKS) && _POSIX_SPIN_LOCKS > 0
+#define DEFER_SPINLOCKS_AVAILABLE 1
+#else
+#define DEFER_SPINLOCKS_AVAILABLE 0
+#endif
+
+#ifdef DEFER_LOCK_PROFILE
+#ifndef DEFER_LOCK_PROFILE_FILE
+#define DEFER_LOCK_PROFILE_FILE "defer_lock_profile.txt"
+#endif
+
+#define DEFER_LOCK_BUCKETS 32
+#define _DFR_LOCK_PAGE 64      // records per page
+#define _DFR_LOCK_PAGES 256    // pages per thread, so up to 16384 sites
+
+typedef struct _dfr_LockSite {
+    const char* file;
+    int line;
+    const char* lock;            // the lock expression
+    const char* kind;            // mutex, rdlock, wrlock, rwlock or spin
+    unsigned id;                 // 0 until first used, then 1 based
+    struct _dfr_LockSite* next;  // list of every site that has been used
+} _dfr_LockSite;
+
+typedef struct _dfr_LockRecord {
+    uint64_t acquired;
+    uint64_t contended;
+    uint64_t wait_cycles;
+    uint64_t holds;
+    uint64_t hold_cycles;
+    uint64_t hold_max;
+    uint64_t wait_hist[DEFER_LOCK_BUCKETS];  // [i]: contended waits of [2^i, 2^(i+1)) cycles
+    uint64_t hold_hist[DEFER_LOCK_BUCKETS];  // [i]: holds of [2^i, 2^(i+1)) cycles
+} _dfr_LockRecord;
+
+typedef struct _dfr_LockThread {
+    _dfr_LockRecord* pages[_DFR_LOCK_PAGES];
+    struct _dfr_LockThread* next;
+} _dfr_LockThread;
+
+// What a lock scope remembers until its unlock
+typedef struct _dfr_LockHold {
+    void* lock;
+    _dfr_LockSite* site;
+    uint64_t start;
+} _dfr_LockHold;
+
+// Totals of one lock site over every thread, from defer_lock_collect()
+typedef struct defer_lock_stats {
+    const char* file;
+    int line;
+    const char* lock;
+    const char* kind;
+    uint64_t acquired;
+    uint64_t contended;
+    uint64_t wait_cycles;
+    uint64_t holds;
+    uint64_t hold_cycles;
+    uint64_t hold_max;
+    uint64_t wait_hist[DEFER_LOCK_BUCKETS];
+    uint64_t hold_hist[DEFER_LOCK_BUCKETS];
+} defer_lock_stats;
+
+_dfr_shared _dfr_LockSite* _dfr_lock_sites;
+_dfr_shared _dfr_LockThread* _dfr_lock_threads;
+_dfr_shared unsigned _dfr_lock_next_id;
+_dfr_shared int _dfr_lock_exit_hook;
+_dfr_shared _dfr_thread_local _dfr_LockThread* _dfr_lock_self;
+
+// Fills out with up to max sites that have been used, summed over every
+// thread, and returns how many there are (which may be more than max). Counts
+// of threads that are still running may be a few events behind.
+static inline size_t defer_lock_collect(defer_lock_stats* out, size_t max) {
+    size_t n = 0;
+    _dfr_LockSite* site = __atomic_load_n(&_dfr_lock_sites, __ATOMIC_ACQUIRE);
+    for (; site && n < max; site = site->next, n++) {
+        defer_lock_stats* stats = &out[n];
+        *stats = (defer_lock_stats){ 0 };
+        stats->file = site->file;
+        stats->line = site->line;
+        stats->lock = site->lock;
+        stats->kind = site->kind;
+        unsigned index = site->id - 1;
+        _dfr_LockThread* thread = __atomic_load_n(&_dfr_lock_threads, __ATOMIC_ACQUIRE);
+        for (; thread; thread = thread->next) {
+            _dfr_LockRecord* page = __atomic_load_n(&thread->pages[index / _DFR_LOCK_PAGE], __ATOMIC_ACQUIRE);
+            // Pages only exist on threads that used the site
+            if (page) {
+                _dfr_LockRecord* record = &page[index % _DFR_LOCK_PAGE];
+                stats->acquired += __atomic_load_n(&record->acquired, __ATOMIC_RELAXED);
+                stats->contended += __atomic_load_n(&record->contended, __ATOMIC_RELAXED);
+                stats->wait_cycles += __atomic_load_n(&record->wait_cycles, __ATOMIC_RELAXED);
+                stats->holds += __atomic_load_n(&record->holds, __ATOMIC_RELAXED);
+                stats->hold_cycles += __atomic_load_n(&record->hold_cycles, __ATOMIC_RELAXED);
+                uint64_t hold_max = __atomic_load_n(&record->hold_max, __ATOMIC_RELAXED);
+                if (hold_max > stats->hold_max) stats->hold_max = hold_max;
+                for (int b = 0; b < DEFER_LOCK_BUCKETS; b++) {
+                    stats->wait_hist[b] += __atomic_load_n(&record->wait_hist[b], __ATOMIC_RELAXED);
+                    stats->hold_hist[b] += __atomic_load_n(&record->hold_hist[b], __ATOMIC_RELAXED);
+                }
+            }
+        }
+    }
+    for (; site; site = site->next) {
+        n++;
+    }
+    return n;
+}
+
+static int _dfr_lock_stats_order(const void* a, const void* b) {
+    const defer_lock_stats* x = (const defer_lock_stats*)a;
+    const defer_lock_stats* y = (const defer_lock_stats*)b;
+    if (x->wait_cycles != y->wait_cycles) {
+        return x->wait_cycles < y->wait_cycles ? 1 : -1;
+    }
+    if (x->hold_cycles != y->hold_cycles) {
+        return x->hold_cycles < y->hold_cycles ? 1 : -1;
+    }
+    return 0;
+}
+
+static void _dfr_lock_print_hist(FILE* out, const uint64_t* hist) {
+    fputc('\t', out);
+    for (int b = 0; b < DEFER_LOCK_BUCKETS; b++) {
+        if (hist[b]) fprintf(out, " %d:%llu", b, (unsigned long long)hist[b]);
+    }
+}
+
+// One line per lock site, the sites that spent the most cycles waiting first
+static inline void defer_lock_report(FILE* out) {
+    fprintf(out, "# site\tlock\tkind\tacquired\tcontended\twait cycles\tholds\thold cycles\t"
+        "mean hold\tmax hold\twait histogram (log2 cycles:count)\thold histogram\n");
+    size_t n = defer_lock_collect(NULL, 0);
+    defer_lock_stats* stats = (defer_lock_stats*)calloc(n ? n : 1, sizeof(*stats));
+    if (!stats) {
+        return;
+    }
+    n = defer_lock_collect(stats, n);
+    qsort(stats, n, sizeof(*stats), _dfr_lock_stats_order);
+    for (size_t i = 0; i < n; i++) {
+        defer_lock_stats* s = &stats[i];
+        fprintf(out, "%s:%d\t%s\t%s\t%llu\t%llu\t%llu\t%llu\t%llu\t%.1f\t%llu", s->file, s->line,
+            s->lock, s->kind, (unsigned long long)s->acquired, (unsigned long long)s->contended,
+            (unsigned long long)s->wait_cycles, (unsigned long long)s->holds,
+            (unsigned long long)s->hold_cycles,
+            s->holds ? (double)s->hold_cycles / (double)s->holds : 0.0,
+            (unsigned long long)s->hold_max);
+        _dfr_lock_print_hist(out, s->wait_hist);
+        _dfr_lock_print_hist(out, s->hold_hist);
+        fputc('\n', out);
+    }
+    free(stats);
+}
+
+static inline int defer_lock_report_file(const char* path) {
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        return -1;
+    }
+    defer_lock_report(out);
+    return fclose(out);
+}
+
+static void _dfr_lock_report_at_exit(void) {
+    const char* path = getenv("DEFER_LOCK_PROFILE_OUT");
+    defer_lock_report_file(path && *path ? path : DEFER_LOCK_PROFILE_FILE);
+}
+
+// First use of a site: give it an id and publish it. Once the ids run out
+// the counter stays put, as in _dfr_prof_register.
+__attribute__((noinline, cold))
+static unsigned _dfr_lock_register(_dfr_LockSite* site) {
+    unsigned id = 0;
+    unsigned fresh = __atomic_load_n(&_dfr_lock_next_id, __ATOMIC_RELAXED);
+    do {
+        if (fresh >= _DFR_LOCK_PAGE * _DFR_LOCK_PAGES) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&_dfr_lock_next_id, &fresh, fresh + 1, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    fresh++;
+    if (!__atomic_compare_exchange_n(&site->id, &id, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return id;  // another thread got there first
+    }
+    site->next = __atomic_load_n(&_dfr_lock_sites, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&_dfr_lock_sites, &site->next, site, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    if (__atomic_exchange_n(&_dfr_lock_exit_hook, 1, __ATOMIC_ACQ_REL) == 0) {
+        atexit(_dfr_lock_report_at_exit);
+    }
+    return fresh;
+}
+
+// First use of a site on this thread. Records are never freed, so they can
+// still be reported after the thread is gone.
+__attribute__((noinline, cold))
+static _dfr_LockRecord* _dfr_lock_record_slow(unsigned index) {
+    _dfr_LockThread* self = _dfr_lock_self;
+    if (!self) {
+        self = (_dfr_LockThread*)calloc(1, sizeof(*self));
+        if (!self) {
+            return NULL;
+        }
+        self->next = __atomic_load_n(&_dfr_lock_threads, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&_dfr_lock_threads, &self->next, self, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+        _dfr_lock_self = self;
+    }
+    _dfr_LockRecord* page = self->pages[index / _DFR_LOCK_PAGE];
+    if (!page) {
+        page = (_dfr_LockRecord*)calloc(_DFR_LOCK_PAGE, sizeof(*page));
+        if (!page) {
+            return NULL;
+        }
+        __atomic_store_n(&self->pages[index / _DFR_LOCK_PAGE], page, __ATOMIC_RELEASE);
+    }
+    return &page[index % _DFR_LOCK_PAGE];
+}
+
+static inline _dfr_LockRecord* _dfr_lock_record(_dfr_LockSite* site) {
+    unsigned id = __atomic_load_n(&site->id, __ATOMIC_ACQUIRE);
+    if (!id && !(id = _dfr_lock_register(site))) {
+        return NULL;
+    }
+    unsigned index = id - 1;
+    _dfr_LockThread* self = _dfr_lock_self;
+    _dfr_LockRecord* page = self ? self->pages[index / _DFR_LOCK_PAGE] : NULL;
+    return page ? &page[index % _DFR_LOCK_PAGE] : _dfr_lock_record_slow(index);
+}
+
+static inline int _dfr_lock_bucket(uint64_t cycles) {
+    int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+    return bucket < DEFER_LOCK_BUCKETS ? bucket : DEFER_LOCK_BUCKETS - 1;
+}
+
+// Single writer per record: plain read, relaxed store so reports don't race
+#define _dfr_lock_add(field, value) \
+    __atomic_store_n(&(field), (field) + (value), __ATOMIC_RELAXED)
+
+// A contended acquisition is timed from the failed trylock to the lock
+static inline void _dfr_lock_acquired(_dfr_LockSite* site, bool contended, uint64_t wait) {
+    _dfr_LockRecord* record = _dfr_lock_record(site);
+    if (!record) {
+        return;
+    }
+    _dfr_lock_add(record->acquired, 1);
+    if (contended) {
+        _dfr_lock_add(record->contended, 1);
+        _dfr_lock_add(record->wait_cycles, wait);
+        _dfr_lock_add(record->wait_hist[_dfr_lock_bucket(wait)], 1);
+    }
+}
+
+static inline void _dfr_lock_released(_dfr_LockHold* hold, uint64_t now) {
+    uint64_t cycles = now - hold->start;
+    _dfr_LockRecord* record = _dfr_lock_record(hold->site);
+    if (!record) {
+        return;
+    }
+    _dfr_lock_add(record->holds, 1);
+    _dfr_lock_add(record->hold_cycles, cycles);
+    if (cycles > record->hold_max) {
+        __atomic_store_n(&record->hold_max, cycles, __ATOMIC_RELAXED);
+    }
+    _dfr_lock_add(record->hold_hist[_dfr_lock_bucket(cycles)], 1);
+}
+
+#define _DFR_LOCK_SITE(kind, lock) \
+    ({ static _dfr_LockSite _dfr_site = { __FILE__, __LINE__, #lock, #kind, 0, NULL }; &_dfr_site; })
+
+// Per lock kind: acquire (timing a contended wait), start a hold that began
+// elsewhere, and release, directly for the cleanup attribute or as a node
+#define _DFR_LOCK_KIND(kind, type, lock_fn, trylock_fn, unlock_fn) \
+    static inline _dfr_LockHold _dfr_acquire_##kind(type* lock, _dfr_LockSite* site) { \
+        if (trylock_fn(lock) == 0) { \
+            _dfr_lock_acquired(site, false, 0); \
+        } else { \
+            uint64_t start = _dfr_now(); \
+            lock_fn(lock); \
+            _dfr_lock_acquired(site, true, _dfr_now() - start); \
+        } \
+        _dfr_LockHold hold = { (void*)lock, site, _dfr_now() }; \
+        return hold; \
+    } \
+    static inline _dfr_LockHold _dfr_holding_##kind(type* lock, _dfr_LockSite* site) { \
+        _dfr_LockHold hold = { (void*)lock, site, _dfr_now() }; \
+        return hold; \
+    } \
+    static inline void _dfr_release_ref_##kind(_dfr_LockHold* hold) { \
+        uint64_t now = _dfr_now(); \
+        unlock_fn((type*)hold->lock); \
+        _dfr_lock_released(hold, now); \
+    } \
+    static inline void _dfr_release_node_##kind(void* hold) { \
+        _dfr_release_ref_##kind((_dfr_LockHold*)hold); \
+    } \
+    struct _dfr_lock_##kind##_declared
+
+#if USING_GNUC_DEFER && !defined(DEFER_LONGJMP)
+#define _dfr_lock_impl(kind, lock, unique) \
+    _dfr_LockHold _CAT(_dfr_hold, unique) __attribute__((cleanup(_dfr_release_ref_##kind))) = \
+        _dfr_acquire_##kind(&(lock), _DFR_LOCK_SITE(kind, lock))
+#define _dfr_unlock_impl(kind, lock, unique) \
+    _dfr_LockHold _CAT(_dfr_hold, unique) __attribute__((cleanup(_dfr_release_ref_##kind))) = \
+        _dfr_holding_##kind(&(lock), _DFR_LOCK_SITE(kind, lock))
+#else
+#define _dfr_lock_impl(kind, lock, unique) \
+    _dfr_LockHold _CAT(_dfr_hold, unique) = _dfr_acquire_##kind(&(lock), _DFR_LOCK_SITE(kind, lock)); \
+    defer(_dfr_release_node_##kind, _CAT(_dfr_hold, unique))
+#define _dfr_unlock_impl(kind, lock, unique) \
+    _dfr_LockHold _CAT(_dfr_hold, unique) = _dfr_holding_##kind(&(lock), _DFR_LOCK_SITE(kind, lock)); \
+    defer(_dfr_release_node_##kind, _CAT(_dfr_hold, unique))
+#endif
+
+#else // !DEFER_LOCK_PROFILE
+
+// Per lock kind: the lock call, and the unlock, directly for the cleanup
+// attribute or as a node
+#define _DFR_LOCK_KIND(kind, type, lock_fn, trylock_fn, unlock_fn) \
+    typedef type _dfr_lock_type_##kind; \
+    static inline void _dfr_lock_##kind(type* lock) { lock_fn(lock); } \
+    static inline void _dfr_unlock_ref_##kind(type* const* lock) { unlock_fn(*lock); } \
+    static inline void _dfr_unlock_node_##kind(void* lock) { unlock_fn(*(type**)lock); } \
+    struct _dfr_lock_##kind##_declared
+
+#if USING_GNUC_DEFER && !defined(DEFER_LONGJMP)
+#define _dfr_unlock_impl(kind, lock, unique) \
+    __typeof__(&(lock)) const _CAT(_dfr_lock, unique) __attribute__((cleanup(_dfr_unlock_ref_##kind))) = &(lock)
+#else
+// The node holds a pointer to the lock rather than the lock's address, which
+// would lose the volatile of glibc's pthread_spinlock_t on the way to void*
+#define _dfr_unlock_impl(kind, lock, unique) \
+    _dfr_lock_type_##kind* _CAT(_dfr_lock, unique) = &(lock); \
+    defer(_dfr_unlock_node_##kind, _CAT(_dfr_lock, unique))
+#endif
+#define _dfr_lock_impl(kind, lock, unique) \
+    _dfr_lock_##kind(&(lock)); _dfr_unlock_impl(kind, lock, unique)
+
+#endif // DEFER_LOCK_PROFILE
+
+_DFR_LOCK_KIND(mutex, pthread_mutex_t, pthread_mutex_lock, pthread_mutex_trylock, pthread_mutex_unlock);
+#define defer_lock(lock) _dfr_lock_impl(mutex, lock, _UNIQUER)
+#define defer_unlock(lock) _dfr_unlock_impl(mutex, lock, _UNIQUER)
+
+#if DEFER_RWLOCKS_AVAILABLE
+_DFR_LOCK_KIND(rdlock, pthread_rwlock_t, pthread_rwlock_rdlock, pthread_rwlock_tryrdlock, pthread_rwlock_unlock);
+_DFR_LOCK_KIND(wrlock, pthread_rwlock_t, pthread_rwlock_wrlock, pthread_rwlock_trywrlock, pthread_rwlock_unlock);
+#define defer_rdlock(lock) _dfr_lock_impl(rdlock, lock, _UNIQUER)
+#define defer_wrlock(lock) _dfr_lock_impl(wrlock, lock, _UNIQUER)
+// Either kind of hold, unlocking is the same. Which one it was is up to the
+// caller's lock call, so profiled holds count as rwlock, not rdlock or wrlock;
+// this kind's acquire is never used.
+_DFR_LOCK_KIND(rwlock, pthread_rwlock_t, pthread_rwlock_wrlock, pthread_rwlock_trywrlock, pthread_rwlock_unlock);
+#define defer_rwunlock(lock) _dfr_unlock_impl(rwlock, lock, _UNIQUER)
+#endif
+
+#if DEFER_SPINLOCKS_AVAILABLE
+_DFR_LOCK_KIND(spin, pthread_spinlock_t, pthread_spin_lock, pthread_spin_trylock, pthread_spin_unlock);
+#define defer_spin_lock(lock) _dfr_lock_impl(spin, lock, _UNIQUER)
+#define defer_spin_unlock(lock) _dfr_unlock_impl(spin, lock, _UNIQUER)
+#endif
+
+#endif // DEFER_LOCK_H
@@ -0,0 +1,668 @@
+#!/usr/bin/env python3
+"""Lower S_ _S defer code into plain goto-cleanup C.
+
+Rewrites every function of a C file that uses defer.h scopes so that each
+exit calls its cleanups directly, the way you'd write it by hand:
+
+    int load(const char* path) S_          int load(const char* path) {
+        FILE* f = open_file(path);             FILE* f = open_file(path);
+        defer(close_file, f);                  void* const _dfr_arg0 = &(f);
+        if (!ok(f)) {                          if (!ok(f)) {
+            returnerr -1;           ->             { close_file(_dfr_arg0); return -1; }
+        }                                      }
+        return 0;                              { close_file(_dfr_arg0); return 0; }
+    _S                                     }
+
+There are no nodes, contexts or stacks left, only calls, so at -O1 and up
+the lowered function compiles to what the hand-written goto version does.
+Every line stays on its own line and a #line directive points back at the
+source, so compiler errors, __LINE__ and assert messages name the original.
+
+Lowered: S_ _S, S_LABEL/_S_LABEL/break_to, defer, errdefer, cleanupdecl,
+tdefer, terrdefer, deferblock, errdeferblock, defer_each, errdefer_each,
+defer_mem, errdefer_mem, returnerr, and return, break and continue in their
+lowercase and DONT_REDEFINE_KEYWORDS spellings. Exits behave like the C99
+versions: a return expression is evaluated after the cleanups, and
+returnerr runs the errdefers of every enclosing scope, not just the
+innermost one.
+
+Functions that use something else that needs a runtime scope (S_ARENA,
+scratchdecl, coroutines, defer_longjmp...), or that jump into a scope past
+one of its defers (case or goto labels after a defer), are left as they are
+with a note on stderr, and keep working through defer.h. --strict makes that
+an error instead. The output still includes defer.h for them and for
+DEFER_TYPED; lowered functions don't depend on which backend it picks.
+
+tdefer and the inline blocks name their variables at each exit, so those
+variables must not be shadowed between the defer and an exit. Every other
+cleanup takes the variable's address at the defer, as defer.h does.
+
+Usage:
+    defer_lower.py [--strict] [-o OUTPUT] FILE
+
+"""
+
+import re
+import sys
+from typing import Dict, List, NamedTuple, Optional, TextIO, Tuple
+
+
+class Token(NamedTuple):
+    kind: str   # id, num, str, punct, pp
+    text: str
+    start: int
+    end: int
+    line: int
+
+
+class LowerError(Exception):
+    def __init__(self, token: Token, message: str) -> None:
+        super().__init__(message)
+        self.token = token
+        self.message = message
+
+
+_TOKEN_RE = re.compile(r"""
+    (?P<ws>[ \t\r\f\v]+|\\\n)
+  | (?P<nl>\n)
+  | (?P<comment>//[^\n]*|/\*.*?\*/)
+  | (?P<id>[A-Za-z_]\w*)
+  | (?P<num>\.?\d(?:[eEpP][+-]|[\w.])*)
+  | (?P<str>(?:L|u8|u|U)?"(?:\\.|[^"\\\n])*"|(?:L|u|U)?'(?:\\.|[^'\\\n])*')
+  | (?P<punct>\.\.\.|<<=|>>=|->|\+\+|--|<<|>>|<=|>=|==|!=|&&|\|\||[-+*/%&|^!=<>]=|\#\#|[^\s])
+""", re.VERBOSE | re.DOTALL)
+
+
+def tokenize(src: str) -> List[Token]:
+    """Significant tokens; each preprocessor directive is a single pp token."""
+    tokens: List[Token] = []
+    pos = 0
+    line = 1
+    line_start = True
+    while pos < len(src):
+        if line_start and src[pos] == "#":
+            end = pos
+            while True:
+                nl = src.find("\n", end)
+                if nl < 0:
+                    end = len(src)
+                    break
+                if src[nl - 1] == "\\" or _open_comment(src, pos, nl):
+                    end = nl + 1
+                    continue
+                end = nl
+                break
+            tokens.append(Token("pp", src[pos:end], pos, end, line))
+            line += src.count("\n", pos, end)
+            pos = end
+            continue
+        m = _TOKEN_RE.match(src, pos)
+        if not m:
+            raise SyntaxError(f"line {line}: can't tokenize {src[pos:pos + 20]!r}")
+        kind = m.lastgroup
+        text = m.group()
+        if kind == "nl":
+            line_start = True
+        elif kind == "ws" or kind == "comment":
+            pass
+        else:
+            line_start = False
+            tokens.append(Token(kind, text, pos, m.end(), line))
+        line += text.count("\n")
+        pos = m.end()
+    return tokens
+
+
+def _open_comment(src: str, start: int, nl: int) -> bool:
+    """Whether a /* comment is still open at nl, on a directive from start."""
+    text = re.sub(r"\"(?:\\.|[^\"\\])*\"", "", src[start:nl])
+    return text.rfind("/*") > text.rfind("*/")
+
+
+# Keyword spellings, DONT_REDEFINE_KEYWORDS ones included
+RETURNS = {"return": False, "RETURN": False, "returnerr": True, "RETURNERR": True}
+BREAKS = {"break", "BREAK"}
+CONTINUES = {"continue", "CONTINUE"}
+LOWERCASE = {"RETURN": "return", "RETURNERR": "return", "returnerr": "return",
+             "BREAK": "break", "CONTINUE": "continue", "FOR": "for", "DO": "do",
+             "WHILE": "while", "SWITCH": "switch"}
+
+# Statements that never fall through to the next one
+TERMINAL = set(RETURNS) | BREAKS | CONTINUES | {"break_to", "goto"}
+
+# Cleanup registrations: name -> (kind, runs only on error)
+REGISTRATIONS = {
+    "defer": ("call", False), "errdefer": ("call", True),
+    "defer_mem": ("mem", False), "errdefer_mem": ("mem", True),
+    "tdefer": ("typed", False), "terrdefer": ("typed", True),
+    "deferblock": ("block", False), "errdeferblock": ("block", True),
+    "defer_each": ("each", False), "errdefer_each": ("each", True),
+    "cleanupdecl": ("decl", False),
+}
+
+# Things that need a runtime S_ _S scope (or reach into one) and can't be lowered
+UNSUPPORTED = {
+    "S_ARENA", "S_ERRARENA", "arena_alloc", "scratchdecl", "scratch_alloc",
+    "defer_free_each", "errdefer_free_each", "defer_free_each_sized",
+    "S_CORO", "_S_CORO", "coro_defer", "coro_errdefer", "CORO_BEGIN",
+    "defer_setjmp", "defer_longjmp",
+    "defer_lock", "defer_unlock", "defer_rdlock", "defer_wrlock", "defer_rwunlock",
+    "defer_spin_lock", "defer_spin_unlock",
+    "iobatchdecl", "defer_close", "defer_unlink", "defer_munmap",
+    "defer_pool_release", "errdefer_pool_release",
+    "refbatchdecl", "defer_unref", "defer_count",
+    "_dfr_ctx", "_dfr_ctx_", "_dfr_err", "_dfr_break_ctx", "_dfr_continue_ctx",
+}
+
+_OPENERS = {"(": ")", "[": "]", "{": "}"}
+
+
+def _is_scope_open(tok: Token) -> bool:
+    return tok.kind == "id" and re.fullmatch(r"S_[A-Z]*", tok.text) is not None
+
+
+def _is_scope_close(tok: Token) -> bool:
+    return tok.kind == "id" and re.fullmatch(r"_S(?:_[A-Z]+)?", tok.text) is not None
+
+
+class Entry:
+    """A registered cleanup. Its setup (taking the variable's address, say) is
+    only written out if some exit ends up calling it."""
+
+    def __init__(self, err: bool, code: str, keep: str = "") -> None:
+        self.err = err
+        self.code = code    # the cleanup statement, run at every exit
+        self.keep = keep    # what's left of the registration when nothing does
+        self.used = False
+
+
+class Frame:
+    """A block on the way from a function's body to the current statement."""
+
+    def __init__(self, kind: str, label: Optional[str] = None) -> None:
+        self.kind = kind        # scope, brace, loop, switch
+        self.label = label
+        self.entries: List[Entry] = []
+        self.label_used = False
+
+
+class FunctionLowerer:
+    def __init__(self, lowerer: "Lowerer", tokens: List[Token]) -> None:
+        self.lowerer = lowerer
+        self.tokens = tokens
+        self.frames: List[Frame] = []
+        self.edits: List[Tuple[int, int, str]] = []
+        self.setups: List[Tuple[int, int, str, Entry]] = []
+
+    # -- token helpers ------------------------------------------------------
+
+    def tok(self, i: int) -> Token:
+        if i >= len(self.tokens):
+            raise LowerError(self.tokens[-1], "unexpected end of file")
+        return self.tokens[i]
+
+    def expect(self, i: int, text: str) -> int:
+        if self.tok(i).text != text:
+            raise LowerError(self.tok(i), f"expected '{text}'")
+        return i + 1
+
+    def skip_group(self, i: int) -> int:
+        """i is at an opening bracket; returns the index past its match."""
+        depth = 0
+        while True:
+            text = self.tok(i).text if self.tok(i).kind == "punct" else None
+            if text in _OPENERS:
+                depth += 1
+            elif text in (")", "]", "}"):
+                depth -= 1
+                if depth == 0:
+                    return i + 1
+            i += 1
+
+    def args(self, i: int) -> Tuple[List[str], int]:
+        """Splits the macro arguments at i (an opening paren) at top level commas."""
+        end = self.skip_group(i)
+        src = self.lowerer.src
+        out: List[str] = []
+        start = self.tok(i).end
+        depth = 0
+        for j in range(i + 1, end - 1):
+            t = self.tokens[j]
+            if t.kind == "punct" and t.text in _OPENERS:
+                depth += 1
+            elif t.kind == "punct" and t.text in (")", "]", "}"):
+                depth -= 1
+            elif t.kind == "punct" and t.text == "," and depth == 0:
+                out.append(src[start:t.start].strip())
+                start = t.end
+        out.append(src[start:self.tokens[end - 1].start].strip())
+        return out, end
+
+    def replace(self, tok: Token, text: str) -> None:
+        self.edits.append((tok.start, tok.end, text))
+
+    def replace_span(self, first: Token, last: Token, text: str) -> None:
+        self.edits.append((first.start, last.end, text))
+
+    def insert_after(self, tok: Token, text: str) -> None:
+        self.edits.append((tok.end, tok.end, text))
+
+    # -- cleanups -----------------------------------------------------------
+
+    def cleanups(self, frames: List[Frame], err: bool) -> str:
+        code = []
+        for frame in reversed(frames):
+            for entry in reversed(frame.entries):
+                if err or not entry.err:
+                    entry.used = True
+                    code.append(entry.code)
+        return " ".join(code)
+
+    def scopes_since(self, kinds: Tuple[str, ...]) -> Optional[List[Frame]]:
+        """Scope frames inside the innermost frame of one of kinds, None without one."""
+        for n in range(len(self.frames) - 1, -1, -1):
+            if self.frames[n].kind in kinds:
+                return [f for f in self.frames[n + 1:] if f.kind == "scope"]
+        return None
+
+    def scope(self, tok: Token) -> Frame:
+        """The S_ _S scope a registration at tok attaches to."""
+        if not self.frames or self.frames[-1].kind != "scope":
+            raise LowerError(tok, f"{tok.text} must be a statement of a S_ _S scope")
+        return self.frames[-1]
+
+    def check_label(self, tok: Token) -> None:
+        for frame in reversed(self.frames):
+            if frame.kind == "scope" and frame.entries:
+                raise LowerError(tok, "label after a defer in the same scope")
+            if frame.kind in ("scope", "switch", "loop"):
+                return
+
+    # -- statements ---------------------------------------------------------
+
+    def body(self, i: int) -> int:
+        """Lowers the function body starting at i, returns the index past it."""
+        end = self.statement(i)
+        for start, stop, setup, entry in self.setups:
+            self.edits.append((start, stop, setup if entry.used else entry.keep))
+        return end
+
+    def block(self, i: int, frame: Frame, close: str) -> int:
+        self.frames.append(frame)
+        self.falls_off = True
+        while not (self.tok(i).text == close and self.tok(i).kind in ("punct", "id")):
+            if close != "}" and self.tok(i).text == "}":
+                raise LowerError(self.tok(i), f"unbalanced '}}' before {close}")
+            first = self.tok(i).text
+            i = self.statement(i)
+            # Nothing after an unconditional jump reaches the end of the block
+            self.falls_off = first not in TERMINAL
+        self.frames.pop()
+        return i
+
+    def statement(self, i: int) -> int:
+        t = self.tok(i)
+        text = t.text
+        if t.kind == "pp":
+            return i + 1
+        if t.kind == "punct":
+            if text == "{":
+                i = self.block(i + 1, Frame("brace"), "}")
+                return i + 1
+            if text == ";":
+                return i + 1
+            return self.simple(i)
+        if t.kind != "id":
+            return self.simple(i)
+        if text in UNSUPPORTED:
+            raise LowerError(t, f"{text} isn't supported")
+        if text == "S_":
+            return self.lower_scope(i, i + 1, None)
+        if text == "S_LABEL":
+            (name,), end = self.args(i + 1)
+            return self.lower_scope(i, end, name)
+        if _is_scope_open(t) or _is_scope_close(t):
+            raise LowerError(t, f"{text} isn't supported here")
+        if text in RETURNS:
+            return self.lower_return(i, RETURNS[text])
+        if text in BREAKS or text in CONTINUES:
+            return self.lower_jump(i, text in BREAKS)
+        if text == "break_to":
+            return self.lower_break_to(i)
+        if text in REGISTRATIONS:
+            return self.lower_registration(i)
+        if text == "if":
+            i = self.skip_group(self.expect(i + 1, "(") - 1)
+            i = self.statement(i)
+            if self.tok(i).text == "else":
+                i = self.statement(i + 1)
+            return i
+        if text in ("for", "FOR", "while", "WHILE", "switch", "SWITCH"):
+            if text in LOWERCASE:
+                self.replace(t, LOWERCASE[text])
+            i = self.skip_group(self.expect(i + 1, "(") - 1)
+            is_switch = text.lower() == "switch"
+            self.frames.append(Frame("switch" if is_switch else "loop"))
+            i = self.statement(i)
+            self.frames.pop()
+            return i
+        if text in ("do", "DO"):
+            if text in LOWERCASE:
+                self.replace(t, LOWERCASE[text])
+            self.frames.append(Frame("loop"))
+            i = self.statement(i + 1)
+            self.frames.pop()
+            w = self.tok(i)
+            if w.text not in ("while", "WHILE"):
+                raise LowerError(w, "expected 'while' after do")
+            if w.text in LOWERCASE:
+                self.replace(w, LOWERCASE[w.text])
+            i = self.skip_group(self.expect(i + 1, "(") - 1)
+            return self.expect(i, ";")
+        if text in ("case", "default"):
+            self.check_label(t)
+            while self.tok(i).text != ":":
+                i += 1
+            return i + 1
+        if self.tok(i + 1).text == ":" and text not in ("else",):
+            self.check_label(t)
+            return i + 2
+        return self.simple(i)
+
+    def simple(self, i: int) -> int:
+        """An expression statement or declaration, up to its semicolon."""
+        while True:
+            t = self.tok(i)
+            if t.kind == "punct" and t.text in _OPENERS:
+                i = self.skip_group(i)
+                continue
+            if t.kind == "punct" and t.text == ";":
+                return i + 1
+            if t.kind == "punct" and t.text == "}":
+                raise LowerError(t, "missing ';'")
+            if t.kind == "id":
+                if t.text == "cleanupdecl":
+                    # The declaration's type comes first: int* cleanupdecl(p, ...)
+                    return self.lower_registration(i)
+                if t.text in UNSUPPORTED:
+                    raise LowerError(t, f"{t.text} isn't supported")
+                if t.text in RETURNS or t.text in REGISTRATIONS or _is_scope_open(t) or _is_scope_close(t):
+                    raise LowerError(t, f"{t.text} in the middle of a statement")
+                if t.text in LOWERCASE:
+                    self.replace(t, LOWERCASE[t.text])
+            i += 1
+
+    def lower_scope(self, i: int, body: int, label: Optional[str]) -> int:
+        frame = Frame("scope", label)
+        self.replace_span(self.tok(i), self.tok(body - 1), "{")
+        close_text = "_S_LABEL" if label else "_S"
+        j = self.block(body, frame, close_text)
+        falls_off = self.falls_off
+        close = self.tok(j)
+        end = j + 1
+        last = close
+        if label:
+            (name,), end = self.args(j + 1)
+            if name != label:
+                raise LowerError(close, f"_S_LABEL({name}) closes S_LABEL({label})")
+            last = self.tok(end - 1)
+        code = self.cleanups([frame], False) if falls_off else ""
+        if self.tok(j - 1).text == ":":
+            code = "; " + code
+        text = (code + " }").lstrip()
+        if label and frame.label_used:
+            text += f" _dfr_end_{label}: ;"
+        self.replace_span(close, last, text)
+        return end
+
+    def statement_end(self, i: int) -> int:
+        """Index of the ';' ending the statement that i is in."""
+        while self.tok(i).text != ";":
+            if self.tok(i).kind == "punct" and self.tok(i).text in _OPENERS:
+                i = self.skip_group(i)
+            else:
+                i += 1
+        return i
+
+    def lower_return(self, i: int, err: bool) -> int:
+        t = self.tok(i)
+        end = self.statement_end(i + 1)
+        for j in range(i + 1, end):
+            tj = self.tokens[j]
+            if tj.kind == "id" and tj.text in LOWERCASE:
+                self.replace(tj, LOWERCASE[tj.text])
+        code = self.cleanups([f for f in self.frames if f.kind == "scope"], err)
+        if code:
+            self.replace(t, "{ " + code + " return")
+            self.insert_after(self.tok(end), " }")
+        elif t.text != "return":
+            self.replace(t, "return")
+        return end + 1
+
+    def lower_jump(self, i: int, is_break: bool) -> int:
+        t = self.tok(i)
+        keyword = "break" if is_break else "continue"
+        frames = self.scopes_since(("loop", "switch") if is_break else ("loop",))
+        if frames is None:
+            raise LowerError(t, f"{keyword} outside of a loop{' or switch' if is_break else ''}")
+        end = self.expect(i + 1, ";") - 1
+        code = self.cleanups(frames, False)
+        if code:
+            self.replace(t, "{ " + code + " " + keyword)
+            self.insert_after(self.tok(end), " }")
+        elif t.text != keyword:
+            self.replace(t, keyword)
+        return end + 1
+
+    def lower_break_to(self, i: int) -> int:
+        t = self.tok(i)
+        (name,), end = self.args(i + 1)
+        for n in range(len(self.frames) - 1, -1, -1):
+            if self.frames[n].label == name:
+                break
+        else:
+            raise LowerError(t, f"break_to({name}) outside of S_LABEL({name})")
+        self.frames[n].label_used = True
+        code = self.cleanups([f for f in self.frames[n:] if f.kind == "scope"], False)
+        text = "{ " + (code + " " if code else "") + f"goto _dfr_end_{name}; }}"
+        if self.tok(end).text == ";":
+            end += 1
+        self.replace_span(t, self.tok(end - 1), text)
+        return end
+
+    def lower_registration(self, i: int) -> int:
+        t = self.tok(i)
+        scope = self.scope(t)
+        kind, err = REGISTRATIONS[t.text]
+        args, end = self.args(i + 1)
+        arg = f"_dfr_arg{self.lowerer.next_temp()}"
+        setup = f"void* const {arg} = &({args[-1]})"
+        keep = ""
+        if kind == "block":
+            setup = ""
+            code = "{ " + ", ".join(args) + " }"
+        elif kind == "typed":
+            fn, var = args
+            type_ = self.lowerer.typed.get(fn)
+            keep = f"(void)({var})"
+            if type_ is None:
+                setup = ""
+                code = f"{fn}({var});"
+            else:
+                code = f"{fn}(*({type_}*){arg});"
+        elif kind == "each":
+            fn, array, count = args
+            setup = f"size_t const {arg} = (size_t)({count})"
+            code = (f"for (size_t _dfr_i = {arg}; _dfr_i > 0; _dfr_i--) "
+                    f"{fn}(&({array})[_dfr_i - 1]);")
+        elif kind == "decl":
+            lvalue, rvalue, fn = args
+            names = re.findall(r"[A-Za-z_]\w*", lvalue)
+            if not names:
+                raise LowerError(t, "cleanupdecl without a variable name")
+            keep = f"{lvalue} = {rvalue}"
+            setup = f"{keep}; void* const {arg} = &({names[-1]})"
+            code = f"{fn}({arg});"
+        else:
+            fn, var = args
+            keep = f"(void)({var})"
+            code = f"{fn}({arg});"
+            if kind == "mem":
+                code = f"if (!defer_fast_exiting()) {code}"
+        entry = Entry(err, code, keep)
+        scope.entries.append(entry)
+        last = self.tok(end - 1)
+        if self.tok(end).text == ";":
+            self.setups.append((t.start, last.end, setup, entry))
+            return end + 1
+        # No semicolon of its own (GNU C defer doesn't need one)
+        self.setups.append((t.start, last.end, setup + ";" if setup else "", entry))
+        entry.keep += ";" if keep else ""
+        return end
+
+
+class Lowerer:
+    def __init__(self, src: str, path: str, strict: bool = False, log: TextIO = sys.stderr) -> None:
+        self.src = src
+        self.path = path
+        self.strict = strict
+        self.log = log
+        self.tokens = tokenize(src)
+        self.typed: Dict[str, str] = {}
+        self.temps = 0
+        self.lowered = 0
+        self.kept = 0
+
+    def next_temp(self) -> int:
+        self.temps += 1
+        return self.temps - 1
+
+    def function_name(self, i: int) -> str:
+        """Name of the function whose body starts at token i."""
+        j = i - 1
+        while j >= 0 and self.tokens[j].text != ")":
+            j -= 1
+        depth = 0
+        while j >= 0:
+            text = self.tokens[j].text
+            if text == ")":
+                depth += 1
+            elif text == "(":
+                depth -= 1
+                if depth == 0:
+                    break
+            j -= 1
+        return self.tokens[j - 1].text if j > 0 else "?"
+
+    def function_end(self, i: int) -> int:
+        depth = 0
+        while i < len(self.tokens):
+            t = self.tokens[i]
+            if (t.kind == "punct" and t.text == "{") or _is_scope_open(t):
+                depth += 1
+            elif (t.kind == "punct" and t.text == "}") or _is_scope_close(t):
+                depth -= 1
+                if depth == 0:
+                    return i + 1
+            i += 1
+        return i
+
+    def run(self) -> str:
+        edits: List[Tuple[int, int, str]] = []
+        tokens = self.tokens
+        i = 0
+        depth = 0
+        while i < len(tokens):
+            t = tokens[i]
+            prev = tokens[i - 1].text if i > 0 else ""
+            if depth == 0 and t.text == "DEFER_TYPED" and i + 1 < len(tokens) and tokens[i + 1].text == "(":
+                fl = FunctionLowerer(self, tokens)
+                (fn, type_), i = fl.args(i + 1)
+                self.typed[fn] = type_
+                continue
+            is_body = depth == 0 and ((t.text == "{" and t.kind == "punct" and prev == ")")
+                                      or _is_scope_open(t))
+            if is_body:
+                end = self.function_end(i)
+                fl = FunctionLowerer(self, tokens)
+                try:
+                    if fl.body(i) != end:
+                        raise LowerError(tokens[end - 1], "couldn't find the end of the function")
+                except LowerError as e:
+                    where = f"{self.path}:{e.token.line}"
+                    name = self.function_name(i)
+                    if self.strict:
+                        raise SystemExit(f"{where}: error: can't lower {name}(): {e.message}")
+                    uses_defer = any(_is_scope_open(tok) for tok in tokens[i:end])
+                    if uses_defer:
+                        self.log.write(f"{where}: note: kept {name}() as is: {e.message}\n")
+                        self.kept += 1
+                else:
+                    if fl.edits:
+                        self.lowered += 1
+                    edits.extend(fl.edits)
+                i = end
+                continue
+            if t.kind == "punct" and t.text in "([{":
+                depth += 1
+            elif t.kind == "punct" and t.text in ")]}":
+                depth -= 1
+            i += 1
+
+        out = self.src
+        for start, end, text in sorted(edits, reverse=True):
+            out = out[:start] + text + out[end:]
+        return out
+
+
+def lower(src: str, path: str, strict: bool = False, log: TextIO = sys.stderr) -> str:
+    lowerer = Lowerer(src, path, strict, log)
+    body = lowerer.run()
+    log.write(f"{path}: lowered {lowerer.lowered} functions, kept {lowerer.kept}\n")
+    header = f"// Generated by defer_lower.py from {path}, don't edit.\n#line 1 \"{path}\"\n"
+    return header + body
+
+
+def print_usage(stream: TextIO = sys.stderr) -> None:
+    stream.write("Usage: {} [--strict] [-o OUTPUT] FILE\n".format(sys.argv[0]))
+    stream.write("\n")
+    stream.write("  --strict   Fail instead of keeping functions that can't be lowered\n")
+    stream.write("  -o OUTPUT  Write the lowered C there instead of to stdout\n")
+
+
+def main(argv: List[str]) -> int:
+    strict = False
+    output: Optional[str] = None
+    path: Optional[str] = None
+    args = argv[1:]
+    while args:
+        arg = args.pop(0)
+        if arg == "--strict":
+            strict = True
+        elif arg == "-o" and args:
+            output = args.pop(0)
+        elif arg in ("-h", "--help"):
+            print_usage(sys.stdout)
+            return 0
+        elif path is None and not arg.startswith("-"):
+            path = arg
+        else:
+            print_usage()
+            return 1
+    if path is None:
+        print_usage()
+        return 1
+
+    with open(path) as f:
+        src = f.read()
+    result = lower(src, path, strict)
+    if output:
+        with open(output, "w") as f:
+            f.write(result)
+    else:
+        sys.stdout.write(result)
+    return 0
+
+
+if __name__ == "__main__":  # pragma: no cover - CLI entry point
+    raise SystemExit(main(sys.argv))
@@ -0,0 +1,238 @@
+#ifndef DEFER_POOL_H
+#define DEFER_POOL_H
+
+// Fixed-size object pools for defer.h. pooldef(name, type) at file scope
+// defines a pool of objects the size of type. pool_acquire(name) takes one
+// from the calling thread's free list, and defer_pool_release(var) puts it
+// back on every way out of the scope:
+//
+//     pooldef(request_pool, request);
+//
+//     int handle(conn* c) S_
+//         request* req = pool_acquire(request_pool);
+//         if (!req) {
+//             returnerr -1;
+//         }
+//         defer_pool_release(req);
+//         if (parse(c, req) < 0) {
+//             returnerr -1;              // back in the pool here
+//         }
+//         return respond(c, req);        // or here
+//     _S
+//
+// Each thread has a free list per pool. Acquiring pops it and releasing on the
+// same thread pushes it, no atomics or locks. Objects are malloc'd one at a
+// time when the free list is empty, and cached from then on.
+//
+// Every object remembers the thread it was first acquired on, and goes back
+// to that thread's free list wherever it's released. A release on another
+// thread pushes the object onto the owner's return queue, a lock-free stack.
+// The owner takes the whole queue back in one exchange when its free list
+// runs dry. When the owner exits, its free list and queue are freed. Objects
+// still out on other threads are freed by whichever release comes last.
+//
+// defer_pool_release takes the variable by reference like defer. It's
+// memory-only, like defer_mem, so it does nothing after defer_fast_exit().
+// errdefer_pool_release is the errdefer flavour, for handing the object to
+// the caller on success. pool_release(ptr) releases right away. None of the
+// releases need the pool, so objects can cross files as well as threads. NULL
+// is ignored. pool_trim(name) frees the calling thread's cached objects.
+//
+// Objects are aligned like malloc's. Their contents aren't cleared, a
+// recycled object holds whatever its last user left in it. The per-thread
+// state is static, so each file that pooldefs gets its own pool.
+
+#include <stddef.h>
+#include <stdlib.h>
+// Ahead of defer.h, so pthread.h comes before the keyword macros
+#include "defer_thread.h"
+#include "defer.h"
+
+#if !defined(__GNUC__)
+#error "defer_pool.h needs GCC or clang (__atomic builtins)"
+#endif
+
+// Where pool objects and per-thread pool state come from
+#ifndef DEFER_POOL_MALLOC
+#define DEFER_POOL_MALLOC malloc
+#endif
+#ifndef DEFER_POOL_FREE
+#define DEFER_POOL_FREE free
+#endif
+
+struct _dfr_PoolCache;
+
+// In front of every object. Aligned like malloc's result, so the object after
+// it is too.
+typedef union _dfr_PoolHeader {
+    struct {
+        union _dfr_PoolHeader* next;    // free list or return queue
+        struct _dfr_PoolCache* owner;   // set once, at malloc
+    } h;
+    long double ld;
+    long long ll;
+    void* ptr;
+} _dfr_PoolHeader;
+
+// One thread's state for one pool. Heap allocated, because objects out on
+// other threads keep pointing to it after the thread is gone.
+typedef struct _dfr_PoolCache {
+    _dfr_PoolHeader* cached;          // free list
+    _dfr_PoolHeader* remote;          // return queue, _DFR_POOL_ORPHANED once the owner is gone
+    const char* thread;               // &_dfr_pool_self of the owner, NULL once it's gone, atomic
+    struct _dfr_PoolCache** slot;     // the pool's thread-local pointer to this
+    long allocated;                   // objects malloc'd, only touched by the owner
+    long orphans;                     // objects still out after the owner exited
+    _dfr_ThreadNode exit;
+} _dfr_PoolCache;
+
+#define _DFR_POOL_ORPHANED ((_dfr_PoolHeader*)1)
+
+// Only its address is used, it tells threads apart
+_dfr_shared _dfr_thread_local char _dfr_pool_self;
+
+static inline void* _dfr_pool_object(_dfr_PoolHeader* header) {
+    return header + 1;
+}
+
+static inline _dfr_PoolHeader* _dfr_pool_header(void* ptr) {
+    return (_dfr_PoolHeader*)ptr - 1;
+}
+
+static void _dfr_pool_free_list(_dfr_PoolHeader* list, long* freed) {
+    for (_dfr_PoolHeader* next; list; list = next) {
+        next = list->h.next;
+        DEFER_POOL_FREE(list);
+        ++*freed;
+    }
+}
+
+// Thread exit: free what the thread has, leave the rest to the last release
+static void _dfr_pool_orphan(void* arg) {
+    _dfr_PoolCache* cache = (_dfr_PoolCache*)arg;
+    long freed = 0;
+    *cache->slot = NULL;
+    __atomic_store_n(&cache->thread, NULL, __ATOMIC_RELAXED);
+    _dfr_pool_free_list(cache->cached, &freed);
+    cache->cached = NULL;
+    _dfr_pool_free_list(__atomic_exchange_n(&cache->remote, _DFR_POOL_ORPHANED, __ATOMIC_ACQUIRE), &freed);
+    // Releases that found the cache orphaned have already counted themselves
+    // down, so this only reaches 0 once every object is back
+    if (__atomic_add_fetch(&cache->orphans, cache->allocated - freed, __ATOMIC_ACQ_REL) == 0) {
+        DEFER_POOL_FREE(cache);
+    }
+}
+
+// Release on a thread that doesn't own the object
+__attribute__((noinline))
+static void _dfr_pool_release_remote(_dfr_PoolCache* cache, _dfr_PoolHeader* header) {
+    _dfr_PoolHeader* head = __atomic_load_n(&cache->remote, __ATOMIC_RELAXED);
+    for (;;) {
+        if (head == _DFR_POOL_ORPHANED) {
+            DEFER_POOL_FREE(header);
+            if (__atomic_sub_fetch(&cache->orphans, 1, __ATOMIC_ACQ_REL) == 0) {
+                DEFER_POOL_FREE(cache);
+            }
+            return;
+        }
+        header->h.next = head;
+        if (__atomic_compare_exchange_n(&cache->remote, &head, header, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+}
+
+static inline void pool_release(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    _dfr_PoolHeader* header = _dfr_pool_header(ptr);
+    _dfr_PoolCache* cache = header->h.owner;
+    // Relaxed is enough: only the owner ever sees its own address here, and
+    // it wrote it. Other threads only need to see something else.
+    if (__atomic_load_n(&cache->thread, __ATOMIC_RELAXED) == &_dfr_pool_self) {
+        header->h.next = cache->cached;
+        cache->cached = header;
+        return;
+    }
+    _dfr_pool_release_remote(cache, header);
+}
+
+// Slow path of pool_acquire: set up the thread's cache, take back what other
+// threads released, or malloc a new object
+__attribute__((noinline, cold))
+static void* _dfr_pool_refill(_dfr_PoolCache** slot, size_t size) {
+    _dfr_PoolCache* cache = *slot;
+    if (!cache) {
+        cache = (_dfr_PoolCache*)DEFER_POOL_MALLOC(sizeof(_dfr_PoolCache));
+        if (!cache) {
+            return NULL;
+        }
+        cache->cached = NULL;
+        cache->remote = NULL;
+        __atomic_store_n(&cache->thread, &_dfr_pool_self, __ATOMIC_RELAXED);
+        cache->slot = slot;
+        cache->allocated = 0;
+        cache->orphans = 0;
+        cache->exit.linked = false;
+        _dfr_thread_link(&cache->exit, _dfr_pool_orphan, cache);
+        *slot = cache;
+    }
+    _dfr_PoolHeader* header = __atomic_exchange_n(&cache->remote, NULL, __ATOMIC_ACQUIRE);
+    if (header) {
+        cache->cached = header->h.next;
+        return _dfr_pool_object(header);
+    }
+    if (size > (size_t)-1 - sizeof(_dfr_PoolHeader)) {
+        return NULL;
+    }
+    header = (_dfr_PoolHeader*)DEFER_POOL_MALLOC(sizeof(_dfr_PoolHeader) + size);
+    if (!header) {
+        return NULL;
+    }
+    header->h.owner = cache;
+    cache->allocated++;
+    return _dfr_pool_object(header);
+}
+
+static inline void* _dfr_pool_acquire(_dfr_PoolCache** slot, size_t size) {
+    _dfr_PoolCache* cache = *slot;
+    if (cache && cache->cached) {
+        _dfr_PoolHeader* header = cache->cached;
+        cache->cached = header->h.next;
+        return _dfr_pool_object(header);
+    }
+    return _dfr_pool_refill(slot, size);
+}
+
+static inline void _dfr_pool_trim(_dfr_PoolCache* cache) {
+    if (!cache) {
+        return;
+    }
+    long freed = 0;
+    _dfr_pool_free_list(cache->cached, &freed);
+    cache->cached = NULL;
+    cache->allocated -= freed;
+}
+
+// Cleanup function registered by defer_pool_release / errdefer_pool_release
+static inline void _dfr_pool_release_ref(void* arg) {
+    pool_release(*(void**)arg);
+}
+
+#define pooldef(name, type) \
+    static _dfr_thread_local _dfr_PoolCache* _dfr_pool_##name; \
+    typedef type _dfr_pool_type_##name
+
+// Returns an uninitialized object, or NULL if malloc failed
+#define pool_acquire(name) _dfr_pool_acquire(&_dfr_pool_##name, sizeof(_dfr_pool_type_##name))
+
+#define defer_pool_release(var) defer_mem(_dfr_pool_release_ref, var)
+#define errdefer_pool_release(var) errdefer_mem(_dfr_pool_release_ref, var)
+
+// Frees the objects cached on this thread for the pool. Objects in use, or
+// waiting in the return queue, are untouched.
+#define pool_trim(name) _dfr_pool_trim(_dfr_pool_##name)
+
+#endif // DEFER_POOL_H
@@ -0,0 +1,122 @@
+#ifndef DEFER_REF_H
+#define DEFER_REF_H
+
+// Batched atomic updates for defer.h. refbatchdecl(n) declares a batch in the
+// current scope. defer_unref(counter, destroy, obj) and defer_count(counter,
+// delta) add to it instead of registering a defer each, and the batch is
+// flushed by one defer on every way out of the scope:
+//
+//     int render(scene* s, int n, const int* ids) S_
+//         refbatchdecl(32);
+//         for (int i = 0; i < n; i++) {
+//             mesh* m = scene_borrow(s, ids[i]);     // takes a reference
+//             defer_unref(&m->refs, mesh_free, m);
+//             defer_count(&stats.meshes_drawn, 1);
+//             if (draw(m) < 0) {
+//                 returnerr -1;                       // flushed here
+//             }
+//         }
+//         return 0;                                   // or here
+//     _S
+//
+// Updates to the same counter are added up as they come in. The flush makes
+// one atomic add per distinct counter, so a scope that borrows the same
+// object 10 times, or bumps a shared statistic 10 times, touches its cache
+// line once instead of 10 times. When an unref brings a count to 0, destroy
+// runs right there with obj. Counter adds are relaxed. Unrefs are acq_rel,
+// so the destroying thread sees every other thread's writes to the object.
+//
+// Counters are plain or _Atomic integers of 4 or 8 bytes. The references stay
+// held until the flush, so every object unref'd in the scope stays alive until
+// the scope exits. The flush goes newest counter first. Coalescing only looks
+// back DEFER_REF_SCAN entries, so a batch with more distinct counters than
+// that may flush some of them twice. It's still correct, just less batched.
+//
+// One refbatchdecl per scope. A nested scope can declare its own, otherwise
+// defer_unref and defer_count add to the enclosing one. The first n distinct
+// counters are kept in the scope's frame, more go to the heap. Unlike
+// defer_mem these also run after defer_fast_exit(), a destructor may do more
+// than free memory.
+
+#include <stdint.h>
+#include "defer.h"
+
+#if !defined(__GNUC__)
+#error "defer_ref.h needs GCC or clang (__atomic builtins)"
+#endif
+
+// How far back defer_unref and defer_count look for the same counter
+#ifndef DEFER_REF_SCAN
+#define DEFER_REF_SCAN 16
+#endif
+
+typedef struct _dfr_RefOp {
+    void* counter;
+    void (*destroy)(void*);   // NULL for defer_count
+    void* obj;
+    int64_t delta;
+    unsigned width;           // sizeof the counter, 4 or 8
+} _dfr_RefOp;
+
+static inline void _dfr_ref_push(_dfr_Batch* batch, void* counter, unsigned width, int64_t delta,
+                                 void (*destroy)(void*), void* obj) {
+    _dfr_RefOp* ops = (_dfr_RefOp*)batch->ops;
+    unsigned stop = batch->len > DEFER_REF_SCAN ? batch->len - DEFER_REF_SCAN : 0;
+    for (unsigned i = batch->len; i > stop; i--) {
+        _dfr_RefOp* op = &ops[i - 1];
+        if (op->counter == counter) {
+            op->delta += delta;
+            if (destroy) {
+                op->destroy = destroy;
+                op->obj = obj;
+            }
+            return;
+        }
+    }
+    _dfr_RefOp* op = (_dfr_RefOp*)_dfr_batch_push(batch, sizeof(*op));
+    op->counter = counter;
+    op->destroy = destroy;
+    op->obj = obj;
+    op->delta = delta;
+    op->width = width;
+}
+
+static inline int64_t _dfr_ref_add(const _dfr_RefOp* op, int order) {
+    if (op->width == 4) {
+        return __atomic_add_fetch((int32_t*)op->counter, (int32_t)op->delta, order);
+    }
+    return __atomic_add_fetch((int64_t*)op->counter, op->delta, order);
+}
+
+// Cleanup function registered by refbatchdecl. A delta of 0 (everything taken
+// in the scope was given back) costs nothing.
+static void _dfr_ref_flush(void* arg) {
+    _dfr_Batch* batch = (_dfr_Batch*)arg;
+    const _dfr_RefOp* ops = (const _dfr_RefOp*)batch->ops;
+    for (unsigned i = batch->len; i > 0; i--) {
+        const _dfr_RefOp* op = &ops[i - 1];
+        if (op->delta && !op->destroy) {
+            _dfr_ref_add(op, __ATOMIC_RELAXED);
+        } else if (op->delta && _dfr_ref_add(op, __ATOMIC_ACQ_REL) == 0) {
+            op->destroy(op->obj);
+        }
+    }
+    _dfr_batch_free(batch);
+}
+
+#define refbatchdecl(n) \
+    _dfr_batch_decl(_dfr_refbatch, _dfr_RefOp, n); \
+    defer(_dfr_ref_flush, _dfr_refbatch)
+
+// Size of *counter, or a compile error if it isn't 4 or 8 bytes
+#define _dfr_ref_width(counter) \
+    ((unsigned)sizeof(char[sizeof(*(counter)) == 4 || sizeof(*(counter)) == 8 ? 1 : -1]) \
+        * (unsigned)sizeof(*(counter)))
+
+// Only usable in a scope with a refbatchdecl, or one nested in it
+#define defer_unref(counter, destroy, obj) \
+    _dfr_ref_push(&_dfr_refbatch, (void*)(counter), _dfr_ref_width(counter), -1, (destroy), (void*)(obj))
+#define defer_count(counter, delta) \
+    _dfr_ref_push(&_dfr_refbatch, (void*)(counter), _dfr_ref_width(counter), (int64_t)(delta), NULL, NULL)
+
+#endif // DEFER_REF_H
@@ -0,0 +1,158 @@
+#ifndef DEFER_THREAD_H
+#define DEFER_THREAD_H
+
+// Thread-exit defers: defer_thread(cleanup, var) runs cleanup(&var) when the
+// calling thread ends, newest registration first, like a defer whose scope is
+// the thread. The main thread (or whichever thread calls exit()) runs its
+// list from atexit.
+//
+//     static _Thread_local cache_t* cache;
+//     cache_t* get_cache(void) {
+//         if (!cache) {
+//             cache = cache_new();
+//             defer_thread(cache_free_ref, cache);
+//         }
+//         return cache;
+//     }
+//
+// Registration allocates nothing and takes no lock: every defer_thread call
+// site has a thread-local node, linked onto the thread's list. One process
+// wide pthread key (set once per thread) triggers the run at thread exit,
+// instead of a key and a destructor per cleanup, and the order is defined.
+//
+// As with defer, var is taken by reference, so it has to outlive the thread:
+// a thread-local, a static, or heap memory, not a local of the registering
+// function. Because the node belongs to the call site, calling defer_thread
+// again from the same site on the same thread only registers once, and doing
+// it with another function or variable before the first one ran aborts
+// instead of dropping it. To register per object, give each object a
+// defer_thread_node and use defer_thread_with, the same thing with the node
+// passed in; the node has to outlive the thread too:
+//
+//     typedef struct { defer_thread_node on_exit; char* buf; } scratch_t;
+//     defer_thread_with(&s->on_exit, scratch_free_ref, s->buf);
+//
+// Cleanups may register more thread defers, they run too. defer_thread_run()
+// runs the calling thread's list early.
+//
+// Without pthreads there's no exit hook per thread, only the atexit one;
+// call defer_thread_run() before a thread returns.
+
+// Before defer.h, whose keywords would otherwise end up in pthread.h's inline
+// functions if this is the first include
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#define _DFR_THREAD_PTHREAD 1
+#endif
+
+#include "defer.h"
+
+#ifndef _dfr_thread_local
+#error "defer_thread.h needs thread-local storage (C11 _Thread_local, __thread or __declspec(thread))"
+#endif
+
+typedef struct _dfr_ThreadNode {
+    struct _dfr_ThreadNode* next;
+    void (*func)(void*);
+    void* arg;
+    bool linked;
+} _dfr_ThreadNode;
+
+// Caller-provided node for defer_thread_with, zeroed before first use
+typedef _dfr_ThreadNode defer_thread_node;
+
+_dfr_shared _dfr_thread_local _dfr_ThreadNode* _dfr_thread_defers;
+_dfr_shared _dfr_thread_local bool _dfr_thread_hooked;
+_dfr_shared int _dfr_thread_atexit;
+
+// Runs the calling thread's thread defers now, newest first
+static inline void defer_thread_run(void) {
+    for (_dfr_ThreadNode* node; (node = _dfr_thread_defers); ) {
+        _dfr_thread_defers = node->next;
+        node->linked = false;
+        node->func(node->arg);
+    }
+}
+
+static void _dfr_thread_run_at_exit(void) {
+    defer_thread_run();
+}
+
+#ifdef _DFR_THREAD_PTHREAD
+_dfr_shared pthread_key_t _dfr_thread_key;
+_dfr_shared pthread_once_t _dfr_thread_key_once = PTHREAD_ONCE_INIT;
+
+static void _dfr_thread_key_destructor(void* value) {
+    (void)value;
+    defer_thread_run();
+}
+
+static void _dfr_thread_key_create(void) {
+    pthread_key_create(&_dfr_thread_key, _dfr_thread_key_destructor);
+}
+#endif
+
+// First registration on a thread: arm the exit hooks
+#ifdef __GNUC__
+__attribute__((noinline, cold))
+#endif
+static void _dfr_thread_hook(void) {
+    _dfr_thread_hooked = true;
+#ifdef _DFR_THREAD_PTHREAD
+    pthread_once(&_dfr_thread_key_once, _dfr_thread_key_create);
+    // Any non-NULL value, the destructor only runs for those
+    pthread_setspecific(_dfr_thread_key, &_dfr_thread_hooked);
+#endif
+#ifdef __GNUC__
+    if (__atomic_exchange_n(&_dfr_thread_atexit, 1, __ATOMIC_ACQ_REL) == 0) {
+        atexit(_dfr_thread_run_at_exit);
+    }
+#else
+    if (!_dfr_thread_atexit) {
+        _dfr_thread_atexit = 1;
+        atexit(_dfr_thread_run_at_exit);
+    }
+#endif
+}
+
+#ifdef __GNUC__
+__attribute__((noinline, cold, noreturn))
+#endif
+static void _dfr_thread_relinked(void) {
+    fputs("defer_thread.h: a node registered again with another cleanup before it ran; "
+          "use defer_thread_with and a node per object\n", stderr);
+    abort();
+}
+
+static inline void _dfr_thread_link(_dfr_ThreadNode* node, void (*func)(void*), void* arg) {
+    if (node->linked) {
+        if (node->func != func || node->arg != arg) {
+            _dfr_thread_relinked();
+        }
+        return;
+    }
+    if (!_dfr_thread_hooked) {
+        _dfr_thread_hook();
+    }
+    node->func = func;
+    node->arg = arg;
+    node->linked = true;
+    node->next = _dfr_thread_defers;
+    _dfr_thread_defers = node;
+}
+
+// Braced instead of do/while(0), which would reset the break and continue
+// targets of a surrounding C99 scope
+#define _dfr_thread_defer_impl(cleanup_func, var, unique) \
+    if (1) { \
+        static _dfr_thread_local _dfr_ThreadNode _CAT(_dfr_thread_node, unique); \
+        _dfr_thread_link(&_CAT(_dfr_thread_node, unique), cleanup_func, &(var)); \
+    } else (void)0
+
+#define defer_thread(cleanup_func, var) \
+    _dfr_thread_defer_impl(cleanup_func, var, _UNIQUER)
+
+#define defer_thread_with(node, cleanup_func, var) \
+    _dfr_thread_link(node, cleanup_func, &(var))
+
+#endif // DEFER_THREAD_H
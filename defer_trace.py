@@ -0,0 +1,178 @@
+#!/usr/bin/env python3
+"""Decode a DEFER_TRACE dump written by defer.h.
+
+Prints every thread's events as a timeline, or with --chrome writes a Chrome
+trace (chrome://tracing, Perfetto) where scopes and cleanups are spans and
+registrations and unwinds are instant events. With --binary the cleanup
+addresses are resolved to function names with nm, correcting for where the
+program was loaded.
+
+Usage:
+    defer_trace.py <dump> [--binary EXE] [--chrome OUT.json]
+
+"""
+
+import json
+import struct
+import subprocess
+import sys
+from typing import Dict, List, NamedTuple, Optional, TextIO, Tuple
+
+# Same order as the _DFR_EV_* enum in defer.h
+KINDS = ["enter", "exit", "defer", "errdefer", "cleanup", "cleanup_end",
+         "return", "returnerr", "break", "continue"]
+
+HEADER = struct.Struct("=8sII5Q")
+RING = struct.Struct("=II")
+EVENT = struct.Struct("=QQIHH")
+
+
+class Event(NamedTuple):
+    thread: int
+    tsc: int
+    addr: int
+    line: int
+    kind: str
+    depth: int
+
+
+class Trace(NamedTuple):
+    anchor: int
+    ticks_per_us: Optional[float]
+    start: int
+    events: List[Event]
+
+
+def print_usage(stream: TextIO = sys.stderr) -> None:
+    stream.write("Usage: {} <dump> [--binary EXE] [--chrome OUT.json]\n".format(sys.argv[0]))
+    stream.write("\n")
+    stream.write("  dump       File written by defer_trace_dump() or at exit\n")
+    stream.write("  --binary   Program that wrote the dump, to name cleanup functions\n")
+    stream.write("  --chrome   Write Chrome trace JSON here instead of printing a timeline\n")
+
+
+def read_trace(data: bytes) -> Trace:
+    magic, version, _ring_size, anchor, tsc0, ns0, tsc1, ns1 = HEADER.unpack_from(data, 0)
+    if magic != b"DFRTRACE" or version != 1:
+        raise ValueError("not a defer.h trace dump (version 1)")
+    ticks_per_us = (tsc1 - tsc0) * 1000.0 / (ns1 - ns0) if ns1 > ns0 and tsc1 > tsc0 else None
+    events = []
+    offset = HEADER.size
+    while offset < len(data):
+        thread, count = RING.unpack_from(data, offset)
+        offset += RING.size
+        for _ in range(count):
+            tsc, addr, line, kind, depth = EVENT.unpack_from(data, offset)
+            offset += EVENT.size
+            name = KINDS[kind] if kind < len(KINDS) else "kind{}".format(kind)
+            events.append(Event(thread, tsc, addr, line, name, depth))
+    start = min((e.tsc for e in events), default=tsc0)
+    return Trace(anchor, ticks_per_us, start, events)
+
+
+def load_symbols(binary: str, anchor: int) -> Dict[int, str]:
+    """Runtime address -> function name, using _dfr_trace_rings to find the load bias."""
+    out = subprocess.run(["nm", "--defined-only", binary], capture_output=True,
+                         text=True, check=True).stdout
+    symbols: Dict[int, str] = {}
+    bias = None
+    for line in out.splitlines():
+        parts = line.split()
+        if len(parts) != 3:
+            continue
+        address = int(parts[0], 16)
+        if parts[2] == "_dfr_trace_rings":
+            bias = anchor - address
+        elif parts[1] in "Tt":
+            symbols[address] = parts[2]
+    if bias is None:
+        print("note: _dfr_trace_rings not found in {}, addresses left as is".format(binary),
+              file=sys.stderr)
+        return {}
+    return {address + bias: name for address, name in symbols.items()}
+
+
+def describe(event: Event, symbols: Dict[int, str]) -> str:
+    if event.addr:
+        return symbols.get(event.addr, "0x{:x}".format(event.addr))
+    return "line {}".format(event.line) if event.line else ""
+
+
+def timestamp(trace: Trace, tsc: int) -> float:
+    if trace.ticks_per_us is None:
+        return float(tsc - trace.start)
+    return (tsc - trace.start) / trace.ticks_per_us
+
+
+def print_timeline(trace: Trace, symbols: Dict[int, str], stream: TextIO = sys.stdout) -> None:
+    unit = "us" if trace.ticks_per_us else "cycles"
+    stream.write("{:>6} {:>14}  event\n".format("thread", unit))
+    for event in trace.events:
+        stream.write("{:>6} {:>14.3f}  {}{:<11} {}\n".format(
+            event.thread, timestamp(trace, event.tsc), "  " * event.depth,
+            event.kind, describe(event, symbols)))
+
+
+def chrome_events(trace: Trace, symbols: Dict[int, str]) -> List[dict]:
+    out = []
+    # Spans begun before the ring wrapped have lost their begin event
+    open_spans: Dict[Tuple[int, str], int] = {}
+    for event in trace.events:
+        base = {"pid": 1, "tid": event.thread, "ts": timestamp(trace, event.tsc)}
+        if event.kind in ("enter", "cleanup"):
+            span = "scope" if event.kind == "enter" else "cleanup"
+            open_spans[(event.thread, span)] = open_spans.get((event.thread, span), 0) + 1
+            name = "scope line {}".format(event.line) if span == "scope" else describe(event, symbols)
+            out.append(dict(base, ph="B", name=name, cat=span))
+        elif event.kind in ("exit", "cleanup_end"):
+            span = "scope" if event.kind == "exit" else "cleanup"
+            if open_spans.get((event.thread, span), 0) == 0:
+                continue
+            open_spans[(event.thread, span)] -= 1
+            out.append(dict(base, ph="E", cat=span))
+        else:
+            out.append(dict(base, ph="i", s="t", name="{} {}".format(event.kind, describe(event, symbols)).strip(),
+                            cat=event.kind))
+    return out
+
+
+def main(argv: List[str]) -> int:
+    dump = None
+    binary = None
+    chrome = None
+    args = argv[1:]
+    while args:
+        arg = args.pop(0)
+        if arg == "--binary" and args:
+            binary = args.pop(0)
+        elif arg == "--chrome" and args:
+            chrome = args.pop(0)
+        elif dump is None and not arg.startswith("--"):
+            dump = arg
+        else:
+            print_usage()
+            return 1
+    if dump is None:
+        print_usage()
+        return 1
+
+    with open(dump, "rb") as f:
+        data = f.read()
+    try:
+        trace = read_trace(data)
+    except (ValueError, struct.error) as e:
+        print("Error: {}: {}".format(dump, e), file=sys.stderr)
+        return 1
+    symbols = load_symbols(binary, trace.anchor) if binary else {}
+
+    if chrome:
+        with open(chrome, "w") as f:
+            json.dump({"traceEvents": chrome_events(trace, symbols), "displayTimeUnit": "ns"}, f)
+        print("{} events written to {}".format(len(trace.events), chrome))
+    else:
+        print_timeline(trace, symbols)
+    return 0
+
+
+if __name__ == "__main__":  # pragma: no cover - CLI entry point
+    raise SystemExit(main(sys.argv))
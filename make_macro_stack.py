@@ -3,19 +3,52 @@
 
 Usage:
     make_macro_stack.py <length> [fail|fallback] > <output_file>
+    make_macro_stack.py --count SOURCE [-I DIR]... [-o OUTPUT] [--deps DEPFILE]
+                        [fail|fallback]
+
+With --count the length is the number of top-level S_ _S scopes in SOURCE
+and in every header it includes with quotes, found relative to the including
+file and then in the -I directories, so each translation unit gets a stack of
+exactly the size it uses. Scopes under #if are counted whether or not they're
+compiled, which only makes the stack bigger than needed. Macros whose
+bodies open scopes are followed to where they're used, but a macro that's
+only reached through token pasting isn't, and the default fail mode is there
+to tell you about that.
+
+With -o the header is only rewritten when its contents change, so targets
+that depend on it aren't rebuilt while the scope count stays the same.
+--deps writes a make rule listing every file that was scanned, for -include.
 
 """
 
+import io
+import os
+import re
 import sys
-from typing import TextIO
+from typing import Dict, List, Optional, Set, TextIO, Tuple
+
+from defer_lower import Token, tokenize
+
+# Everything that opens or closes a scope that consumes the stack. S_CORO
+# doesn't go through S_, and the arena openers do.
+OPENERS = {"S_", "S_LABEL", "S_ARENA", "S_ERRARENA"}
+CLOSERS = {"_S", "_S_LABEL"}
+
+_DEFINE_RE = re.compile(r"#\s*define\s+(\w+)(?:\([^)]*\))?")
 
 
 def print_usage(stream: TextIO = sys.stderr) -> None:
     stream.write("Usage: {} <length> [fail|fallback] > <output_file>\n".format(sys.argv[0]))
+    stream.write("       {} --count SOURCE [-I DIR]... [-o OUTPUT] [--deps DEPFILE] "
+                 "[fail|fallback]\n".format(sys.argv[0]))
     stream.write("\n")
     stream.write("  length     Number of top-level defer scopes supported (each consumes 2 stack slots)\n")
     stream.write("  fail       When stack depleted, cause compile error (default)\n")
     stream.write("  fallback   When stack depleted, fall back to global keyword redefinition\n")
+    stream.write("  --count    Size the stack to the top-level scopes in SOURCE and its headers\n")
+    stream.write("  -I         Also look for quoted #includes in DIR\n")
+    stream.write("  -o         Write to OUTPUT, and only if it changed\n")
+    stream.write("  --deps     Write a make rule for OUTPUT listing the files scanned\n")
 
 
 def generate_macro_stack(length: int, mode: str, stream: TextIO = sys.stdout) -> None:
@@ -42,7 +75,162 @@ def generate_macro_stack(length: int, mode: str, stream: TextIO = sys.stdout) ->
     stream.write("#define SCOPE_MACRO_STACK_AVAILABLE\n")
 
 
+def _quoted_include(directive: str) -> Optional[str]:
+    text = directive[1:].lstrip()
+    if not text.startswith("include"):
+        return None
+    text = text[len("include"):].lstrip()
+    if not text.startswith('"'):
+        return None
+    end = text.find('"', 1)
+    return text[1:end] if end > 0 else None
+
+
+def _find_include(name: str, including: str, include_dirs: List[str]) -> Optional[str]:
+    for directory in [os.path.dirname(including)] + include_dirs:
+        path = os.path.normpath(os.path.join(directory, name))
+        if os.path.isfile(path):
+            return path
+    return None
+
+
+class _Counter:
+    """Follows scope depth through a file, its headers and its macros."""
+
+    def __init__(self, include_dirs: List[str], skip: Set[str]) -> None:
+        self.include_dirs = include_dirs
+        self.seen = skip
+        self.files: List[str] = []
+        # Macros whose bodies open or close scopes, by name
+        self.macros: Dict[str, List[Token]] = {}
+        self.expanding: Set[str] = set()
+        self.depth = 0
+        self.count = 0
+
+    def scan_file(self, path: str) -> None:
+        if os.path.abspath(path) in self.seen:
+            return
+        self.seen.add(os.path.abspath(path))
+        self.files.append(path)
+        with open(path) as f:
+            tokens = tokenize(f.read())
+        for t in tokens:
+            if t.kind == "pp":
+                self.directive(t.text, path)
+            else:
+                self.token(t)
+
+    def directive(self, text: str, path: str) -> None:
+        name = _quoted_include(text)
+        # A macro stack has no scopes, and may be this file's output
+        if name and os.path.basename(name) != "macro_stack.h":
+            found = _find_include(name, path, self.include_dirs)
+            if found:
+                self.scan_file(found)
+            return
+        m = _DEFINE_RE.match(text)
+        if m and m.group(1) not in OPENERS | CLOSERS:
+            body = tokenize(text[m.end():])
+            if any(t.kind == "id" and (t.text in OPENERS | CLOSERS or t.text in self.macros)
+                   for t in body):
+                self.macros[m.group(1)] = body
+
+    def token(self, t: Token) -> None:
+        if t.kind != "id":
+            return
+        if t.text in OPENERS:
+            if self.depth == 0:
+                self.count += 1
+            self.depth += 1
+        elif t.text in CLOSERS:
+            self.depth = max(self.depth - 1, 0)
+        elif t.text in self.macros and t.text not in self.expanding:
+            # Arguments are scanned as they come after the name anyway
+            self.expanding.add(t.text)
+            for body_token in self.macros[t.text]:
+                self.token(body_token)
+            self.expanding.discard(t.text)
+
+
+def count_scopes(source: str, include_dirs: List[str],
+                 skip: Optional[List[str]] = None) -> Tuple[int, List[str]]:
+    """Top-level scopes in source and its headers, and the files scanned.
+
+    Headers are scanned where they're included, once each, as if they had
+    include guards. Files in skip (the stack being generated) aren't scanned.
+    """
+    counter = _Counter(include_dirs, set(os.path.abspath(p) for p in skip or ()))
+    counter.scan_file(os.path.normpath(source))
+    return counter.count, counter.files
+
+
+def write_if_changed(path: str, text: str) -> None:
+    try:
+        with open(path) as f:
+            if f.read() == text:
+                return
+    except OSError:
+        pass
+    with open(path, "w") as f:
+        f.write(text)
+
+
+def count_main(args: List[str]) -> int:
+    source: Optional[str] = None
+    output: Optional[str] = None
+    deps: Optional[str] = None
+    include_dirs: List[str] = []
+    mode = "fail"
+    while args:
+        arg = args.pop(0)
+        if arg == "-o" and args:
+            output = args.pop(0)
+        elif arg == "--deps" and args:
+            deps = args.pop(0)
+        elif arg == "-I" and args:
+            include_dirs.append(args.pop(0))
+        elif arg.startswith("-I") and len(arg) > 2:
+            include_dirs.append(arg[2:])
+        elif arg in {"fail", "fallback"}:
+            mode = arg
+        elif source is None and not arg.startswith("-"):
+            source = arg
+        else:
+            print_usage()
+            return 1
+    if source is None or (deps is not None and output is None):
+        print_usage()
+        return 1
+
+    try:
+        count, files = count_scopes(source, include_dirs, [output] if output else None)
+    except OSError as e:
+        print("Error: {}".format(e), file=sys.stderr)
+        return 1
+    except SyntaxError as e:
+        print("Error: {}: {}".format(source, e), file=sys.stderr)
+        return 1
+
+    stack = io.StringIO()
+    stack.write("// {} top-level scopes in {}\n".format(count, source))
+    generate_macro_stack(count, mode, stack)
+    if output is None:
+        sys.stdout.write(stack.getvalue())
+        return 0
+    write_if_changed(output, stack.getvalue())
+    if deps is not None:
+        # Every scanned file gets an empty rule too, so deleting a header
+        # doesn't break the build, like gcc -MP
+        rule = "{}: {}\n".format(output, " ".join(files))
+        rule += "".join("\n{}:\n".format(f) for f in files[1:])
+        write_if_changed(deps, rule)
+    return 0
+
+
 def main(argv: list[str]) -> int:
+    if len(argv) > 1 and argv[1] == "--count":
+        return count_main(argv[2:])
+
     if len(argv) < 2 or len(argv) > 3:
         print_usage()
         return 1
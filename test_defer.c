@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <time.h>
 #include <string.h>
 #include <stdbool.h>
 #ifdef __clang__
@@ -17,11 +18,24 @@
 #if defined (__GNUC__) && !defined(USE_C99_DEFER) && !defined(__PCC__)
 #undef USE_MACRO_STACK
 #endif
-#ifdef USE_MACRO_STACK
+// The Makefile force-includes a stack sized for this file (-include), the
+// shared macro_stack.h is for building by hand
+#if defined(USE_MACRO_STACK) && !defined(SCOPE_MACRO_STACK_AVAILABLE)
 #include "macro_stack.h"
 #else
 #endif // USE_MACRO_STACK
 #include "defer.h"
+#define DEFER_ALLOC_FREE counting_free
+static void counting_free(void* ptr);
+#include "defer_alloc.h"
+#include "defer_coro.h"
+#include "defer_thread.h"
+#include "defer_lock.h"
+#include "defer_io.h"
+#ifdef __GNUC__
+#include "defer_pool.h"
+#include "defer_ref.h"
+#endif
 #ifndef USE_C99_DEFER
 #else
 #endif // USE_C99_DEFER
@@ -1437,6 +1451,1379 @@ void test_switch_fallthrough_to_loop() {
     printf("✓ Switch fallthrough to loop works\n");
 }
 
+// Test 43: Typed defers call the cleanup with the variable's own type
+void log_typed(int value) {
+    log_cleanup("t", value);
+}
+DEFER_TYPED(log_typed, int);
+
+// Declared with void*, used with char*, like free
+void log_typed_text(void* text) {
+    log_cleanup((const char*)text, 0);
+}
+DEFER_TYPED(log_typed_text, void*);
+
+int typed_defer_helper(int fail) S_
+    int a = 1;
+    tdefer(log_typed, a);
+    int b = 2;
+    terrdefer(log_typed, b);
+    a = 10; // Still captured by reference
+    if (fail) {
+        returnerr -1;
+    }
+    return 0;
+_S
+
+// Variables that convert to the declared type without changing their bits
+void typed_convert_helper(void) S_
+    char* text = "text";
+    tdefer(log_typed_text, text);
+    unsigned u = 3;
+    tdefer(log_typed, u);
+_S
+
+#ifdef DEFER_TEST_REJECT_TYPED
+// Built on its own by `make run-test-reject`, which expects it not to compile:
+// log_typed takes an int, and a long would otherwise be read through an int*
+void typed_mismatch_helper(void) S_
+    long wrong = 1;
+    tdefer(log_typed, wrong);
+    long also_wrong = 2;
+    terrdefer(log_typed, also_wrong);
+    int* not_an_int = NULL;
+    tdefer(log_typed, not_an_int);
+_S
+#endif
+
+void test_typed_defer() {
+    printf("\n=== Test 43: Typed defer and errdefer ===\n");
+    reset_log();
+
+    assert(typed_defer_helper(0) == 0);
+    assert(cleanup_count == 1);
+    assert(strcmp(cleanup_log[0], "t:10") == 0);
+
+    reset_log();
+    assert(typed_defer_helper(1) == -1);
+    assert(cleanup_count == 2);
+    assert(strcmp(cleanup_log[0], "t:2") == 0);
+    assert(strcmp(cleanup_log[1], "t:10") == 0);
+    printf("✓ Typed defers see current values and respect errdefer\n");
+
+    reset_log();
+    typed_convert_helper();
+    assert(cleanup_count == 2);
+    assert(strcmp(cleanup_log[0], "t:3") == 0);
+    assert(strcmp(cleanup_log[1], "text:0") == 0);
+    printf("✓ char* for a void* cleanup, unsigned for an int one\n");
+}
+
+// Test 44: Inline cleanup blocks (GCC only, skipped elsewhere)
+#if DEFER_BLOCKS_AVAILABLE
+int block_defer_helper(int fail) S_
+    int a = 1;
+    deferblock(log_cleanup("blk", a);)
+    int b = 2;
+    errdeferblock({ log_cleanup("errblk", b); })
+    a = 10;
+    if (fail) {
+        returnerr -1;
+    }
+    return 0;
+_S
+#endif
+
+void test_defer_blocks() {
+    printf("\n=== Test 44: Inline cleanup blocks ===\n");
+#if DEFER_BLOCKS_AVAILABLE
+    reset_log();
+    assert(block_defer_helper(0) == 0);
+    assert(cleanup_count == 1);
+    assert(strcmp(cleanup_log[0], "blk:10") == 0);
+
+    reset_log();
+    assert(block_defer_helper(1) == -1);
+    assert(cleanup_count == 2);
+    assert(strcmp(cleanup_log[0], "errblk:2") == 0);
+    assert(strcmp(cleanup_log[1], "blk:10") == 0);
+    printf("✓ Cleanup blocks run inline on scope exit\n");
+#else
+    printf("(skipped, deferblock not available)\n");
+#endif
+}
+
+// Test 45: Scope-bound arena
+static char* arena_keep_helper(int fail) S_ERRARENA
+    char* buf = (char*)arena_alloc(16);
+    strcpy(buf, "kept");
+    if (fail) {
+        returnerr NULL;
+    }
+    return buf;
+_S
+
+static char* arena_loop_helper(char** seen) S_ARENA
+    char* mark = (char*)arena_alloc(1);
+    for (int i = 0; i < 4; i++) S_ARENA
+        seen[i] = (char*)arena_alloc(64);
+        if (i == 1) {
+            continue;
+        }
+        if (i == 2) {
+            break;
+        }
+    _S
+    seen[3] = (char*)arena_alloc(1);
+    return mark;
+_S
+
+void test_arena() {
+    printf("\n=== Test 45: Scope-bound arena ===\n");
+    char* first;
+    S_ARENA
+        first = (char*)arena_alloc(10);
+        char* second = (char*)arena_alloc(1);
+        assert(((uintptr_t)first & (DEFER_ARENA_ALIGN - 1)) == 0);
+        assert(second == first + DEFER_ARENA_ALIGN);
+    _S
+
+    S_ARENA
+        // Rewound at _S, so the same memory comes back
+        assert(arena_alloc(10) == first);
+
+        // Nested scopes get nested marks
+        S_ARENA
+            char* inner = (char*)arena_alloc(32);
+            assert(inner == first + DEFER_ARENA_ALIGN);
+            // Bigger than a chunk: gets a chunk of its own, released at _S
+            char* big = (char*)arena_alloc(DEFER_ARENA_CHUNK * 2);
+            assert(big != NULL);
+            memset(big, 1, DEFER_ARENA_CHUNK * 2);
+        _S
+        assert(arena_alloc(1) == first + DEFER_ARENA_ALIGN);
+
+        // errdefer semantics: kept on success, released on returnerr
+        char* kept = arena_keep_helper(0);
+        assert(strcmp(kept, "kept") == 0);
+        char* after = (char*)arena_alloc(1);
+        assert(after == kept + 16);
+        assert(arena_keep_helper(1) == NULL);
+        assert(arena_alloc(1) == after + DEFER_ARENA_ALIGN);
+    _S
+
+    // break and continue rewind the loop body's arena
+    S_ARENA
+        char* seen[4] = { NULL, NULL, NULL, NULL };
+        assert(arena_loop_helper(seen) == first);
+        assert(seen[0] == first + DEFER_ARENA_ALIGN);
+        assert(seen[1] == seen[0]);
+        assert(seen[2] == seen[0]);
+        assert(seen[3] == seen[0]);
+        assert(arena_alloc(1) == first);
+    _S
+    arena_trim();
+    printf("✓ Arena rewinds on every scope exit, errarena keeps on success\n");
+}
+
+// Test 46: Scratch buffer with heap spill
+static int scratch_spill_helper(int fail, char** first) S_
+    scratchdecl(96);
+    *first = (char*)scratch_alloc(40);
+    char* second = (char*)scratch_alloc(24);   // still fits
+    char* spilled = (char*)scratch_alloc(100); // spills, freed on every exit
+    memset(spilled, 0, 100);
+    if (second != *first + 48) {
+        return -2;
+    }
+    if (fail) {
+        returnerr -1;
+    }
+    return 0;
+_S
+
+void test_scratch() {
+    printf("\n=== Test 46: Scratch buffer with heap spill ===\n");
+    char* first = NULL;
+    assert(scratch_spill_helper(0, &first) == 0);
+    assert(((uintptr_t)first & (DEFER_ARENA_ALIGN - 1)) == 0);
+    assert(scratch_spill_helper(1, &first) == -1);
+
+    int spills = 0;
+    for (int i = 0; i < 3; i++) S_
+        scratchdecl(32);
+        char* a = (char*)scratch_alloc(16);
+        char* b = (char*)scratch_alloc(64);
+        spills += (b < a || b >= a + 32);
+        if (i == 0) {
+            continue;
+        }
+        break;
+    _S
+    assert(spills == 2);
+    printf("✓ Scratch allocations spill to the heap and are freed on exit\n");
+}
+
+// Test 47: One defer covering a whole array
+static int each_helper(int fail) S_
+    int values[4] = { 1, 2, 3, 4 };
+    defer_each(cleanup_a, values, 4);
+    int errs[3] = { 10, 20, 30 };
+    errdefer_each(cleanup_b, errs, 2);
+    values[0] = 100;
+    if (fail) {
+        returnerr -1;
+    }
+    return 0;
+_S
+
+void test_defer_each() {
+    printf("\n=== Test 47: defer_each / errdefer_each ===\n");
+    reset_log();
+    assert(each_helper(0) == 0);
+    assert(cleanup_count == 4);
+    assert(strcmp(cleanup_log[0], "a:4") == 0);
+    assert(strcmp(cleanup_log[3], "a:100") == 0);
+
+    reset_log();
+    assert(each_helper(1) == -1);
+    assert(cleanup_count == 6);
+    assert(strcmp(cleanup_log[0], "b:20") == 0);
+    assert(strcmp(cleanup_log[1], "b:10") == 0);
+    assert(strcmp(cleanup_log[2], "a:4") == 0);
+    assert(strcmp(cleanup_log[5], "a:100") == 0);
+    printf("✓ Array cleanups run once per element in reverse order\n");
+}
+
+// Test 48: Batch free skipping NULL slots
+static int frees_seen = 0;
+static void counting_free(void* ptr) {
+    frees_seen++;
+    free(ptr);
+}
+
+static void free_each_helper(void** slots, size_t count, int fail) S_
+    defer_free_each(slots, count);
+    if (fail) {
+        returnerr;
+    }
+_S
+
+void test_defer_free_each() {
+    printf("\n=== Test 48: defer_free_each ===\n");
+    void* slots[37] = { NULL };
+    int allocated = 0;
+    frees_seen = 0;
+    for (int i = 0; i < 37; i++) {
+        // Leave whole 32 byte blocks empty as well as single slots
+        if ((i >= 8 && i < 16) || i % 3 == 0) {
+            continue;
+        }
+        slots[i] = malloc(8);
+        allocated++;
+    }
+    void* sized[5] = { malloc(16), NULL, malloc(16), NULL, NULL };
+    free_each_helper(slots, 37, 0);
+    S_
+        defer_free_each_sized(sized, 5, 16);
+    _S
+    assert(frees_seen == allocated + 2);
+
+    frees_seen = 0;
+    void* none[9] = { NULL };
+    free_each_helper(none, 9, 1);
+    assert(frees_seen == 0);
+    printf("✓ Every non-NULL slot freed once, empty blocks skipped\n");
+}
+
+// Test 49: Per-site cleanup profiling (only built with -DDEFER_PROFILE)
+#ifdef DEFER_PROFILE
+static int profiled_runs = 0;
+static void profiled_cleanup(void* arg) {
+    profiled_runs += *(int*)arg;
+}
+
+static void profiled_helper(int fail) S_
+    int one = 1;
+    defer(profiled_cleanup, one);
+    errdefer(profiled_cleanup, one);
+    if (fail) {
+        returnerr;
+    }
+_S
+
+static void unprofiled_helper(void) S_
+    int one = 1;
+    defer(profiled_cleanup, one);
+_S
+#endif
+
+void test_profile() {
+    printf("\n=== Test 49: DEFER_PROFILE per-site counters ===\n");
+#ifdef DEFER_PROFILE
+    profiled_runs = 0;
+    for (int i = 0; i < 5; i++) {
+        profiled_helper(i == 0);
+    }
+    assert(profiled_runs == 6);
+
+    FILE* out = tmpfile();
+    assert(out != NULL);
+    defer_profile_dump(out);
+    rewind(out);
+    char line[512];
+    int sites = 0;
+    unsigned long long calls = 0, total = 0;
+    for (; fgets(line, sizeof(line), out); ) {
+        if (strstr(line, "test_defer.c:") && strstr(line, "\tprofiled_cleanup\t")) {
+            sites++;
+            sscanf(strstr(line, "\tprofiled_cleanup\t") + strlen("\tprofiled_cleanup\t"), "%llu", &calls);
+            total += calls;
+        }
+    }
+    fclose(out);
+    // One line for the defer (5 calls), one for the errdefer (1 call)
+    assert(sites == 2);
+    assert(total == 6);
+
+    // Past the last id, new sites go unprofiled and the counter stays put
+    unsigned next_id = _dfr_prof_next_id;
+    _dfr_prof_next_id = _DFR_PROF_PAGE * _DFR_PROF_PAGES;
+    for (int i = 0; i < 3; i++) {
+        unprofiled_helper();
+    }
+    assert(_dfr_prof_next_id == _DFR_PROF_PAGE * _DFR_PROF_PAGES);
+    assert(profiled_runs == 9);
+    _dfr_prof_next_id = next_id;
+    printf("✓ Both sites dumped with their call counts\n");
+#else
+    printf("✓ Skipped (build with -DDEFER_PROFILE)\n");
+#endif
+}
+
+// Test 50: Event trace ring buffer (only built with -DDEFER_TRACE)
+#ifdef DEFER_TRACE
+static int traced_runs = 0;
+static void traced_cleanup(void* arg) {
+    traced_runs += *(int*)arg;
+}
+
+static int traced_helper(int fail) S_
+    int one = 1;
+    defer(traced_cleanup, one);
+    for (int i = 0; i < 3; i++) S_
+        errdefer(traced_cleanup, one);
+        if (i == 1) {
+            break;
+        }
+    _S
+    if (fail) {
+        returnerr 1;
+    }
+    return 0;
+_S
+#endif
+
+void test_trace() {
+    printf("\n=== Test 50: DEFER_TRACE event ring ===\n");
+#ifdef DEFER_TRACE
+    traced_runs = 0;
+    traced_helper(0);
+    _dfr_TraceRing* ring = _dfr_trace_self;
+    assert(ring != NULL);
+    unsigned depth = ring->depth;
+    uint64_t start = ring->head;
+    traced_helper(1);
+    uint64_t end = ring->head;
+    // Every scope entered is exited again, back at the depth we started at
+    assert(ring->depth == depth);
+    int counts[10] = { 0 };
+    bool cleanup_seen = false;
+    uint64_t last_tsc = 0;
+    bool ordered = true;
+    for (uint64_t i = start; i < end; i++) {
+        _dfr_TraceEvent* event = &ring->events[i & (DEFER_TRACE_EVENTS - 1)];
+        counts[event->kind]++;
+        if (event->kind == _DFR_EV_CLEANUP && event->addr == (uintptr_t)traced_cleanup) cleanup_seen = true;
+        if (event->tsc < last_tsc) ordered = false;
+        last_tsc = event->tsc;
+    }
+    assert(ordered);
+    assert(cleanup_seen);
+    // Outer scope plus two loop iterations
+    assert(counts[_DFR_EV_ENTER] == 3);
+    assert(counts[_DFR_EV_EXIT] == 3);
+    assert(counts[_DFR_EV_DEFER] == 1);
+    assert(counts[_DFR_EV_ERRDEFER] == 2);
+    assert(counts[_DFR_EV_RETURNERR] == 1);
+    // Only the defer runs: the errdefers belonged to scopes without returnerr
+    assert(counts[_DFR_EV_CLEANUP] == 1);
+    assert(counts[_DFR_EV_CLEANUP_END] == 1);
+    assert(traced_runs == 2);
+
+    // continue out of a function level scope in a loop that isn't in one
+    for (int i = 0; i < 3; i++) S_
+        if (i < 2) {
+            continue;
+        }
+    _S
+    assert(ring->depth == depth);
+
+    FILE* out = tmpfile();
+    assert(out != NULL);
+    defer_trace_dump(out);
+    assert(ftell(out) > 64);
+    fclose(out);
+    printf("✓ Scopes, registrations and cleanups recorded in order\n");
+#else
+    printf("✓ Skipped (build with -DDEFER_TRACE)\n");
+#endif
+}
+
+// Test 51: Defers in a coroutine frame survive yields
+typedef struct {
+    defer_coro co;
+    int id;
+    int step;
+    int opened;
+    int scratch;
+} coro_task;
+
+static int coro_log[64];
+static int coro_log_len = 0;
+static void coro_cleanup(void* arg) {
+    coro_log[coro_log_len++ % 64] = *(int*)arg;
+}
+
+static int coro_task_step(coro_task* t, int fail_at) {
+    CORO_BEGIN(&t->co);
+    t->opened = t->id * 10 + 1;
+    coro_defer(&t->co, coro_cleanup, t->opened);
+    CORO_YIELD(&t->co);
+    t->scratch = t->id * 10 + 2;
+    coro_errdefer(&t->co, coro_cleanup, t->scratch);
+    S_CORO(&t->co)
+        coro_defer(&t->co, coro_cleanup, t->step);
+        for (t->step = 0; t->step < 3; t->step++) {
+            CORO_YIELD(&t->co);
+        }
+        if (fail_at == 1) {
+            CORO_RETURNERR(&t->co);
+        }
+    _S_CORO(&t->co)
+    CORO_AWAIT(&t->co, t->step++ >= 5);
+    CORO_END(&t->co);
+}
+
+void test_coro() {
+    printf("\n=== Test 51: defer_coro.h coroutines ===\n");
+    coro_task t;
+    memset(&t, 0, sizeof(t));
+    t.id = 1;
+    int steps = 1;
+    for (; coro_task_step(&t, 0) == DEFER_CORO_YIELDED; steps++) {
+        // Nothing runs while suspended, except the S_CORO scope's defer at its end
+        if (steps < 5) {
+            assert(coro_log_len == 0);
+        }
+    }
+    assert(steps == 7);
+    assert(defer_coro_done(&t.co));
+    // Scope defer at its end (step == 3), then the outer defer; no errdefer
+    assert(coro_log_len == 2 && coro_log[0] == 3 && coro_log[1] == 11);
+    assert(coro_task_step(&t, 0) == DEFER_CORO_DONE);
+    assert(coro_log_len == 2);
+
+    // Failing inside the scope runs everything including the errdefer
+    coro_log_len = 0;
+    memset(&t, 0, sizeof(t));
+    t.id = 2;
+    for (; coro_task_step(&t, 1) == DEFER_CORO_YIELDED; ) {}
+    assert(coro_log_len == 3 && coro_log[0] == 3 && coro_log[1] == 22 && coro_log[2] == 21);
+
+    // Many interleaved tasks, some cancelled while suspended
+    static coro_task tasks[1000];
+    memset(tasks, 0, sizeof(tasks));
+    coro_log_len = 0;
+    for (int i = 0; i < 1000; i++) {
+        tasks[i].id = 3;
+        coro_task_step(&tasks[i], 0);
+        coro_task_step(&tasks[i], 0);
+    }
+    int done = 0;
+    for (int i = 0; i < 1000; i++) {
+        if (i % 2) {
+            defer_coro_cancel(&tasks[i].co);
+        } else {
+            for (; coro_task_step(&tasks[i], 0) == DEFER_CORO_YIELDED; ) {}
+        }
+        done += defer_coro_done(&tasks[i].co);
+    }
+    assert(done == 1000);
+    // 500 finished: scope defer + outer; 500 cancelled: step defer, errdefer, outer
+    assert(coro_log_len == 500 * 2 + 500 * 3);
+
+    // More defers than fit in the frame spill to the heap
+    defer_coro co;
+    memset(&co, 0, sizeof(co));
+    int values[DEFER_CORO_INLINE * 3];
+    coro_log_len = 0;
+    for (int i = 0; i < DEFER_CORO_INLINE * 3; i++) {
+        values[i] = i;
+        coro_defer(&co, coro_cleanup, values[i]);
+    }
+    defer_coro_cancel(&co);
+    assert(coro_log_len == DEFER_CORO_INLINE * 3);
+    assert(coro_log[0] == DEFER_CORO_INLINE * 3 - 1 && coro_log[DEFER_CORO_INLINE * 3 - 1] == 0);
+    assert(co.spill == NULL);
+    printf("✓ Coroutine defers run at finish or cancel, not at yields\n");
+}
+
+// Test 52: Thread-exit defers
+typedef struct {
+    int log[8];
+    int len;
+} thread_log;
+
+static _dfr_thread_local thread_log* current_thread_log;
+static _dfr_thread_local int thread_first;
+static _dfr_thread_local int thread_second;
+
+static void thread_log_value(void* arg) {
+    current_thread_log->log[current_thread_log->len++] = *(int*)arg;
+}
+
+static void thread_register_second(int value) {
+    thread_second = value;
+    // Same call site and variable each time: registers once
+    defer_thread(thread_log_value, thread_second);
+}
+
+typedef struct {
+    defer_thread_node on_exit;
+    int value;
+} thread_object;
+
+static _dfr_thread_local thread_object thread_objects[2];
+
+static void thread_register_object(thread_object* object, int value) {
+    object->value = value;
+    // One call site, a node per object: each stays registered
+    defer_thread_with(&object->on_exit, thread_log_value, object->value);
+}
+
+static void* thread_defer_worker(void* arg) {
+    current_thread_log = (thread_log*)arg;
+    thread_first = 1;
+    defer_thread(thread_log_value, thread_first);
+    thread_register_second(2);
+    thread_register_second(3);
+    thread_register_object(&thread_objects[0], 4);
+    thread_register_object(&thread_objects[1], 5);
+    return NULL;
+}
+
+void test_defer_thread() {
+    printf("\n=== Test 52: defer_thread ===\n");
+#ifdef _DFR_THREAD_PTHREAD
+    pthread_t threads[4];
+    thread_log logs[4];
+    memset(logs, 0, sizeof(logs));
+    for (int i = 0; i < 4; i++) {
+        assert(pthread_create(&threads[i], NULL, thread_defer_worker, &logs[i]) == 0);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    // Ran at thread exit, newest first, the second site once with its last
+    // value and the objects' shared site once per object
+    for (int i = 0; i < 4; i++) {
+        assert(logs[i].len == 4);
+        assert(logs[i].log[0] == 5 && logs[i].log[1] == 4);
+        assert(logs[i].log[2] == 3 && logs[i].log[3] == 1);
+    }
+#endif
+
+    // On this thread, run the list early; it can be refilled afterwards
+    thread_log main_log;
+    memset(&main_log, 0, sizeof(main_log));
+    current_thread_log = &main_log;
+    thread_defer_worker(&main_log);
+    assert(main_log.len == 0);
+    defer_thread_run();
+    assert(main_log.len == 4 && main_log.log[0] == 5 && main_log.log[3] == 1);
+    thread_register_second(6);
+    defer_thread_run();
+    assert(main_log.len == 5 && main_log.log[4] == 6);
+    printf("✓ Thread defers run at thread exit, newest first\n");
+}
+
+// Test 53: Fast exit skips memory-only cleanups
+static int fast_exit_helper(int fail) S_
+    int mem = 1;
+    int ext = 2;
+    int errmem = 3;
+    defer_mem(cleanup_a, mem);
+    defer(cleanup_b, ext);
+    errdefer_mem(cleanup_a, errmem);
+    if (fail) {
+        returnerr -1;
+    }
+    return 0;
+_S
+
+void test_fast_exit() {
+    printf("\n=== Test 53: defer_mem / defer_fast_exit ===\n");
+    reset_log();
+    assert(fast_exit_helper(0) == 0);
+    assert(cleanup_count == 2);
+    reset_log();
+    assert(fast_exit_helper(1) == -1);
+    assert(cleanup_count == 3);
+    assert(strcmp(cleanup_log[0], "a:3") == 0);
+    assert(strcmp(cleanup_log[2], "a:1") == 0);
+
+    void* slots[3] = { malloc(8), NULL, malloc(8) };
+    frees_seen = 0;
+    assert(!defer_fast_exiting());
+    defer_fast_exit();
+    assert(defer_fast_exiting());
+    reset_log();
+    assert(fast_exit_helper(0) == 0);
+    assert(cleanup_count == 1 && strcmp(cleanup_log[0], "b:2") == 0);
+    reset_log();
+    assert(fast_exit_helper(1) == -1);
+    assert(cleanup_count == 1 && strcmp(cleanup_log[0], "b:2") == 0);
+    free_each_helper(slots, 3, 0);
+    assert(frees_seen == 0);
+
+    // Not something programs can do, but the rest of the tests need cleanups
+    _dfr_fast_exit_flag = 0;
+    free(slots[0]);
+    free(slots[2]);
+    printf("✓ Memory-only cleanups skipped after defer_fast_exit, others still run\n");
+}
+
+// Test 54: defer_longjmp runs the skipped scopes' cleanups (only built with
+// -DDEFER_LONGJMP)
+#ifdef DEFER_LONGJMP
+static void jmp_dive(defer_jmp_buf* env, int depth, bool jump) S_
+    int v = depth;
+    defer(cleanup_a, v);
+    tdefer(log_typed, v);
+    errdefer(cleanup_b, v);
+    for (int i = 0; i < 3; i++) S_
+        int x = depth * 10 + i;
+        defer(cleanup_d, x);
+        if (jump && depth == 0 && i == 1) {
+            defer_longjmp(*env, 7);
+        }
+    _S
+    if (depth > 0) {
+        jmp_dive(env, depth - 1, jump);
+    }
+_S
+
+static int jmp_run(bool jump) S_
+    int outer = 100;
+    defer(cleanup_c, outer);
+    defer_jmp_buf env;
+    if (defer_setjmp(env) == 7) {
+        return 7;
+    }
+    jmp_dive(&env, 1, jump);
+    return 0;
+_S
+
+// The setjmp scope's own defers from after defer_setjmp run at the jump, once
+static int jmp_late(void) S_
+    int outer = 100;
+    defer(cleanup_c, outer);
+    defer_jmp_buf env;
+    if (defer_setjmp(env) == 7) {
+        return 7;
+    }
+    int late = 200;
+    int mem = 300;
+    defer(cleanup_a, late);
+    errdefer(cleanup_b, late);
+    defer_mem(cleanup_d, mem);
+    defer_longjmp(env, 7);
+    return 0;
+_S
+#endif
+
+void test_longjmp() {
+    printf("\n=== Test 54: defer_setjmp / defer_longjmp ===\n");
+#ifdef DEFER_LONGJMP
+    for (int round = 0; round < 2; round++) {
+        reset_log();
+        assert(jmp_run(true) == 7);
+        // depth 1's loop ran normally before recursing, depth 0 jumped out
+        // of its second iteration
+        assert(cleanup_count == 12);
+        assert(strcmp(cleanup_log[3], "d:0") == 0);
+        assert(strcmp(cleanup_log[4], "d:1") == 0);
+        assert(strcmp(cleanup_log[5], "b:0") == 0);
+        assert(strcmp(cleanup_log[6], "t:0") == 0);
+        assert(strcmp(cleanup_log[7], "a:0") == 0);
+        assert(strcmp(cleanup_log[8], "b:1") == 0);
+        assert(strcmp(cleanup_log[10], "a:1") == 0);
+        assert(strcmp(cleanup_log[11], "c:100") == 0);
+    }
+    // After two jumps, normal exits still find the list where they left it
+    reset_log();
+    assert(jmp_run(false) == 0);
+    assert(cleanup_count == 11);
+    assert(strcmp(cleanup_log[6], "t:0") == 0);
+    assert(strcmp(cleanup_log[7], "a:0") == 0);
+    assert(strcmp(cleanup_log[10], "c:100") == 0);
+
+    reset_log();
+    assert(jmp_late() == 7);
+    assert(cleanup_count == 4);
+    assert(strcmp(cleanup_log[0], "d:300") == 0);
+    assert(strcmp(cleanup_log[1], "b:200") == 0);
+    assert(strcmp(cleanup_log[2], "a:200") == 0);
+    assert(strcmp(cleanup_log[3], "c:100") == 0);
+    // The jump skips memory-only cleanups after defer_fast_exit like an exit
+    defer_fast_exit();
+    reset_log();
+    assert(jmp_run(true) == 7 && cleanup_count == 12);
+    reset_log();
+    assert(jmp_late() == 7);
+    assert(cleanup_count == 3 && strcmp(cleanup_log[0], "b:200") == 0);
+    _dfr_fast_exit_flag = 0;
+    printf("✓ Skipped defers and errdefers ran before the jump\n");
+#else
+    printf("✓ Skipped (build with -DDEFER_LONGJMP)\n");
+#endif
+}
+
+// Test 55: break_to leaves nested scopes, loops and a switch in one jump
+static int break_to_helper(int stop) S_
+    int reached = -1;
+    int outer = 100;
+    defer(cleanup_c, outer);
+    S_LABEL(search)
+        int mid = 50;
+        defer(cleanup_b, mid);
+        for (int i = 0; i < 3; i++) S_
+            int x = i;
+            defer(cleanup_a, x);
+            for (int j = 0; j < 3; j++) S_
+                int y = i * 10 + j;
+                defer(cleanup_d, y);
+                switch (y) {
+                    case 11:
+                        if (stop) {
+                            reached = y;
+                            break_to(search);
+                        }
+                        break;
+                }
+            _S
+        _S
+    _S_LABEL(search)
+    return reached;
+_S
+
+void test_break_to() {
+    printf("\n=== Test 55: S_LABEL / break_to ===\n");
+    reset_log();
+    assert(break_to_helper(1) == 11);
+    // Both loops' defers, then the labelled scope's, then the function's
+    assert(cleanup_count == 9);
+    assert(strcmp(cleanup_log[5], "d:11") == 0);
+    assert(strcmp(cleanup_log[6], "a:1") == 0);
+    assert(strcmp(cleanup_log[7], "b:50") == 0);
+    assert(strcmp(cleanup_log[8], "c:100") == 0);
+    reset_log();
+    assert(break_to_helper(0) == -1);
+    assert(cleanup_count == 14);
+    assert(strcmp(cleanup_log[12], "b:50") == 0);
+    assert(strcmp(cleanup_log[13], "c:100") == 0);
+    printf("✓ Every scope up to the label cleaned up once\n");
+}
+
+// Test 56: lock scopes unlock on every exit
+static pthread_mutex_t lock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t lock_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t held_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int mutex_helper(int fail) S_
+    defer_lock(lock_mutex);
+    assert(pthread_mutex_trylock(&lock_mutex) != 0);
+    if (fail) {
+        returnerr -1;
+    }
+    return 0;
+_S
+
+static int rwlock_helper(bool write, int fail) S_
+    if (write) S_
+        defer_wrlock(lock_rwlock);
+        assert(pthread_rwlock_tryrdlock(&lock_rwlock) != 0);
+        if (fail) {
+            returnerr -1;
+        }
+    _S else S_
+        defer_rdlock(lock_rwlock);
+        assert(pthread_rwlock_trywrlock(&lock_rwlock) != 0);
+        if (fail) {
+            return -1;
+        }
+    _S
+    return 0;
+_S
+
+static int unlock_helper(int stop) S_
+    int taken = 0;
+    for (int i = 0; i < 4; i++) S_
+        pthread_mutex_lock(&held_mutex);
+        defer_unlock(held_mutex);
+        taken++;
+        if (i == stop) {
+            break;
+        }
+    _S
+    return taken;
+_S
+
+// A read hold taken by hand, released by defer_rwunlock
+static void rwunlock_helper(void) S_
+    pthread_rwlock_rdlock(&lock_rwlock);
+    defer_rwunlock(lock_rwlock);
+    assert(pthread_rwlock_trywrlock(&lock_rwlock) != 0);
+_S
+
+#if DEFER_SPINLOCKS_AVAILABLE
+static pthread_spinlock_t lock_spin;
+
+static int spin_helper(int fail) S_
+    defer_spin_lock(lock_spin);
+    assert(pthread_spin_trylock(&lock_spin) != 0);
+    if (fail) {
+        return -1;
+    }
+    return 0;
+_S
+#endif
+
+#ifdef DEFER_LOCK_PROFILE
+static pthread_mutex_t contended_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int contended_locked = 0;
+
+static void sleep_ms(long ms) {
+    struct timespec delay = { ms / 1000, (ms % 1000) * 1000000 };
+    nanosleep(&delay, NULL);
+}
+
+// Holds the lock long enough for the main thread to block on it
+static void* contended_owner(void* arg) {
+    pthread_mutex_lock(&contended_mutex);
+    __atomic_store_n(&contended_locked, 1, __ATOMIC_RELEASE);
+    sleep_ms(20);
+    pthread_mutex_unlock(&contended_mutex);
+    return arg;
+}
+
+static void contended_helper(void) S_
+    defer_lock(contended_mutex);
+_S
+
+static defer_lock_stats* find_lock_stats(defer_lock_stats* stats, size_t n, const char* lock,
+                                         const char* kind) {
+    for (size_t i = 0; i < n; i++) {
+        if (strcmp(stats[i].lock, lock) == 0 && strcmp(stats[i].kind, kind) == 0) {
+            return &stats[i];
+        }
+    }
+    return NULL;
+}
+#endif
+
+void test_defer_lock() {
+    printf("\n=== Test 56: defer_lock ===\n");
+    for (int fail = 0; fail < 2; fail++) {
+        assert(mutex_helper(fail) == -fail);
+        assert(pthread_mutex_trylock(&lock_mutex) == 0);
+        pthread_mutex_unlock(&lock_mutex);
+        for (int write = 0; write < 2; write++) {
+            assert(rwlock_helper(write, fail) == -fail);
+            assert(pthread_rwlock_trywrlock(&lock_rwlock) == 0);
+            pthread_rwlock_unlock(&lock_rwlock);
+        }
+    }
+    assert(unlock_helper(1) == 2);
+    assert(unlock_helper(9) == 4);
+    assert(pthread_mutex_trylock(&held_mutex) == 0);
+    pthread_mutex_unlock(&held_mutex);
+    rwunlock_helper();
+    assert(pthread_rwlock_trywrlock(&lock_rwlock) == 0);
+    pthread_rwlock_unlock(&lock_rwlock);
+#if DEFER_SPINLOCKS_AVAILABLE
+    pthread_spin_init(&lock_spin, PTHREAD_PROCESS_PRIVATE);
+    assert(spin_helper(0) == 0 && spin_helper(1) == -1);
+    assert(pthread_spin_trylock(&lock_spin) == 0);
+    pthread_spin_unlock(&lock_spin);
+    pthread_spin_destroy(&lock_spin);
+#endif
+    printf("✓ Locks released on return, returnerr and break\n");
+
+#ifdef DEFER_LOCK_PROFILE
+    pthread_t owner;
+    assert(pthread_create(&owner, NULL, contended_owner, NULL) == 0);
+    while (!__atomic_load_n(&contended_locked, __ATOMIC_ACQUIRE)) {
+        sleep_ms(1);
+    }
+    contended_helper();
+    pthread_join(owner, NULL);
+
+    defer_lock_stats stats[32];
+    size_t n = defer_lock_collect(stats, 32);
+    assert(n >= 5 && n <= 32);
+    defer_lock_stats* mutex = find_lock_stats(stats, n, "lock_mutex", "mutex");
+    assert(mutex && strstr(mutex->file, "test_defer.c"));
+    assert(mutex->acquired == 2 && mutex->holds == 2 && mutex->contended == 0);
+    assert(mutex->hold_max <= mutex->hold_cycles);
+    defer_lock_stats* wrlock = find_lock_stats(stats, n, "lock_rwlock", "wrlock");
+    assert(wrlock && wrlock->acquired == 2 && wrlock->holds == 2);
+    defer_lock_stats* rdlock = find_lock_stats(stats, n, "lock_rwlock", "rdlock");
+    assert(rdlock && rdlock->acquired == 2 && rdlock->holds == 2);
+    // defer_rwunlock's read hold is neither of those, whatever mode it was
+    defer_lock_stats* rwlock = find_lock_stats(stats, n, "lock_rwlock", "rwlock");
+    assert(rwlock && rwlock->acquired == 0 && rwlock->holds == 1);
+    // defer_unlock only times the hold, the lock was taken by hand
+    defer_lock_stats* held = find_lock_stats(stats, n, "held_mutex", "mutex");
+    assert(held && held->acquired == 0 && held->holds == 6);
+    defer_lock_stats* contended = find_lock_stats(stats, n, "contended_mutex", "mutex");
+    assert(contended && contended->acquired == 1 && contended->contended == 1);
+    assert(contended->wait_cycles > 0 && contended->holds == 1);
+    uint64_t waits = 0;
+    for (int b = 0; b < DEFER_LOCK_BUCKETS; b++) {
+        waits += contended->wait_hist[b];
+    }
+    assert(waits == 1);
+
+    // The report leads with the site that waited longest
+    FILE* out = tmpfile();
+    assert(out != NULL);
+    defer_lock_report(out);
+    rewind(out);
+    char line[1024];
+    assert(fgets(line, sizeof(line), out) && line[0] == '#');
+    assert(fgets(line, sizeof(line), out) && strstr(line, "\tcontended_mutex\tmutex\t"));
+    fclose(out);
+    printf("✓ Holds, contended waits and histograms counted per lock site\n");
+#else
+    printf("✓ Profile skipped (build with -DDEFER_LOCK_PROFILE)\n");
+#endif
+}
+
+// Test 57: batched close/unlink/munmap at scope exit
+static bool fd_open(int fd) {
+    return fcntl(fd, F_GETFD) != -1;
+}
+
+static bool mapped(void* addr, size_t len) {
+    return msync(addr, len, MS_ASYNC) == 0;
+}
+
+// Closes fds in stride order, so stride 1 is one close_range and any other
+// goes through the ring. The batch only has room for 4, the rest spill.
+static int io_helper(const int* fds, int n, int stride, char (*paths)[32], int npaths,
+                     char* map, size_t len, int fail) S_
+    iobatchdecl(4);
+    for (int i = 0; i < n; i++) {
+        defer_close(fds[(i * stride) % n]);
+    }
+    defer_close(-1);
+    for (int i = 0; i < npaths; i++) {
+        defer_unlink(paths[i]);
+    }
+    defer_unlink(NULL);
+    defer_munmap(map + len / 2, len / 2);
+    defer_munmap(map, len / 2);
+    defer_munmap(MAP_FAILED, len);
+    assert(fd_open(fds[0]) && fd_open(fds[n - 1]));
+    assert(access(paths[0], F_OK) == 0 && mapped(map, len));
+    if (fail) {
+        returnerr -1;
+    }
+    return 0;
+_S
+
+static int io_open(int* fds, int n, char (*paths)[32], int npaths, char** map, size_t len) {
+    for (int i = 0; i < n; i++) {
+        fds[i] = open("/dev/null", O_RDONLY);
+    }
+    for (int i = 0; i < npaths; i++) {
+        strcpy(paths[i], "/tmp/defer_io_XXXXXX");
+        int fd = mkstemp(paths[i]);
+        assert(fd >= 0);
+        close(fd);
+    }
+    // /dev/zero since MAP_ANONYMOUS isn't POSIX
+    int zero = open("/dev/zero", O_RDWR);
+    *map = (char*)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, zero, 0);
+    close(zero);
+    return *map != MAP_FAILED;
+}
+
+static bool io_released(const int* fds, int n, char (*paths)[32], int npaths, char* map, size_t len) {
+    bool released = !mapped(map, len);
+    for (int i = 0; i < n; i++) {
+        released = released && !fd_open(fds[i]);
+    }
+    for (int i = 0; i < npaths; i++) {
+        released = released && access(paths[i], F_OK) != 0;
+    }
+    return released;
+}
+
+void test_defer_io() {
+    printf("\n=== Test 57: defer_io ===\n");
+    int fds[16];
+    char paths[3][32];
+    char* map;
+    size_t len = 2 * (size_t)sysconf(_SC_PAGESIZE);
+    // The first batch sets up the thread's ring, whose fd and maps can take
+    // the numbers and addresses the batch just released, so it isn't checked
+    assert(io_open(fds, 16, paths, 3, &map, len));
+    assert(io_helper(fds, 16, 3, paths, 3, map, len, 0) == 0);
+    assert(access(paths[0], F_OK) != 0);
+    for (int fail = 0; fail < 2; fail++) {
+        for (int stride = 1; stride <= 5; stride += 4) {
+            assert(io_open(fds, 16, paths, 3, &map, len));
+            assert(io_helper(fds, 16, stride, paths, 3, map, len, fail) == -fail);
+            assert(io_released(fds, 16, paths, 3, map, len));
+        }
+    }
+    printf("✓ Closes, unlinks and munmaps run on return and returnerr, in runs and scattered\n");
+
+    defer_fast_exit();
+    for (int stride = 1; stride <= 5; stride += 4) {
+        assert(io_open(fds, 16, paths, 3, &map, len));
+        assert(io_helper(fds, 16, stride, paths, 3, map, len, 0) == 0);
+        assert(access(paths[0], F_OK) != 0 && access(paths[2], F_OK) != 0);
+        assert(!fd_open(fds[0]) && !fd_open(fds[15]) && mapped(map, len));
+        munmap(map, len);
+    }
+    _dfr_fast_exit_flag = 0;
+    printf("✓ Closes and unlinks still run after defer_fast_exit, munmaps don't\n");
+}
+
+// Test 58: pool objects go back to their owner's free list
+#ifdef __GNUC__
+typedef struct pooled {
+    int id;
+    char payload[60];
+} pooled;
+
+pooldef(test_pool, pooled);
+
+#define POOL_BATCH 8
+
+static pooled* pool_helper(int fail, pooled** seen) S_
+    pooled* obj = pool_acquire(test_pool);
+    assert(obj != NULL);
+    *seen = obj;
+    defer_pool_release(obj);
+    if (fail) {
+        returnerr NULL;
+    }
+    return obj;
+_S
+
+static pooled* pool_make(int fail) S_
+    pooled* obj = pool_acquire(test_pool);
+    errdefer_pool_release(obj);
+    obj->id = 7;
+    if (fail) {
+        returnerr NULL;
+    }
+    return obj;
+_S
+
+// Releases objects the main thread owns, and acquires some of its own that
+// the main thread releases after this thread is gone
+static void* pool_other(void* arg) {
+    pooled** objs = (pooled**)arg;
+    for (int i = 0; i < POOL_BATCH; i++) {
+        pool_release(objs[i]);
+        objs[i] = (pooled*)pool_acquire(test_pool);
+    }
+    // One comes back to this thread's own free list before it exits
+    pool_release(objs[0]);
+    objs[0] = NULL;
+    return NULL;
+}
+
+// Objects handed from a thread that exits right away to one that releases
+// them, before or after the owner is gone
+typedef struct pool_handoff {
+    pooled* objs[POOL_BATCH];
+    pthread_t releaser;
+} pool_handoff;
+
+static void* pool_releaser(void* arg) {
+    pool_handoff* handoff = (pool_handoff*)arg;
+    for (int i = 0; i < POOL_BATCH; i++) {
+        pool_release(handoff->objs[i]);
+    }
+    return NULL;
+}
+
+static void* pool_owner(void* arg) {
+    pool_handoff* handoff = (pool_handoff*)arg;
+    for (int i = 0; i < POOL_BATCH; i++) {
+        handoff->objs[i] = pool_acquire(test_pool);
+    }
+    assert(pthread_create(&handoff->releaser, NULL, pool_releaser, handoff) == 0);
+    return NULL;
+}
+
+static bool pool_contains(pooled** objs, int n, pooled* obj) {
+    bool found = false;
+    for (int i = 0; i < n; i++) {
+        found = found || objs[i] == obj;
+    }
+    return found;
+}
+#endif
+
+void test_defer_pool() {
+    printf("\n=== Test 58: defer_pool ===\n");
+#ifdef __GNUC__
+    pooled* seen = NULL;
+    for (int fail = 0; fail < 2; fail++) {
+        pooled* first = NULL;
+        pool_helper(fail, &first);
+        assert(pool_helper(fail, &seen) == (fail ? NULL : seen));
+        assert(seen == first);
+    }
+    pooled* kept = pool_make(0);
+    assert(kept && kept->id == 7 && kept == seen);
+    assert(pool_make(1) == NULL);
+    pooled* next = pool_acquire(test_pool);
+    assert(next != kept);
+    pool_release(next);
+    pool_release(kept);
+    pool_release(NULL);
+    printf("✓ Objects reused after return and returnerr, kept by errdefer on success\n");
+
+    pooled* objs[POOL_BATCH];
+    pooled* mine[POOL_BATCH];
+    for (int i = 0; i < POOL_BATCH; i++) {
+        objs[i] = mine[i] = pool_acquire(test_pool);
+    }
+    pthread_t other;
+    assert(pthread_create(&other, NULL, pool_other, objs) == 0);
+    pthread_join(other, NULL);
+    // The other thread released into this thread's queue, taken back once
+    // the free list is empty
+    pooled* back[POOL_BATCH + 2];
+    int returned = 0;
+    for (int i = 0; i < POOL_BATCH + 2; i++) {
+        back[i] = pool_acquire(test_pool);
+        returned += pool_contains(mine, POOL_BATCH, back[i]);
+    }
+    assert(returned == POOL_BATCH);
+    for (int i = 0; i < POOL_BATCH + 2; i++) {
+        pool_release(back[i]);
+    }
+    // Owned by a thread that has exited, freed here (ASan checks the rest)
+    for (int i = 1; i < POOL_BATCH; i++) {
+        assert(objs[i] && !pool_contains(mine, POOL_BATCH, objs[i]));
+        pool_release(objs[i]);
+    }
+    printf("✓ Releases on other threads go back to the owner, or are freed once it's gone\n");
+
+    // Neither thread is this one, and the owner can exit mid-release. Whoever
+    // comes last frees the owner's cache (LeakSanitizer checks it did).
+    for (int round = 0; round < 50; round++) {
+        pool_handoff handoff;
+        pthread_t owner;
+        assert(pthread_create(&owner, NULL, pool_owner, &handoff) == 0);
+        pthread_join(owner, NULL);
+        pthread_join(handoff.releaser, NULL);
+    }
+    printf("✓ Releases racing the owner's exit on a third thread\n");
+
+    pooled* skipped = NULL;
+    defer_fast_exit();
+    pool_helper(0, &skipped);
+    _dfr_fast_exit_flag = 0;
+    pooled* fresh = pool_acquire(test_pool);
+    assert(fresh != skipped);
+    pool_release(fresh);
+    pool_release(skipped);
+    pool_trim(test_pool);
+    printf("✓ Release skipped after defer_fast_exit, pool_trim frees the cache\n");
+#else
+    printf("✓ Skipped (defer_pool.h needs GCC or clang)\n");
+#endif
+}
+
+// Test 59: batched refcount drops and counter adds
+#ifdef __GNUC__
+typedef struct refd {
+    int refs;
+    int id;
+} refd;
+
+static int refd_destroyed = 0;
+static long long ref_stat = 0;
+
+static void refd_destroy(void* obj) {
+    refd_destroyed = refd_destroyed * 10 + ((refd*)obj)->id;
+}
+
+// Borrows a `times` times and b once, bumping the statistic each time, and
+// breaks out of the loop at `stop`
+static int ref_helper(refd* a, refd* b, int times, int stop, int fail) S_
+    int a_refs = a->refs;
+    int b_refs = b->refs;
+    refbatchdecl(2);
+    for (int i = 0; i < times; i++) S_
+        if (i == stop) {
+            break;
+        }
+        __atomic_add_fetch(&a->refs, 1, __ATOMIC_RELAXED);
+        defer_unref(&a->refs, refd_destroy, a);
+        defer_count(&ref_stat, 1);
+    _S
+    __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+    defer_unref(&b->refs, refd_destroy, b);
+    // One entry per counter, whatever the number of borrows
+    assert(_dfr_refbatch.len == (times && stop ? 3u : 1u));
+    assert(a->refs == a_refs + (stop < times ? stop : times) && b->refs == b_refs + 1);
+    if (fail) {
+        returnerr -1;
+    }
+    return 0;
+_S
+#endif
+
+void test_defer_ref() {
+    printf("\n=== Test 59: defer_unref / defer_count ===\n");
+#ifdef __GNUC__
+    refd a = { 1, 1 };
+    refd b = { 1, 2 };
+    for (int fail = 0; fail < 2; fail++) {
+        ref_stat = 0;
+        assert(ref_helper(&a, &b, 10, 99, fail) == -fail);
+        assert(a.refs == 1 && b.refs == 1 && ref_stat == 10);
+        assert(ref_helper(&a, &b, 10, 4, fail) == -fail);
+        assert(a.refs == 1 && b.refs == 1 && ref_stat == 14);
+    }
+    assert(ref_helper(&a, &b, 0, 0, 0) == 0);
+    assert(refd_destroyed == 0);
+    printf("✓ One update per counter on return, returnerr and break\n");
+
+    // Dropping the last references runs the destructors, newest first
+    a.refs = 0;
+    b.refs = 0;
+    assert(ref_helper(&a, &b, 3, 99, 0) == 0);
+    assert(a.refs == 0 && b.refs == 0 && refd_destroyed == 21);
+    printf("✓ Destructor runs once when the count reaches 0\n");
+#else
+    printf("✓ Skipped (defer_ref.h needs GCC or clang)\n");
+#endif
+}
+
+// Test 60: a cleanup that registers enough defers to grow the stack
+static int grow_count = 0;
+
+static void grow_inner(void* ptr) {
+    (void)ptr;
+    grow_count++;
+}
+
+// One defer per level, all still registered at the deepest one
+static void grow_levels(int n) S_
+    defer(grow_inner, n);
+    if (n > 1) {
+        grow_levels(n - 1);
+    }
+_S
+
+// Registers 400 defers, or with USE_TLS_DEFER enough to be sure the stack is
+// reallocated, and the record being run with it
+static void grow(void* ptr) {
+    int* val = (int*)ptr;
+    int levels = 400;
+#ifdef USE_TLS_DEFER
+    if (levels <= (int)_dfr_stack.cap) {
+        levels = (int)_dfr_stack.cap + 1;
+    }
+#endif
+    grow_count = 0;
+    grow_levels(levels);
+    assert(grow_count == levels);
+    log_cleanup("grow", *val);
+}
+
+void test_cleanup_grows_stack() {
+    printf("\n=== Test 60: Cleanup Growing the Stack ===\n");
+    reset_log();
+    grow_count = 0;
+
+    S_
+        int a = 61;
+        defer(cleanup_a, a);
+        int x = 60;
+        defer(grow, x);
+    _S
+
+    assert(grow_count >= 400);
+    assert(cleanup_count == 2);
+    assert(strcmp(cleanup_log[0], "grow:60") == 0);
+    assert(strcmp(cleanup_log[1], "a:61") == 0);
+    printf("✓ 400+ defers from inside a cleanup, then the rest of the scope\n");
+}
+
+// Test 61: scopes on threads that then exit. Run under LeakSanitizer, this is
+// also the check that USE_TLS_DEFER frees each thread's stack.
+static _dfr_thread_local int scope_thread_count;
+
+static void scope_thread_count_up(void* ptr) {
+    (void)ptr;
+    scope_thread_count++;
+}
+
+static void scope_thread_levels(int n) S_
+    defer(scope_thread_count_up, n);
+    if (n > 1) {
+        scope_thread_levels(n - 1);
+    }
+_S
+
+static void* scope_thread_worker(void* arg) {
+    scope_thread_levels(100);
+    *(int*)arg = scope_thread_count;
+    return NULL;
+}
+
+void test_thread_scopes() {
+    printf("\n=== Test 61: Scopes on Exiting Threads ===\n");
+#ifdef _DFR_THREAD_PTHREAD
+    pthread_t threads[4];
+    int counts[4] = { 0 };
+    for (int i = 0; i < 4; i++) {
+        assert(pthread_create(&threads[i], NULL, scope_thread_worker, &counts[i]) == 0);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        assert(counts[i] == 100);
+    }
+    printf("✓ 100 nested scopes on each of 4 threads\n");
+#else
+    printf("✓ Skipped (no pthreads)\n");
+#endif
+}
+
 int main() {
     RUN_TEST(test_basic_defer);
     RUN_TEST(test_nested_scopes);
@@ -1480,6 +2867,25 @@ int main() {
     RUN_TEST(test_duffs_device);
     RUN_TEST(test_pathological_nesting);
     RUN_TEST(test_switch_fallthrough_to_loop);
+    RUN_TEST(test_typed_defer);
+    RUN_TEST(test_defer_blocks);
+    RUN_TEST(test_arena);
+    RUN_TEST(test_scratch);
+    RUN_TEST(test_defer_each);
+    RUN_TEST(test_defer_free_each);
+    RUN_TEST(test_profile);
+    RUN_TEST(test_trace);
+    RUN_TEST(test_coro);
+    RUN_TEST(test_defer_thread);
+    RUN_TEST(test_fast_exit);
+    RUN_TEST(test_longjmp);
+    RUN_TEST(test_break_to);
+    RUN_TEST(test_defer_lock);
+    RUN_TEST(test_defer_io);
+    RUN_TEST(test_defer_pool);
+    RUN_TEST(test_defer_ref);
+    RUN_TEST(test_cleanup_grows_stack);
+    RUN_TEST(test_thread_scopes);
 
     int fails = 0;
     for (int i = 0; i < __test_count; i++) if (__test_results[i]) fails++;
@@ -1487,8 +2893,8 @@ int main() {
     if (fails) {
         printf("\n━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━\n");
         printf("  defer.h Tests (%s, macro_stack: %s)\n", \
-            USING_GNUC_DEFER ? "gnu11+" : "c99+", \
-            USING_MACRO_STACK ? "enabled" : "disabled");
+            USING_GNUC_DEFER ? "gnu11+" : USING_TLS_DEFER ? "c99+ tls stack" : "c99+", \
+            USING_SCOPE_ENUM ? "scope enum" : USING_MACRO_STACK ? "enabled" : "disabled");
         printf("━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━\n");
         printf("  ✗ %d/%d failed\n\n", fails, __test_count);
         printf("Failures:\n");
@@ -1502,8 +2908,8 @@ int main() {
         printf("━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━\n");
         printf("  defer.h: ✓ %d tests passed (%s, macro_stack: %s)\n", \
              __test_count, \
-             USING_GNUC_DEFER ? "gnu11+" : "c99+", \
-             USING_MACRO_STACK ? "enabled" : "disabled");
+             USING_GNUC_DEFER ? "gnu11+" : USING_TLS_DEFER ? "c99+ tls stack" : "c99+", \
+             USING_SCOPE_ENUM ? "scope enum" : USING_MACRO_STACK ? "enabled" : "disabled");
         printf("━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━\n");
     }
 
@@ -0,0 +1,446 @@
+// Tests for defer.hpp, the C++ companion of defer.h. The first tests are the
+// C suite's control flow cases written against the guards, the rest cover
+// what only C++ has: exceptions, lambdas and move-only values.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+#include <fcntl.h>
+#include "defer.hpp"
+
+// Test harness: non-aborting assert and lightweight runner
+static int __test_total_asserts = 0;
+static int __test_failed_asserts = 0;
+static char __last_assert_msg[256] = {0};
+
+#undef assert
+#define assert(cond) do { \
+    __test_total_asserts++; \
+    if (!(cond)) { \
+        __test_failed_asserts++; \
+        snprintf(__last_assert_msg, sizeof(__last_assert_msg), "%s:%d: %s", __FILE__, __LINE__, #cond); \
+    } \
+} while (0)
+
+/* Runner storage */
+#define MAX_TESTS 64
+static const char* __test_names[MAX_TESTS];
+static int __test_results[MAX_TESTS]; /* 0 = pass, 1 = fail */
+static char __test_msgs[MAX_TESTS][256];
+static int __test_count = 0;
+
+#ifndef TEST_VERBOSITY
+#define TEST_VERBOSITY 0
+#endif
+
+/* Verbosity: when 0, suppress stdout produced by tests while they run. */
+static int __test_verbosity = TEST_VERBOSITY;
+
+#define RUN_TEST(fn) do { \
+    int __before = __test_failed_asserts; \
+    __last_assert_msg[0] = '\0'; \
+    int __saved_stdout = -1; \
+    if (!__test_verbosity) { \
+        fflush(stdout); \
+        __saved_stdout = dup(fileno(stdout)); \
+        int __devnull = open("/dev/null", O_WRONLY); \
+        if (__devnull != -1) { dup2(__devnull, fileno(stdout)); close(__devnull); } \
+    } \
+    fn(); \
+    if (!__test_verbosity && __saved_stdout != -1) { \
+        fflush(stdout); \
+        dup2(__saved_stdout, fileno(stdout)); \
+        close(__saved_stdout); \
+    } \
+    int __after = __test_failed_asserts; \
+    __test_names[__test_count] = #fn; \
+    __test_results[__test_count] = (__after > __before) ? 1 : 0; \
+    if (__after > __before) { strncpy(__test_msgs[__test_count], __last_assert_msg, sizeof(__test_msgs[0]) - 1); __test_msgs[__test_count][sizeof(__test_msgs[0]) - 1] = '\0'; } else { __test_msgs[__test_count][0] = '\0'; } \
+    __test_count++; \
+} while (0)
+
+
+// Global state for tracking cleanup order and calls
+#define MAX_CLEANUPS 20
+char cleanup_log[MAX_CLEANUPS][32];
+int cleanup_count = 0;
+
+void reset_log() {
+    cleanup_count = 0;
+    memset(cleanup_log, 0, sizeof(cleanup_log));
+}
+
+void log_cleanup(const char* name, int value) {
+    snprintf(cleanup_log[cleanup_count++], 32, "%s:%d", name, value);
+}
+
+// Cleanup functions for testing, with the same void* signature as in C
+void cleanup_a(void* ptr) {
+    int* val = (int*)ptr;
+    log_cleanup("a", *val);
+}
+
+void cleanup_b(void* ptr) {
+    int* val = (int*)ptr;
+    log_cleanup("b", *val);
+}
+
+void cleanup_c(void* ptr) {
+    int* val = (int*)ptr;
+    log_cleanup("c", *val);
+}
+
+void cleanup_d(void* ptr) {
+    int* val = (int*)ptr;
+    log_cleanup("d", *val);
+}
+
+// Test 1: Basic defer in single scope
+void test_basic_defer() {
+    printf("\n=== Test 1: Basic defer in single scope ===\n");
+    reset_log();
+
+    S_
+        int a = 1;
+        defer(cleanup_a, a);
+        int b = 2;
+        defer(cleanup_b, b);
+    _S
+
+    assert(cleanup_count == 2);
+    assert(strcmp(cleanup_log[0], "b:2") == 0);
+    assert(strcmp(cleanup_log[1], "a:1") == 0);
+    printf("✓ Cleanups ran in reverse order\n");
+}
+
+// Test 2: Return through nested scopes
+int nested_return_helper() S_
+    int a = 10;
+    defer(cleanup_a, a);
+    S_
+        int b = 20;
+        defer(cleanup_b, b);
+        S_
+            int c = 30;
+            defer(cleanup_c, c);
+            return 42;
+        _S
+    _S
+    return 0;
+_S
+
+void test_nested_return() {
+    printf("\n=== Test 2: Return through nested scopes ===\n");
+    reset_log();
+    assert(nested_return_helper() == 42);
+    assert(cleanup_count == 3);
+    assert(strcmp(cleanup_log[0], "c:30") == 0);
+    assert(strcmp(cleanup_log[2], "a:10") == 0);
+    printf("✓ Return triggered all scope cleanups\n");
+}
+
+// Test 3: errdefer only runs on returnerr, in registration order with defers
+int mixed_helper(int fail) S_
+    int a = 1;
+    defer(cleanup_a, a);
+    int b = 2;
+    errdefer(cleanup_b, b);
+    int c = 3;
+    defer(cleanup_c, c);
+    int d = 4;
+    errdefer(cleanup_d, d);
+    if (fail) {
+        returnerr -1;
+    }
+    return 0;
+_S
+
+void test_errdefer() {
+    printf("\n=== Test 3: errdefer and returnerr ===\n");
+    reset_log();
+    assert(mixed_helper(0) == 0);
+    assert(cleanup_count == 2);
+    assert(strcmp(cleanup_log[0], "c:3") == 0);
+    assert(strcmp(cleanup_log[1], "a:1") == 0);
+
+    reset_log();
+    assert(mixed_helper(1) == -1);
+    assert(cleanup_count == 4);
+    assert(strcmp(cleanup_log[0], "d:4") == 0);
+    assert(strcmp(cleanup_log[1], "c:3") == 0);
+    assert(strcmp(cleanup_log[2], "b:2") == 0);
+    assert(strcmp(cleanup_log[3], "a:1") == 0);
+    printf("✓ errdefers ran only on returnerr\n");
+}
+
+// Test 4: break and continue run the loop body's defers
+void test_break_continue() {
+    printf("\n=== Test 4: break and continue ===\n");
+    reset_log();
+    int outer = 0;
+    S_
+        defer(cleanup_a, outer);
+        for (int i = 0; i < 5; i++) S_
+            int x = i;
+            defer(cleanup_b, x);
+            if (i == 3) {
+                break;
+            }
+            if (i & 1) {
+                continue;
+            }
+            outer += 10;
+        _S
+    _S
+    assert(cleanup_count == 5);
+    assert(strcmp(cleanup_log[0], "b:0") == 0);
+    assert(strcmp(cleanup_log[3], "b:3") == 0);
+    assert(strcmp(cleanup_log[4], "a:20") == 0);
+    printf("✓ Loop bodies cleaned up on break and continue\n");
+}
+
+// Test 5: Switch with fallthrough and defers in cases
+void test_switch() {
+    printf("\n=== Test 5: switch ===\n");
+    reset_log();
+    for (int n = 0; n < 3; n++) S_
+        switch (n) {
+        case 0: S_
+            int a = 0;
+            defer(cleanup_a, a);
+            break;
+        _S
+        case 1: {
+            int b = 1;
+            defer(cleanup_b, b);
+        }
+            [[fallthrough]];
+        default: S_
+            int c = n;
+            defer(cleanup_c, c);
+        _S
+        }
+    _S
+    assert(cleanup_count == 4);
+    assert(strcmp(cleanup_log[0], "a:0") == 0);
+    assert(strcmp(cleanup_log[1], "b:1") == 0);
+    assert(strcmp(cleanup_log[2], "c:1") == 0);
+    assert(strcmp(cleanup_log[3], "c:2") == 0);
+    printf("✓ Switch cases cleaned up\n");
+}
+
+// Test 6: Recursion, one defer per level
+void recurse(int n) S_
+    int x = n;
+    defer(cleanup_a, x);
+    if (n > 0) {
+        recurse(n - 1);
+    }
+_S
+
+void test_recursion() {
+    printf("\n=== Test 6: Recursion ===\n");
+    reset_log();
+    recurse(4);
+    assert(cleanup_count == 5);
+    assert(strcmp(cleanup_log[0], "a:0") == 0);
+    assert(strcmp(cleanup_log[4], "a:4") == 0);
+    printf("✓ Each level cleaned up innermost first\n");
+}
+
+// Test 7: Values are captured by reference
+void test_value_changes() {
+    printf("\n=== Test 7: Value changes ===\n");
+    reset_log();
+    S_
+        int a = 1;
+        defer(cleanup_a, a);
+        a = 99;
+    _S
+    assert(cleanup_count == 1);
+    assert(strcmp(cleanup_log[0], "a:99") == 0);
+    printf("✓ Cleanup saw the final value\n");
+}
+
+// Test 8: cleanupdecl, typed defers and cleanup blocks
+void free_int(void* ptr) {
+    int** p = (int**)ptr;
+    log_cleanup("free", **p);
+    free(*p);
+}
+
+void log_typed(int value) {
+    log_cleanup("t", value);
+}
+DEFER_TYPED(log_typed, int);
+
+int typed_helper(int fail) S_
+    int* cleanupdecl(p, (int*)malloc(sizeof(int)), free_int);
+    *p = 5;
+    int a = 1;
+    tdefer(log_typed, a);
+    int b = 2;
+    terrdefer(log_typed, b);
+    deferblock(log_cleanup("blk", a);)
+    errdeferblock({ log_cleanup("errblk", b); })
+    a = 10;
+    if (fail) {
+        returnerr -1;
+    }
+    return 0;
+_S
+
+void test_typed_and_blocks() {
+    printf("\n=== Test 8: cleanupdecl, tdefer, deferblock ===\n");
+    reset_log();
+    assert(typed_helper(0) == 0);
+    assert(cleanup_count == 3);
+    assert(strcmp(cleanup_log[0], "blk:10") == 0);
+    assert(strcmp(cleanup_log[1], "t:10") == 0);
+    assert(strcmp(cleanup_log[2], "free:5") == 0);
+
+    reset_log();
+    assert(typed_helper(1) == -1);
+    assert(cleanup_count == 5);
+    assert(strcmp(cleanup_log[0], "errblk:2") == 0);
+    assert(strcmp(cleanup_log[1], "blk:10") == 0);
+    assert(strcmp(cleanup_log[2], "t:2") == 0);
+    printf("✓ Typed defers and blocks behave like defer/errdefer\n");
+}
+
+// Test 9: Array cleanups
+void test_defer_each() {
+    printf("\n=== Test 9: defer_each / errdefer_each ===\n");
+    reset_log();
+    S_
+        int values[3] = { 1, 2, 3 };
+        defer_each(cleanup_a, values, 3);
+        int errs[2] = { 7, 8 };
+        errdefer_each(cleanup_b, errs, 2);
+    _S
+    assert(cleanup_count == 3);
+    assert(strcmp(cleanup_log[0], "a:3") == 0);
+    assert(strcmp(cleanup_log[2], "a:1") == 0);
+    printf("✓ One cleanup per element, last first\n");
+}
+
+// Test 10: An exception runs defers and errdefers
+int throwing_helper(int fail) S_
+    int a = 1;
+    defer(cleanup_a, a);
+    int b = 2;
+    errdefer(cleanup_b, b);
+    if (fail) {
+        throw std::runtime_error("fail");
+    }
+    return 0;
+_S
+
+void test_exception_unwind() {
+    printf("\n=== Test 10: Exception unwind ===\n");
+    reset_log();
+    bool caught = false;
+    try {
+        throwing_helper(1);
+    } catch (const std::runtime_error&) {
+        caught = true;
+    }
+    assert(caught);
+    assert(cleanup_count == 2);
+    assert(strcmp(cleanup_log[0], "b:2") == 0);
+    assert(strcmp(cleanup_log[1], "a:1") == 0);
+
+    reset_log();
+    assert(throwing_helper(0) == 0);
+    assert(cleanup_count == 1);
+    printf("✓ errdefer fired on the exception, not on success\n");
+}
+
+// Test 11: A scope that succeeds while another exception unwinds
+struct unwinder {
+    ~unwinder() {
+        S_
+            int c = 3;
+            errdefer(cleanup_c, c);
+            int d = 4;
+            defer(cleanup_d, d);
+        _S
+    }
+};
+
+void test_success_during_unwind() {
+    printf("\n=== Test 11: Success during an unrelated unwind ===\n");
+    reset_log();
+    try {
+        unwinder u;
+        throw 1;
+    } catch (int) {
+    }
+    // The destructor's scope exited normally: only its defer ran
+    assert(cleanup_count == 1);
+    assert(strcmp(cleanup_log[0], "d:4") == 0);
+    printf("✓ errdefer compares against the exceptions in flight at registration\n");
+}
+
+// Test 12: Lambdas, member access and move-only state
+struct counter {
+    int hits = 0;
+};
+
+void bump(void* ptr) {
+    ((counter*)ptr)->hits++;
+}
+
+void test_lambdas() {
+    printf("\n=== Test 12: Inside lambdas ===\n");
+    counter total;
+    auto body = [&](int n) S_
+        defer(bump, total);
+        if (n > 1) {
+            returnerr n;
+        }
+        return 0;
+    _S;
+    assert(body(1) == 0);
+    assert(body(2) == 2);
+    assert(total.hits == 2);
+    printf("✓ Scopes work inside lambdas\n");
+}
+
+int main() {
+    RUN_TEST(test_basic_defer);
+    RUN_TEST(test_nested_return);
+    RUN_TEST(test_errdefer);
+    RUN_TEST(test_break_continue);
+    RUN_TEST(test_switch);
+    RUN_TEST(test_recursion);
+    RUN_TEST(test_value_changes);
+    RUN_TEST(test_typed_and_blocks);
+    RUN_TEST(test_defer_each);
+    RUN_TEST(test_exception_unwind);
+    RUN_TEST(test_success_during_unwind);
+    RUN_TEST(test_lambdas);
+
+    int fails = 0;
+    for (int i = 0; i < __test_count; i++) if (__test_results[i]) fails++;
+
+    if (fails) {
+        printf("\n━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━\n");
+        printf("  defer.hpp Tests (c++%ld)\n", (long)(__cplusplus / 100 % 100));
+        printf("━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━\n");
+        printf("  ✗ %d/%d failed\n\n", fails, __test_count);
+        printf("Failures:\n");
+        for (int i = 0; i < __test_count; i++) {
+            if (__test_results[i]) {
+                printf("  - %s\n    %s\n", __test_names[i], __test_msgs[i]);
+            }
+        }
+        printf("━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━\n");
+    } else {
+        printf("━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━\n");
+        printf("  defer.hpp: ✓ %d tests passed (c++%ld)\n", __test_count, (long)(__cplusplus / 100 % 100));
+        printf("━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━\n");
+    }
+    return fails ? 1 : 0;
+}